@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+#
+# Copyright 2021 WebAssembly Community Group participants
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Times --explicit-bounds-checks against the default memory accesses.
+
+The same module is built with and without --explicit-bounds-checks, and
+each case is timed in both: sequential loads of several widths, loads with
+constant offsets, stores, and a pointer chase whose addresses come from
+memory.
+"""
+
+import os
+import sys
+
+sys.path.append(os.path.dirname(os.path.abspath(__file__)))
+
+import benchmark_util  # noqa: E402
+
+# Each export runs its loop over the first 64KiB $n times.
+MODULE = '''
+(module
+  (memory 2)
+  (func (export "load8") (param $n i32) (result i32)
+    (local $i i32) (local $sum i32)
+    (loop $outer
+      (local.set $i (i32.const 0))
+      (loop $inner
+        (local.set $sum
+          (i32.add (local.get $sum) (i32.load8_u (local.get $i))))
+        (br_if $inner (i32.ne (local.tee $i (i32.add (local.get $i)
+                                                     (i32.const 1)))
+                              (i32.const 65536))))
+      (br_if $outer (local.tee $n (i32.sub (local.get $n) (i32.const 1)))))
+    (local.get $sum))
+  (func (export "load32") (param $n i32) (result i32)
+    (local $i i32) (local $sum i32)
+    (loop $outer
+      (local.set $i (i32.const 0))
+      (loop $inner
+        (local.set $sum
+          (i32.add (local.get $sum) (i32.load (local.get $i))))
+        (br_if $inner (i32.ne (local.tee $i (i32.add (local.get $i)
+                                                     (i32.const 4)))
+                              (i32.const 65536))))
+      (br_if $outer (local.tee $n (i32.sub (local.get $n) (i32.const 1)))))
+    (local.get $sum))
+  (func (export "load64") (param $n i32) (result i32)
+    (local $i i32) (local $sum i64)
+    (loop $outer
+      (local.set $i (i32.const 0))
+      (loop $inner
+        (local.set $sum
+          (i64.add (local.get $sum) (i64.load (local.get $i))))
+        (br_if $inner (i32.ne (local.tee $i (i32.add (local.get $i)
+                                                     (i32.const 8)))
+                              (i32.const 65536))))
+      (br_if $outer (local.tee $n (i32.sub (local.get $n) (i32.const 1)))))
+    (i32.wrap_i64 (local.get $sum)))
+  (func (export "offset") (param $n i32) (result i32)
+    (local $i i32) (local $sum i32)
+    (loop $outer
+      (local.set $i (i32.const 0))
+      (loop $inner
+        (local.set $sum
+          (i32.add (local.get $sum)
+                   (i32.add (i32.load offset=4 (local.get $i))
+                            (i32.load offset=60000 (local.get $i)))))
+        (br_if $inner (i32.ne (local.tee $i (i32.add (local.get $i)
+                                                     (i32.const 4)))
+                              (i32.const 65536))))
+      (br_if $outer (local.tee $n (i32.sub (local.get $n) (i32.const 1)))))
+    (local.get $sum))
+  (func (export "store32") (param $n i32) (result i32)
+    (local $i i32)
+    (loop $outer
+      (local.set $i (i32.const 0))
+      (loop $inner
+        (i32.store (local.get $i) (local.get $n))
+        (br_if $inner (i32.ne (local.tee $i (i32.add (local.get $i)
+                                                     (i32.const 4)))
+                              (i32.const 65536))))
+      (br_if $outer (local.tee $n (i32.sub (local.get $n) (i32.const 1)))))
+    (i32.load (i32.const 0)))
+  (func (export "gather") (param $n i32) (result i32)
+    ;; Each address comes from the previous load.
+    (local $i i32) (local $p i32) (local $sum i32)
+    (loop $init
+      (i32.store (local.get $i)
+                 (i32.and (i32.mul (local.get $i) (i32.const 2654435761))
+                          (i32.const 0xfffc)))
+      (br_if $init (i32.ne (local.tee $i (i32.add (local.get $i)
+                                                  (i32.const 4)))
+                           (i32.const 65536))))
+    (loop $outer
+      (local.set $i (i32.const 16384))
+      (loop $inner
+        (local.set $p (i32.load (local.get $p)))
+        (local.set $sum (i32.add (local.get $sum) (local.get $p)))
+        (br_if $inner (local.tee $i (i32.sub (local.get $i) (i32.const 1)))))
+      (br_if $outer (local.tee $n (i32.sub (local.get $n) (i32.const 1)))))
+    (local.get $sum)))
+'''
+
+# name, export, argument.
+CASES = [
+    ('load8', 'load8', 5000),
+    ('load32', 'load32', 20000),
+    ('load64', 'load64', 40000),
+    ('offset', 'offset', 10000),
+    ('store32', 'store32', 20000),
+    ('gather', 'gather', 20000),
+]
+
+
+def main(args):
+    return benchmark_util.Compare(args, __doc__, MODULE, CASES,
+                                  ('Plain', 'default', []),
+                                  ('Checked', 'explicit',
+                                   ['--explicit-bounds-checks']))
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+#
+# Copyright 2021 WebAssembly Community Group participants
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Times memory.copy and memory.fill in code generated by wasm2kotlin.
+
+Each case runs the instruction in a wasm loop, for small, medium and
+multi-MB lengths, with copies both overlapping backward and forward.
+"""
+
+import os
+import sys
+
+sys.path.append(os.path.dirname(os.path.abspath(__file__)))
+
+import benchmark_util  # noqa: E402
+
+MODULE = '''
+(module
+  (memory 160 160)
+  (func (export "copy") (param $dst i32) (param $src i32) (param $len i32)
+                        (param $n i32)
+    (loop $l
+      (memory.copy (local.get $dst) (local.get $src) (local.get $len))
+      (br_if $l (local.tee $n (i32.sub (local.get $n) (i32.const 1))))))
+  (func (export "fill") (param $dst i32) (param $val i32) (param $len i32)
+                        (param $n i32)
+    (loop $l
+      (memory.fill (local.get $dst) (local.get $val) (local.get $len))
+      (br_if $l (local.tee $n (i32.sub (local.get $n) (i32.const 1)))))))
+'''
+
+# name, export, dst, src or value, length, iterations.
+CASES = [
+    ('copy 16B', 'copy', 0, 64, 16, 2000000),
+    ('copy 4KiB', 'copy', 0, 8192, 4096, 200000),
+    ('copy 4KiB overlap fwd', 'copy', 16, 0, 4096, 200000),
+    ('copy 4KiB overlap back', 'copy', 0, 16, 4096, 200000),
+    ('copy 4MiB', 'copy', 0, 4 << 20, 4 << 20, 200),
+    ('copy 4MiB overlap fwd', 'copy', 4096, 0, 4 << 20, 200),
+    ('fill 16B', 'fill', 0, 0x55, 16, 2000000),
+    ('fill 4KiB', 'fill', 0, 0x55, 4096, 200000),
+    ('fill 4MiB', 'fill', 0, 0x55, 4 << 20, 200),
+]
+
+MAIN = '''
+typealias Bench = (Int, Int, Int, Int) -> Unit
+
+class Registry(val direct: Boolean) : wasm_rt_impl.ModuleRegistry() {
+    override fun memoryBackend(modname: String, index: Int): wasm_rt_impl.MemoryBackend =
+        if (direct) wasm_rt_impl.DirectMemoryBackend else wasm_rt_impl.HeapMemoryBackend
+}
+
+fun main(args: Array<String>) {
+    val registry = Registry(args.isNotEmpty() && args[0] == "direct")
+    BulkMemory(registry, "bench")
+    val funcs = mapOf(
+        "copy" to registry.importFunc<Bench, Unit>("bench", "Z_copy"),
+        "fill" to registry.importFunc<Bench, Unit>("bench", "Z_fill"))
+    for (case in CASES) {
+        val func = funcs[case.export]!!
+        // once to warm up, then the best of a few runs.
+        func(case.dst, case.src, case.len, case.n)
+        var best = Long.MAX_VALUE
+        for (run in 0..<%(runs)d) {
+            val start = System.nanoTime()
+            func(case.dst, case.src, case.len, case.n)
+            best = minOf(best, System.nanoTime() - start)
+        }
+        val bytes = case.len.toDouble() * case.n
+        println("%%-24s %%10.3f ms %%10.2f GB/s".format(case.name, best / 1e6, bytes / best))
+    }
+}
+
+class Case(val name: String, val export: String, val dst: Int, val src: Int, val len: Int, val n: Int)
+
+val CASES = listOf(
+%(cases)s
+)
+'''
+
+
+def main(args):
+    parser = benchmark_util.ArgumentParser(__doc__)
+    parser.add_argument('--direct', action='store_true',
+                        help='keep the memory off-heap.')
+    options = parser.parse_args(args)
+
+    cases = ',\n'.join('    Case("%s", "%s", %d, %d, %d, %d)' % case
+                       for case in CASES)
+    main = MAIN % {'runs': options.runs, 'cases': cases}
+    run_args = ['direct'] if options.direct else []
+    benchmark_util.Run(options, MODULE, [('BulkMemory', [])], main,
+                       run_args=run_args)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
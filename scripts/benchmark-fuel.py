@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+#
+# Copyright 2021 WebAssembly Community Group participants
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Times the cost of --fuel in code generated by wasm2kotlin.
+
+The same module is built with and without --fuel, and each case is timed
+in both, for a tight loop, a loop over memory and recursive calls.
+"""
+
+import os
+import sys
+
+sys.path.append(os.path.dirname(os.path.abspath(__file__)))
+
+import benchmark_util  # noqa: E402
+
+MODULE = '''
+(module
+  (memory 1)
+  (func (export "count") (param $n i32) (result i32)
+    (local $sum i32)
+    (loop $l
+      (local.set $sum (i32.add (local.get $sum) (local.get $n)))
+      (br_if $l (local.tee $n (i32.sub (local.get $n) (i32.const 1)))))
+    (local.get $sum))
+  (func (export "scan") (param $n i32) (result i32)
+    (local $i i32) (local $sum i32)
+    (loop $outer
+      (local.set $i (i32.const 0))
+      (loop $inner
+        (local.set $sum
+          (i32.add (local.get $sum) (i32.load (local.get $i))))
+        (br_if $inner (i32.ne (local.tee $i (i32.add (local.get $i)
+                                                     (i32.const 4)))
+                              (i32.const 65536))))
+      (br_if $outer (local.tee $n (i32.sub (local.get $n) (i32.const 1)))))
+    (local.get $sum))
+  (func $fib (export "fib") (param i32) (result i32)
+    (if (result i32) (i32.lt_u (local.get 0) (i32.const 2))
+      (then (local.get 0))
+      (else
+        (i32.add
+          (call $fib (i32.sub (local.get 0) (i32.const 1)))
+          (call $fib (i32.sub (local.get 0) (i32.const 2))))))))
+'''
+
+# name, export, argument.
+CASES = [
+    ('loop', 'count', 200000000),
+    ('memory loop', 'scan', 5000),
+    ('calls', 'fib', 32),
+]
+
+
+def main(args):
+    return benchmark_util.Compare(args, __doc__, MODULE, CASES,
+                                  ('Plain', 'plain', []),
+                                  ('Fueled', '--fuel', ['--fuel']))
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
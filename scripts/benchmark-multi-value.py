@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+#
+# Copyright 2021 WebAssembly Community Group participants
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Times --multi-value-fields against the default lambda ABI.
+
+The same module is built with and without --multi-value-fields, and each
+case is timed in both. Each case calls a multi-value function in a wasm
+loop: a 128-bit add on i64 pairs, an i32 divmod pair, and a three-value
+tuple of mixed types.
+"""
+
+import os
+import sys
+
+sys.path.append(os.path.dirname(os.path.abspath(__file__)))
+
+import benchmark_util  # noqa: E402
+
+MODULE = '''
+(module
+  (func $add128 (param $alo i64) (param $ahi i64) (param $blo i64)
+                (param $bhi i64) (result i64 i64)
+    (local $lo i64)
+    (local.tee $lo (i64.add (local.get $alo) (local.get $blo)))
+    (i64.add (i64.add (local.get $ahi) (local.get $bhi))
+             (i64.extend_i32_u (i64.lt_u (local.get $lo) (local.get $alo)))))
+  (func $divmod (param $a i32) (param $b i32) (result i32 i32)
+    (i32.div_u (local.get $a) (local.get $b))
+    (i32.rem_u (local.get $a) (local.get $b)))
+  (func $triple (param $x i32) (result f64 i32 i64)
+    (f64.convert_i32_s (local.get $x))
+    (i32.xor (local.get $x) (i32.const 0x5555))
+    (i64.extend_i32_s (local.get $x)))
+  (func (export "add128") (param $n i32) (result i64)
+    (local $lo i64) (local $hi i64)
+    (loop $l
+      (call $add128 (local.get $lo) (local.get $hi)
+                    (i64.const 0x7fffffffffffffff)
+                    (i64.extend_i32_u (local.get $n)))
+      (local.set $hi)
+      (local.set $lo)
+      (br_if $l (local.tee $n (i32.sub (local.get $n) (i32.const 1)))))
+    (i64.xor (local.get $lo) (local.get $hi)))
+  (func (export "divmod") (param $n i32) (result i64)
+    (local $sum i32)
+    (loop $l
+      (call $divmod (local.get $n) (i32.const 7))
+      (local.set $sum (i32.add (local.get $sum)))
+      (local.set $sum (i32.add (local.get $sum)))
+      (br_if $l (local.tee $n (i32.sub (local.get $n) (i32.const 1)))))
+    (i64.extend_i32_u (local.get $sum)))
+  (func (export "triple") (param $n i32) (result i64)
+    (local $sum i64)
+    (loop $l
+      (call $triple (local.get $n))
+      (local.set $sum (i64.add (local.get $sum)))
+      i64.extend_i32_u
+      (local.set $sum (i64.add (local.get $sum)))
+      i64.trunc_f64_s
+      (local.set $sum (i64.add (local.get $sum)))
+      (br_if $l (local.tee $n (i32.sub (local.get $n) (i32.const 1)))))
+    (local.get $sum)))
+'''
+
+# name, export, argument.
+CASES = [
+    ('add128', 'add128', 100000000),
+    ('divmod', 'divmod', 100000000),
+    ('triple', 'triple', 100000000),
+]
+
+
+def main(args):
+    return benchmark_util.Compare(args, __doc__, MODULE, CASES,
+                                  ('Lambdas', 'lambdas', []),
+                                  ('Fields', 'fields',
+                                   ['--multi-value-fields']),
+                                  result='Long')
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
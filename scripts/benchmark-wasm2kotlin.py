@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+#
+# Copyright 2021 WebAssembly Community Group participants
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Times wasm2kotlin on a generated module.
+
+With --module=data, the module has one memory and as many active data
+segments of random bytes as it takes to reach --data-size, so the time is
+mostly spent writing data.
+
+With --module=calls, the module has --globals mutable globals and a function
+that adds them up with a call between each read, so the time is mostly spent
+tracking what the calls may change.
+"""
+
+import argparse
+import os
+import random
+import subprocess
+import sys
+import tempfile
+import time
+
+SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
+REPO_ROOT_DIR = os.path.dirname(SCRIPT_DIR)
+sys.path.append(os.path.join(REPO_ROOT_DIR, 'test'))
+
+import find_exe  # noqa: E402
+
+
+def Leb128(value):
+    result = bytearray()
+    while True:
+        byte = value & 0x7f
+        value >>= 7
+        if value:
+            result.append(byte | 0x80)
+        else:
+            result.append(byte)
+            return bytes(result)
+
+
+def Section(section_id, contents):
+    return bytes([section_id]) + Leb128(len(contents)) + contents
+
+
+def DataHeavyModule(data_size, segment_size):
+    rng = random.Random(0)
+    num_segments = (data_size + segment_size - 1) // segment_size
+    pages = (num_segments * segment_size + 0xffff) // 0x10000
+    segments = bytearray()
+    for i in range(num_segments):
+        size = min(segment_size, data_size - i * segment_size)
+        offset = i * segment_size
+        # Active segment for memory 0 at i32.const offset.
+        segments += b'\x00\x41' + Leb128(offset) + b'\x0b'
+        segments += Leb128(size) + rng.randbytes(size)
+    memory = Leb128(1) + b'\x00' + Leb128(pages)
+    return (b'\x00asm\x01\x00\x00\x00' + Section(5, memory) +
+            Section(11, Leb128(num_segments) + bytes(segments)))
+
+
+def CallHeavyModule(num_globals, num_calls):
+    types = Leb128(2) + b'\x60\x00\x00' + b'\x60\x00\x01\x7f'
+    funcs = Leb128(2) + Leb128(0) + Leb128(1)
+    # (mut i32) initialized with i32.const 0.
+    globals_ = Leb128(num_globals) + b'\x7f\x01\x41\x00\x0b' * num_globals
+    exports = Leb128(1) + Leb128(3) + b'sum' + b'\x00' + Leb128(1)
+    body = bytearray(b'\x00\x41\x00')
+    for i in range(num_calls):
+        # global.get, call 0, i32.add
+        body += b'\x23' + Leb128(i % num_globals) + b'\x10\x00\x6a'
+    body += b'\x0b'
+    code = Leb128(2) + Leb128(2) + b'\x00\x0b' + Leb128(len(body)) + body
+    return (b'\x00asm\x01\x00\x00\x00' + Section(1, types) +
+            Section(3, funcs) + Section(6, globals_) + Section(7, exports) +
+            Section(10, code))
+
+
+def main(args):
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--bindir', metavar='PATH',
+                        default=find_exe.GetDefaultPath(),
+                        help='directory to search for the executable.')
+    parser.add_argument('--module', choices=['data', 'calls'],
+                        default='data', help='which module to generate.')
+    parser.add_argument('--data-size', type=int, default=32 << 20,
+                        help='bytes of data in the module.')
+    parser.add_argument('--segment-size', type=int, default=1 << 16,
+                        help='bytes in each data segment.')
+    parser.add_argument('--globals', type=int, default=5000,
+                        help='globals in the calls module.')
+    parser.add_argument('--calls', type=int, default=20000,
+                        help='calls in the calls module.')
+    parser.add_argument('--runs', type=int, default=5)
+    parser.add_argument('args', nargs='*',
+                        help='extra arguments for wasm2kotlin.')
+    options = parser.parse_args(args)
+
+    wasm2kotlin = find_exe.GetWasm2KotlinExecutable(options.bindir)
+    with tempfile.TemporaryDirectory() as temp_dir:
+        wasm_filename = os.path.join(temp_dir, 'module.wasm')
+        with open(wasm_filename, 'wb') as wasm_file:
+            if options.module == 'data':
+                wasm_file.write(DataHeavyModule(options.data_size,
+                                                options.segment_size))
+            else:
+                wasm_file.write(CallHeavyModule(options.globals,
+                                                options.calls))
+        kotlin_filename = os.path.join(temp_dir, 'Module.kt')
+        times = []
+        for _ in range(options.runs):
+            start = time.perf_counter()
+            subprocess.check_call([wasm2kotlin, wasm_filename, '-o',
+                                   kotlin_filename] + options.args)
+            times.append(time.perf_counter() - start)
+        output_size = os.path.getsize(kotlin_filename)
+
+    if options.module == 'data':
+        print('%d bytes of data, %d bytes of output' % (options.data_size,
+                                                         output_size))
+    else:
+        print('%d globals, %d calls, %d bytes of output' % (
+            options.globals, options.calls, output_size))
+    print('best %.3fs, median %.3fs over %d runs' % (
+        min(times), sorted(times)[len(times) // 2], len(times)))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
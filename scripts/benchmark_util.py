@@ -0,0 +1,132 @@
+#
+# Copyright 2021 WebAssembly Community Group participants
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Shared driver for the benchmark-*.py scripts that time generated code.
+
+A benchmark is a WAT module that is translated once per variant, a class
+name and the wasm2kotlin flags to use for it. The variants are compiled
+together with a Kotlin main function, which is then run.
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
+REPO_ROOT_DIR = os.path.dirname(SCRIPT_DIR)
+sys.path.append(os.path.join(REPO_ROOT_DIR, 'test'))
+
+import find_exe  # noqa: E402
+
+WASM_RT_IMPL = os.path.join(REPO_ROOT_DIR, 'wasm2kotlin', 'wasm_rt_impl.kt')
+
+# Times (Int) -> T exports in two module instances and prints the change.
+COMPARE_MAIN = '''
+typealias Bench = (Int) -> %(result)s
+
+fun time(func: Bench, arg: Int): Long {
+    // once to warm up, then the best of a few runs.
+    func(arg)
+    var best = Long.MAX_VALUE
+    for (run in 0..<%(runs)d) {
+        val start = System.nanoTime()
+        func(arg)
+        best = minOf(best, System.nanoTime() - start)
+    }
+    return best
+}
+
+fun main() {
+    val registry = wasm_rt_impl.ModuleRegistry()
+    %(base)s(registry, "base")
+    %(other)s(registry, "other")
+    for (case in CASES) {
+        val base = time(registry.importFunc<Bench, %(result)s>("base", "Z_" + case.export), case.arg)
+        val other = time(registry.importFunc<Bench, %(result)s>("other", "Z_" + case.export), case.arg)
+        println("%%-12s %%10.3f ms %%10.3f ms %%+7.1f%%%%".format(case.name,
+            base / 1e6, other / 1e6, (other - base) * 100.0 / base))
+    }
+}
+
+class Case(val name: String, val export: String, val arg: Int)
+
+val CASES = listOf(
+%(cases)s
+)
+'''
+
+
+def ArgumentParser(description):
+    parser = argparse.ArgumentParser(description=description)
+    parser.add_argument('--bindir', metavar='PATH',
+                        default=find_exe.GetDefaultPath(),
+                        help='directory to search for the executables.')
+    parser.add_argument('--kotlinc', metavar='PATH', default='kotlinc')
+    parser.add_argument('--kotlin', metavar='PATH', default='kotlin')
+    parser.add_argument('--runs', type=int, default=5)
+    return parser
+
+
+def Run(options, module, variants, main, header=None, run_args=None):
+    """Builds `module` once per (class name, flags) in `variants`, compiles
+    the results with the Kotlin source `main` and runs it, after printing
+    `header` if given."""
+    wat2wasm = find_exe.GetWat2WasmExecutable(options.bindir)
+    wasm2kotlin = find_exe.GetWasm2KotlinExecutable(options.bindir)
+    with tempfile.TemporaryDirectory() as temp_dir:
+        wat_filename = os.path.join(temp_dir, 'bench.wat')
+        with open(wat_filename, 'w') as wat_file:
+            wat_file.write(module)
+        wasm_filename = os.path.join(temp_dir, 'bench.wasm')
+        subprocess.check_call([wat2wasm, wat_filename, '-o', wasm_filename])
+        kotlin_filenames = []
+        for class_name, extra_args in variants:
+            kotlin_filename = os.path.join(temp_dir, class_name + '.kt')
+            subprocess.check_call([wasm2kotlin, wasm_filename, '-c', class_name,
+                                   '-o', kotlin_filename] + extra_args)
+            kotlin_filenames.append(kotlin_filename)
+
+        main_filename = os.path.join(temp_dir, 'BenchMain.kt')
+        with open(main_filename, 'w') as main_file:
+            main_file.write(main)
+
+        jar_filename = os.path.join(temp_dir, 'bench.jar')
+        subprocess.check_call([options.kotlinc, '-d', jar_filename,
+                               WASM_RT_IMPL, main_filename] + kotlin_filenames)
+        if header:
+            print(header)
+            sys.stdout.flush()
+        subprocess.check_call([options.kotlin, '-classpath', jar_filename,
+                               'BenchMainKt'] + (run_args or []))
+
+
+def Compare(args, description, module, cases, base, other, result='Int'):
+    """Times each (name, export, argument) in `cases` with two builds of
+    `module`. `base` and `other` are (class name, column label, flags)."""
+    options = ArgumentParser(description).parse_args(args)
+    main = COMPARE_MAIN % {
+        'result': result,
+        'runs': options.runs,
+        'base': base[0],
+        'other': other[0],
+        'cases': ',\n'.join('    Case("%s", "%s", %d)' % case
+                            for case in cases),
+    }
+    header = '%-12s %13s %13s %8s' % ('case', base[1], other[1], 'change')
+    Run(options, module, [(base[0], base[2]), (other[0], other[2])], main,
+        header)
+    return 0
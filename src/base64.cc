@@ -0,0 +1,66 @@
+/*
+ * Copyright 2021 WebAssembly Community Group participants
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/base64.h"
+
+#include <cstdint>
+#include <cstring>
+
+namespace wabt {
+
+namespace {
+
+const char s_base64_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Both chars for every 12 bits of input, so three bytes take two lookups.
+struct Base64PairTable {
+  Base64PairTable() {
+    for (int i = 0; i < 4096; ++i) {
+      pairs[i][0] = s_base64_alphabet[i >> 6];
+      pairs[i][1] = s_base64_alphabet[i & 0x3F];
+    }
+  }
+
+  char pairs[4096][2];
+};
+
+const Base64PairTable s_base64_pairs;
+
+}  // end anonymous namespace
+
+void Base64Encode(const void* src, size_t size, char* dst) {
+  const uint8_t* p = static_cast<const uint8_t*>(src);
+  const uint8_t* end = p + size / 3 * 3;
+  for (; p != end; p += 3, dst += 4) {
+    uint32_t data = (p[0] << 16) | (p[1] << 8) | p[2];
+    memcpy(dst, s_base64_pairs.pairs[data >> 12], 2);
+    memcpy(dst + 2, s_base64_pairs.pairs[data & 0xFFF], 2);
+  }
+  switch (size % 3) {
+    case 1:
+      dst[0] = s_base64_alphabet[p[0] >> 2];
+      dst[1] = s_base64_alphabet[(p[0] << 4) & 0x3F];
+      break;
+    case 2:
+      dst[0] = s_base64_alphabet[p[0] >> 2];
+      dst[1] = s_base64_alphabet[((p[0] << 4) | (p[1] >> 4)) & 0x3F];
+      dst[2] = s_base64_alphabet[(p[1] << 2) & 0x3F];
+      break;
+  }
+}
+
+}  // namespace wabt
@@ -1,5 +1,5 @@
 /*
- * Copyright 2021 Soni L.
+ * Copyright 2021 WebAssembly Community Group participants
  *
  * Licensed under the Apache License, Version 2.0 (the "License");
  * you may not use this file except in compliance with the License.
@@ -14,24 +14,22 @@
  * limitations under the License.
  */
 
-#ifndef WABT_SET_UTIL_H_
-#define WABT_SET_UTIL_H_
+#ifndef WABT_BASE64_H_
+#define WABT_BASE64_H_
 
-#include <set>
-#include <vector>
-#include <algorithm>
-#include <iterator>
+#include <stdlib.h>
 
 namespace wabt {
 
-template <typename T>
-bool SetsOverlap(const std::set<T>& set1, const std::set<T>& set2) {
-  std::vector<T> vec;
-  std::set_intersection(set1.begin(), set1.end(), set2.begin(), set2.end(), std::back_inserter(vec));
-  return !vec.empty();
+// Length of the base64 encoding of size bytes, without padding.
+constexpr size_t Base64EncodedSize(size_t size) {
+  return size / 3 * 4 + (size % 3 ? size % 3 + 1 : 0);
 }
 
-}  // namespace wabt
+// Writes the base64 encoding of size bytes from src to dst, without padding.
+// dst must have room for Base64EncodedSize(size) chars.
+void Base64Encode(const void* src, size_t size, char* dst);
 
-#endif  // WABT_SET_UTIL_H_
+}  // namespace wabt
 
+#endif  // WABT_BASE64_H_
@@ -32,21 +32,27 @@
 
 #include "src/kotlin-writer.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <charconv>
 #include <cinttypes>
 #include <cmath>
+#include <functional>
 #include <limits>
 #include <map>
+#include <queue>
 #include <set>
 #include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <utility>
 
+#include "src/base64.h"
 #include "src/cast.h"
 #include "src/common.h"
 #include "src/ir.h"
 #include "src/literal.h"
-#include "src/set-util.h"
 #include "src/stream.h"
 #include "src/string-util.h"
 
@@ -126,11 +132,6 @@ struct StackVarValue {
   Type type;
 };
 
-struct TypeEnum {
-  explicit TypeEnum(Type type) : type(type) {}
-  Type type;
-};
-
 struct ResultType {
   explicit ResultType(const TypeVector& types) : types(types) {}
   const TypeVector& types;
@@ -147,28 +148,112 @@ struct Newline {};
 struct OpenBrace {};
 struct CloseBrace {};
 
+// A set of local or global indexes. Function bodies refer to few of them at
+// a time, and the lowest indexes the most, so a bitset is both small and
+// fast to merge and compare.
+class IndexSet {
+ public:
+  bool empty() const { return words_.empty(); }
+  void clear() { words_.clear(); }
+
+  void insert(Index index) {
+    size_t word = index / 64;
+    if (word >= words_.size()) {
+      words_.resize(word + 1);
+    }
+    words_[word] |= uint64_t{1} << (index % 64);
+  }
+
+  void erase(Index index) {
+    size_t word = index / 64;
+    if (word < words_.size()) {
+      words_[word] &= ~(uint64_t{1} << (index % 64));
+      while (!words_.empty() && words_.back() == 0) {
+        words_.pop_back();
+      }
+    }
+  }
+
+  bool count(Index index) const {
+    size_t word = index / 64;
+    return word < words_.size() && (words_[word] >> (index % 64)) & 1;
+  }
+
+  size_t size() const {
+    size_t result = 0;
+    for (uint64_t word : words_) {
+      result += Popcount(word);
+    }
+    return result;
+  }
+
+  // The lowest index in the set, which must not be empty.
+  Index front() const {
+    size_t word = 0;
+    while (words_[word] == 0) {
+      ++word;
+    }
+    return word * 64 + Ctz(words_[word]);
+  }
+
+  bool Overlaps(const IndexSet& rhs) const {
+    size_t num_words = std::min(words_.size(), rhs.words_.size());
+    for (size_t i = 0; i < num_words; ++i) {
+      if (words_[i] & rhs.words_[i]) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  IndexSet& operator|=(const IndexSet& rhs) {
+    if (rhs.words_.size() > words_.size()) {
+      words_.resize(rhs.words_.size());
+    }
+    for (size_t i = 0; i < rhs.words_.size(); ++i) {
+      words_[i] |= rhs.words_[i];
+    }
+    return *this;
+  }
+
+  friend IndexSet operator|(IndexSet lhs, const IndexSet& rhs) {
+    lhs |= rhs;
+    return lhs;
+  }
+
+  bool operator==(const IndexSet& rhs) const { return words_ == rhs.words_; }
+  bool operator!=(const IndexSet& rhs) const { return words_ != rhs.words_; }
+
+ private:
+  // Never has trailing zero words, so empty() is cheap.
+  std::vector<uint64_t> words_;
+};
+
 struct SideEffects {
-  std::set<std::string> updates_locals;
-  std::set<std::string> updates_globals;
+  IndexSet updates_locals;
+  IndexSet updates_globals;
+  // Set by calls, instead of listing every global.
+  bool updates_all_globals = false;
   bool updates_memory = false;
   bool can_trap = false;
 
   bool empty() const {
-    return !can_trap && !updates_memory && updates_locals.empty() &&
-           updates_globals.empty();
+    return !can_trap && !updates_memory && !updates_all_globals &&
+           updates_locals.empty() && updates_globals.empty();
   }
 
   void clear() {
     updates_locals.clear();
     updates_globals.clear();
+    updates_all_globals = false;
     updates_memory = false;
     can_trap = false;
   }
 
   SideEffects& operator|=(const SideEffects& rhs) {
-    updates_locals.insert(rhs.updates_locals.begin(), rhs.updates_locals.end());
-    updates_globals.insert(rhs.updates_globals.begin(),
-                           rhs.updates_globals.end());
+    updates_locals |= rhs.updates_locals;
+    updates_globals |= rhs.updates_globals;
+    updates_all_globals = updates_all_globals || rhs.updates_all_globals;
     updates_memory = updates_memory || rhs.updates_memory;
     can_trap = can_trap || rhs.can_trap;
     return *this;
@@ -178,11 +263,16 @@ struct SideEffects {
     lhs |= rhs;
     return lhs;
   }
+
+  bool UpdatesGlobals(const IndexSet& globals) const {
+    return updates_all_globals ? !globals.empty()
+                               : updates_globals.Overlaps(globals);
+  }
 };
 
 struct DependsOn {
-  std::set<std::string> depends_locals;
-  std::set<std::string> depends_globals;
+  IndexSet depends_locals;
+  IndexSet depends_globals;
   bool depends_memory = false;
 
   bool empty() const {
@@ -196,9 +286,8 @@ struct DependsOn {
   }
 
   DependsOn& operator|=(const DependsOn& rhs) {
-    depends_locals.insert(rhs.depends_locals.begin(), rhs.depends_locals.end());
-    depends_globals.insert(rhs.depends_globals.begin(),
-                           rhs.depends_globals.end());
+    depends_locals |= rhs.depends_locals;
+    depends_globals |= rhs.depends_globals;
     depends_memory = depends_memory || rhs.depends_memory;
     return *this;
   }
@@ -218,40 +307,371 @@ struct StackValue {
   bool InvalidatedBy(const SideEffects& effects) const {
     return (effects.can_trap && !side_effects.empty()) ||
            (effects.updates_memory && depends_on.depends_memory) ||
-           SetsOverlap(effects.updates_locals, depends_on.depends_locals) ||
-           SetsOverlap(effects.updates_globals, depends_on.depends_globals);
+           effects.updates_locals.Overlaps(depends_on.depends_locals) ||
+           effects.UpdatesGlobals(depends_on.depends_globals);
   }
 
   bool RequiredFor(const DependsOn& requirements,
                    const SideEffects& effects) const {
     return (side_effects.can_trap && !effects.empty()) ||
            (side_effects.updates_memory && requirements.depends_memory) ||
-           SetsOverlap(side_effects.updates_locals,
-                       requirements.depends_locals) ||
-           SetsOverlap(side_effects.updates_globals,
-                       requirements.depends_globals);
+           side_effects.updates_locals.Overlaps(requirements.depends_locals) ||
+           side_effects.UpdatesGlobals(requirements.depends_globals);
+  }
+};
+
+// A block or loop that can be moved into a helper function when its function
+// is too large. Region 0 is the function body itself.
+struct OutlineRegion {
+  const Expr* expr = nullptr;
+  size_t parent = 0;
+  int label_index = -1;
+  // Instructions in the region, not counting those of outlined regions.
+  Index size = 0;
+  bool eligible = false;
+  bool outlined = false;
+  std::set<std::string> used_locals;
+  std::set<std::string> assigned_locals;
+  std::string name;
+};
+
+struct OutlinePlan {
+  std::vector<OutlineRegion> regions;
+  std::map<const Expr*, size_t> outlined_exprs;
+  std::string frame_class;
+};
+
+// Positions in a function body, counted while walking it backward, and
+// ranges of them. Each instruction has its own position, and a block, loop
+// or if comes after the instructions in it.
+struct LiveRange {
+  Index lo = std::numeric_limits<Index>::max();
+  Index hi = 0;
+
+  bool empty() const { return lo > hi; }
+
+  void Extend(Index pos) {
+    lo = std::min(lo, pos);
+    hi = std::max(hi, pos);
+  }
+
+  void Extend(const LiveRange& range) {
+    lo = std::min(lo, range.lo);
+    hi = std::max(hi, range.hi);
+  }
+
+  bool Contains(const LiveRange& range) const {
+    return lo <= range.lo && range.hi <= hi;
+  }
+};
+
+// The locals live at a point in a function. Unlike IndexSet, it keeps its
+// words when locals are erased, so walking a function with many locals
+// doesn't keep shrinking and zero-filling it again.
+class LiveSet {
+ public:
+  void clear() { std::fill(words_.begin(), words_.end(), 0); }
+
+  void insert(Index index) {
+    size_t word = index / 64;
+    if (word >= words_.size()) {
+      words_.resize(word + 1);
+    }
+    words_[word] |= uint64_t{1} << (index % 64);
+  }
+
+  void erase(Index index) {
+    size_t word = index / 64;
+    if (word < words_.size()) {
+      words_[word] &= ~(uint64_t{1} << (index % 64));
+    }
+  }
+
+  bool count(Index index) const {
+    size_t word = index / 64;
+    return word < words_.size() && (words_[word] >> (index % 64)) & 1;
   }
+
+  template <typename F>
+  void ForEach(F&& func) const {
+    for (size_t word = 0; word < words_.size(); ++word) {
+      for (uint64_t bits = words_[word]; bits != 0; bits &= bits - 1) {
+        func(static_cast<Index>(word * 64 + Ctz(bits)));
+      }
+    }
+  }
+
+  LiveSet& operator|=(const LiveSet& rhs) {
+    if (rhs.words_.size() > words_.size()) {
+      words_.resize(rhs.words_.size());
+    }
+    for (size_t i = 0; i < rhs.words_.size(); ++i) {
+      words_[i] |= rhs.words_[i];
+    }
+    return *this;
+  }
+
+  // Whether this has every index in |rhs|.
+  bool Includes(const LiveSet& rhs) const {
+    for (size_t i = 0; i < rhs.words_.size(); ++i) {
+      uint64_t word = i < words_.size() ? words_[i] : 0;
+      if (rhs.words_[i] & ~word) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  std::vector<uint64_t> words_;
+};
+
+// Liveness of a function's params and locals, found by walking the body
+// backward. Each local gets a range that covers its uses, every loop it is
+// live on entry to, and the function entry if it's live there. That covers
+// every point it is live at, so locals whose ranges don't overlap never hold
+// a value at the same time, and a local whose range is inside a block isn't
+// live on entry to it. Anything a catch reads is treated as live throughout
+// its try body.
+class LocalLiveness {
+ public:
+  explicit LocalLiveness(const Func& func) : func_(func) {}
+
+  // Returns the locals live on entry to the function.
+  LiveSet Analyze();
+
+  const LiveRange& Range(Index index) const { return ranges_[index]; }
+
+  // The positions of the contents of a block, loop or if, by its Block.
+  const LiveRange& Extent(const Block* block) const {
+    return extents_.find(block)->second;
+  }
+
+ private:
+  struct Target {
+    const std::string* label;
+    LiveSet live;
+  };
+
+  void Walk(const ExprList&, LiveSet* live);
+  void Use(Index);
+  void Enter(const Block*, Index start, const LiveSet* live);
+  const LiveSet& FindTarget(const Var&) const;
+
+  const Func& func_;
+  bool record_ = false;
+  bool changed_ = false;
+  Index pos_ = 0;
+  std::vector<Target> targets_;
+  std::map<const Expr*, LiveSet> loop_live_;
+  std::map<const Block*, LiveRange> extents_;
+  std::vector<LiveRange> ranges_;
 };
 
+LiveSet LocalLiveness::Analyze() {
+  // Loops only see what's live at their start on the next pass, so go until
+  // that settles, then once more to record ranges.
+  LiveSet live;
+  do {
+    changed_ = false;
+    live.clear();
+    targets_.assign(1, Target{nullptr, LiveSet()});
+    Walk(func_.exprs, &live);
+  } while (changed_);
+
+  record_ = true;
+  pos_ = 0;
+  ranges_.assign(func_.GetNumParamsAndLocals(), LiveRange());
+  live.clear();
+  targets_.assign(1, Target{nullptr, LiveSet()});
+  Walk(func_.exprs, &live);
+  Index entry = ++pos_;
+  live.ForEach([&](Index i) { ranges_[i].Extend(entry); });
+  return live;
+}
+
+void LocalLiveness::Use(Index index) {
+  if (record_) {
+    ranges_[index].Extend(pos_);
+  }
+}
+
+// Records the extent of a block, loop or if whose contents come after
+// |start|. Locals live on entry to a loop, in |live|, are live throughout it.
+void LocalLiveness::Enter(const Block* block,
+                          Index start,
+                          const LiveSet* live) {
+  Index end = pos_++;
+  if (!record_) {
+    return;
+  }
+  LiveRange& extent = extents_[block];
+  extent.lo = start + 1;
+  extent.hi = end;
+  if (live) {
+    live->ForEach([&](Index i) {
+      ranges_[i].Extend(extent);
+      ranges_[i].Extend(pos_);
+    });
+  }
+}
+
+const LiveSet& LocalLiveness::FindTarget(const Var& var) const {
+  if (var.is_index()) {
+    // Only the implicit function label is referred to by index.
+    return targets_[0].live;
+  }
+  for (size_t i = targets_.size(); i > 1; --i) {
+    if (*targets_[i - 1].label == var.name()) {
+      return targets_[i - 1].live;
+    }
+  }
+  WABT_UNREACHABLE;
+}
+
+void LocalLiveness::Walk(const ExprList& exprs, LiveSet* live) {
+  for (auto iter = exprs.rbegin(); iter != exprs.rend(); ++iter) {
+    const Expr& expr = *iter;
+    Index start = pos_;
+    switch (expr.type()) {
+      case ExprType::LocalGet: {
+        Index index = func_.GetLocalIndex(cast<LocalGetExpr>(&expr)->var);
+        ++pos_;
+        Use(index);
+        live->insert(index);
+        break;
+      }
+
+      case ExprType::LocalSet:
+      case ExprType::LocalTee: {
+        const Var& var = expr.type() == ExprType::LocalSet
+                             ? cast<LocalSetExpr>(&expr)->var
+                             : cast<LocalTeeExpr>(&expr)->var;
+        Index index = func_.GetLocalIndex(var);
+        ++pos_;
+        Use(index);
+        live->erase(index);
+        break;
+      }
+
+      case ExprType::Br:
+        *live = FindTarget(cast<BrExpr>(&expr)->var);
+        break;
+
+      case ExprType::BrIf:
+        *live |= FindTarget(cast<BrIfExpr>(&expr)->var);
+        break;
+
+      case ExprType::BrTable: {
+        const auto* bt_expr = cast<BrTableExpr>(&expr);
+        LiveSet targets = FindTarget(bt_expr->default_target);
+        for (const Var& var : bt_expr->targets) {
+          targets |= FindTarget(var);
+        }
+        *live = std::move(targets);
+        break;
+      }
+
+      case ExprType::Return:
+      case ExprType::ReturnCall:
+      case ExprType::ReturnCallIndirect:
+      case ExprType::Unreachable:
+      case ExprType::Throw:
+      case ExprType::Rethrow:
+        live->clear();
+        break;
+
+      case ExprType::Block: {
+        const Block& block = cast<BlockExpr>(&expr)->block;
+        targets_.push_back(Target{&block.label, *live});
+        Walk(block.exprs, live);
+        targets_.pop_back();
+        Enter(&block, start, nullptr);
+        break;
+      }
+
+      case ExprType::Loop: {
+        const Block& block = cast<LoopExpr>(&expr)->block;
+        LiveSet& loop_start = loop_live_[&expr];
+        targets_.push_back(Target{&block.label, loop_start});
+        Walk(block.exprs, live);
+        targets_.pop_back();
+        if (!loop_start.Includes(*live)) {
+          loop_start |= *live;
+          changed_ = true;
+        }
+        Enter(&block, start, live);
+        break;
+      }
+
+      case ExprType::If: {
+        const IfExpr& if_ = *cast<IfExpr>(&expr);
+        targets_.push_back(Target{&if_.true_.label, *live});
+        LiveSet false_live = *live;
+        Walk(if_.false_, &false_live);
+        Walk(if_.true_.exprs, live);
+        targets_.pop_back();
+        *live |= false_live;
+        Enter(&if_.true_, start, nullptr);
+        break;
+      }
+
+      case ExprType::Try: {
+        const TryExpr& tryexpr = *cast<TryExpr>(&expr);
+        targets_.push_back(Target{&tryexpr.block.label, *live});
+        LiveSet handlers;
+        for (const Catch& c : tryexpr.catches) {
+          LiveSet catch_live = *live;
+          Walk(c.exprs, &catch_live);
+          handlers |= catch_live;
+        }
+        Walk(tryexpr.block.exprs, live);
+        targets_.pop_back();
+        *live |= handlers;
+        break;
+      }
+
+      default:
+        ++pos_;
+        break;
+    }
+  }
+}
+
 class KotlinWriter {
  public:
-  KotlinWriter(Stream* kotlin_stream,
+  KotlinWriter(std::vector<Stream*>&& kotlin_streams,
+               Stream* data_stream,
+               const char* data_name,
                const char* class_name,
                const char* package_name,
                const WriteKotlinOptions& options)
       : options_(options),
-        kotlin_stream_(kotlin_stream),
+        kotlin_stream_(kotlin_streams.front()),
+        shard_streams_(kotlin_streams.begin() + 1, kotlin_streams.end()),
+        data_stream_(data_stream),
+        data_name_(data_name ? data_name : ""),
         class_name_(class_name),
-        package_name_(package_name) {}
+        package_name_(package_name),
+        sharded_(!shard_streams_.empty()) {}
 
   Result WriteModule(const Module&);
 
  private:
+  // A writer for functions only, on a worker thread, sharing the module-level
+  // state of |parent|.
+  KotlinWriter(const KotlinWriter& parent);
+
   typedef std::set<std::string> SymbolSet;
   typedef std::map<std::string, std::string> SymbolMap;
   typedef std::pair<Index, Type> StackTypePair;
   typedef std::map<StackTypePair, std::string> StackVarSymbolMap;
   typedef std::map<Index, FuncDeclaration> CallIndirectDeclMap;
+  typedef std::map<std::string, FuncSignature> TypedFuncMap;
+  // (memory name, local name or "" for absolute addresses) -> end of the
+  // range known to be in bounds.
+  typedef std::map<std::pair<std::string, std::string>, uint64_t>
+      CheckedRangeMap;
 
   void UseStream(Stream*);
 
@@ -292,7 +712,9 @@ class KotlinWriter {
   std::string DefineGlobalScopeName(const std::string&);
   std::string DefineLocalScopeName(const std::string&);
   std::string DefineStackVarName(Index, Type, std::string_view);
-  void DefineCallIndirect(Index, const FuncDeclaration&);
+  void DefineCallIndirect(Index, const FuncDeclaration&, bool tail = false);
+  std::string DefineTypedFunc(const FuncSignature&);
+  static std::string MangleSignature(const FuncSignature&);
 
   void Indent(int size = INDENT_SIZE);
   void Dedent(int size = INDENT_SIZE);
@@ -340,7 +762,6 @@ class KotlinWriter {
   void Write(const GlobalName&);
   void Write(const ExternalPtr&);
   void Write(Type);
-  void Write(TypeEnum);
   void Write(const Var&);
   void Write(const GotoLabel&);
   void Write(const LabelDecl&);
@@ -350,34 +771,125 @@ class KotlinWriter {
   void Write(const Const&);
   void WriteInitExpr(const ExprList&);
   void WriteSourceTop();
+  void WriteSuppressions(const char* annotation);
   void WriteSourceBottom();
   void WriteTagTypes();
   void WriteFuncTypes();
+  void WriteFuel();
+  void WriteFuelSlice();
+  void WriteFuelCheck();
   void WriteTags();
   void WriteTag(const Tag*, const std::string&);
-  void WriteImport(const char*, const std::string&, const std::string&, bool);
+  void WriteImport(const char*, const std::string&, const std::string&);
   void WriteImports();
   void WriteFuncType(const FuncDeclaration&);
+  void WriteTypedFuncParams(const FuncSignature&);
+  void WriteTypedFuncArgs(const FuncSignature&);
+  void WriteTypedFuncRef(const Func&);
+  void WriteTypedFuncs();
   void AllocateFuncs();
+  bool UsesResultFields(const Func&) const;
+  bool ReturnsThroughFields(const Func&) const;
+  static std::string ResultField(Index, Type);
+  std::string ScratchArg();
+  std::string ScratchField(const std::string&);
+  void WriteScratch();
+  void WriteScratchLocal();
+  void WriteResultFields();
+  void WriteResultFieldsAdapter(const Func&);
+  void WriteResultFieldsCallback(const FuncDeclaration&);
+  bool NeedsTrampoline(const Func&,
+                       const ExprList&,
+                       bool check_targets = true) const;
+  static bool HasSelfTailCall(const Func&, const ExprList&, const Module&);
+  bool UsesTrampoline(const Func&) const;
+  bool HasTrampolineTarget(const FuncSignature&) const;
+  static std::string TailCallSlot(Index, Type);
+  static std::string MangleResults(const TypeVector&);
+  static TypeVector FirstResult(const TypeVector&);
+  static std::string TailCallNext(const TypeVector&);
+  static std::string TailFnType(const TypeVector&);
+  void WriteTailCallSlots();
+  void WriteTrampolines();
+  void WriteTailCallAdapter(const Func&);
+  void CollectFuncRefs(const ExprList&,
+                       std::set<Index>*,
+                       bool calls = false) const;
+  void FindUsedFuncs();
+  bool IsFuncUsed(const Func&) const;
+  void WriteFuncRefs();
   void WriteGlobals();
   void WriteGlobal(const Global&, const std::string&);
+  bool IsGlobalCell(const std::string&) const;
+  const Const* ConstantGlobalValue(const Var&) const;
+  static const char* GlobalCellType(Type);
+  static const char* ZeroValue(Type);
+  static std::string LongLiteral(uint64_t);
+  static std::string V128Literal(v128);
+  static std::string OpcodeFuncName(Opcode);
+  std::string OffsetMemoryAccess(Opcode,
+                                 const Var&,
+                                 const StackValue&,
+                                 Address);
+  void WriteSimdLoad(Opcode, const Var&, Address);
+  void WriteAtomicExpr(Opcode, const Var&, Address, Index num_operands);
   void WriteMemories();
   void WriteMemory(const std::string&);
   void WriteTables();
   void WriteTable(const std::string&);
   void WriteDataSegmentData(const DataSegment* data_segment);
   void WriteDataInitializers();
+  void WriteDataFileInitializers();
   void WriteElemSegmentExprs(const ElemSegment* elem_segment);
   void WriteElemInitializers();
   void WriteExports();
   void WriteInit();
   void WriteFuncs();
+  std::vector<MemoryStream> WriteFuncsToStreams(
+      const std::vector<const Func*>&,
+      unsigned num_threads,
+      int indent);
+  void WriteShards(const std::vector<const Func*>&);
+  static size_t ShardIndex(const Func&, size_t num_shards);
+  const char* MemberVisibility() const;
+  std::string FunHeader(const std::string& name, bool shared = true) const;
   void Write(const Func&);
+  void PlanOutlining(const Func&);
+  void PlanLocalSlots(const Func&);
+  void ScanLocalScopes(const ExprList&,
+                       const Block* scope,
+                       std::vector<const Block*>* homes,
+                       IndexSet* used);
+  const Block* CommonLocalScope(const Block*, const Block*) const;
+  Index LocalSlot(const Var&) const;
+  const std::string& LocalSlotName(const Var&) const;
+  void WriteScopedLocals(const Block&);
+  void ScanOutlineRegions(const ExprList&,
+                          size_t region,
+                          std::vector<const std::string*>* labels,
+                          bool in_try);
+  void EscapeOutlineRegions(size_t region,
+                            const std::vector<const std::string*>& labels,
+                            const Var&);
+  const Block& OutlinedBlock(const OutlineRegion&) const;
+  void WriteOutlinedCall(const OutlineRegion&);
+  void WriteOutlinedFunc(const OutlineRegion&);
+  void WriteFrameClass();
+  void WriteFuncSections();
   void WriteParams(const std::vector<std::string>&, std::vector<std::string>&);
   void WriteLocals(const std::vector<std::string>&,
                    const std::vector<std::string>&);
   void WriteStackVarDeclarations();
   void WriteCallIndirectDefinitions();
+  void WriteCallIndirectDefinition(Index, const FuncDeclaration&, bool tail);
+  void WriteCall(const Var&);
+  void WriteCallIndirect(const Var& table_var,
+                         const FuncDeclaration&,
+                         bool tail);
+  void WriteReturn();
+  std::vector<std::string> SpillArgs(const TypeVector&);
+  void WriteSelfTailCall();
+  void WriteTailCall(const Func&);
   void Write(const ExprList&);
 
   void WriteSimpleUnaryExpr(Type, const char* op, bool can_trap = false);
@@ -387,10 +899,30 @@ class KotlinWriter {
                             uint8_t precedence,
                             bool debooleanize = false);
   void WritePrefixBinaryExpr(Opcode, const char* op, bool can_trap = false);
+  static bool ParseIntLiteral(std::string_view, int64_t*);
+  void WriteDivExpr(Opcode);
   void WriteUnsignedCompareExpr(Opcode, const char* op);
   void Write(const BinaryExpr&);
   void Write(const CompareExpr&);
   void Write(const ConvertExpr&);
+  const char* MemoryAccessSuffix() const;
+  void CollectAssignedLocals(const ExprList&, SymbolSet*);
+  void EnterCheckedScope(const Expr&);
+  void ResetCheckedScope();
+  void LeaveCheckedScope();
+  void ForgetCheckedRanges(const std::string& local);
+  bool IsCheckedRange(const std::string& memory,
+                      const std::string& local,
+                      uint64_t end) const;
+  void AddCheckedRange(const std::string& memory,
+                       const std::string& local,
+                       uint64_t end);
+  std::string MemoryAccess(const Memory&,
+                           const char* func,
+                           const StackValue& addr,
+                           uint64_t offset,
+                           uint64_t size,
+                           const SideEffects& later_effects);
   void Write(const LoadExpr&);
   void Write(const StoreExpr&);
   void Write(const UnaryExpr&);
@@ -402,6 +934,7 @@ class KotlinWriter {
   void Write(const LoadSplatExpr&);
   void Write(const LoadZeroExpr&);
   void Write(const Block&);
+  void Write(const LoopExpr&);
 
   size_t BeginTry(const TryExpr& tryexpr);
   void WriteTryCatch(const TryExpr& tryexpr);
@@ -418,10 +951,15 @@ class KotlinWriter {
   const Func* func_ = nullptr;
   Stream* stream_ = nullptr;
   Stream* kotlin_stream_ = nullptr;
+  // If not empty, functions go in these files instead of the class.
+  std::vector<Stream*> shard_streams_;
+  Stream* data_stream_ = nullptr;
+  std::string data_name_;
   std::string class_name_;
   std::string package_name_;
   Result result_ = Result::Ok;
   int indent_ = 0;
+  bool sharded_ = false;
   bool should_write_indent_next_ = false;
   bool unreachable_ = false;
 
@@ -432,19 +970,99 @@ class KotlinWriter {
   SymbolSet global_syms_;
   SymbolSet local_syms_;
   SymbolSet import_syms_;
+  // Mutable globals shared with other modules, which live in a
+  // wasm_rt_impl.Global cell, by wasm name.
+  SymbolSet global_cells_;
   SymbolSet module_import_syms_;
   TypeVector type_stack_;
   std::vector<Label> label_stack_;
   std::vector<TryCatchLabel> try_catch_stack_;
   std::vector<StackValue> value_stack_;
   CallIndirectDeclMap call_indirect_decl_map_;
+  CallIndirectDeclMap return_call_indirect_decl_map_;
+  TypedFuncMap typed_func_map_;
 
   std::vector<std::pair<std::string, MemoryStream>> func_sections_;
   SymbolSet func_includes_;
+
+  // Multi-value functions using result fields, by wasm name, to the name of
+  // the field-returning function.
+  SymbolMap result_fields_sym_map_;
+
+  // Functions whose tail calls go through a trampoline, by wasm name, to the
+  // name of the function holding the body and of its continuation object.
+  SymbolMap tail_call_sym_map_;
+  SymbolMap tail_object_sym_map_;
+  // The loop around the body of a function with self tail calls, and the
+  // wasm names of its params and locals, by index.
+  std::string tail_label_;
+  std::vector<std::string> local_names_;
+
+  // Functions used as references, by wasm name, to the name of their
+  // wasm_rt_impl.Elem. One per function, so ref.func doesn't allocate.
+  SymbolMap func_ref_sym_map_;
+
+  // Planned for all functions up front, so that the helpers' names don't
+  // depend on the order functions are written in.
+  std::map<const Func*, OutlinePlan> outline_plans_;
+  std::vector<OutlineRegion> outline_regions_;
+  std::map<const Expr*, size_t> outlined_exprs_;
+  std::string frame_class_;
+  std::string frame_name_;
+  // The local holding the thread's Fuel.Slice, with --fuel.
+  std::string fuel_name_;
+  // The local holding the thread's Scratch.
+  std::string scratch_name_;
+  SymbolSet func_local_syms_;
+
+  CheckedRangeMap checked_ranges_;
+  std::vector<CheckedRangeMap> checked_scopes_;
+  std::map<const Expr*, SymbolSet> assigned_locals_;
+
+  // By function index; all true unless unused functions are being removed.
+  std::vector<bool> used_funcs_;
+
+  // Locals sharing a Kotlin variable, by index, to the index of the local it
+  // is named after (params only ever map to themselves). Variables declared
+  // in a block, loop or if instead of at the top of the function, by the
+  // Block, and all those not at the top, including unused ones.
+  std::vector<Index> local_slots_;
+  IndexSet entry_live_slots_;
+  std::map<const Block*, std::vector<Index>> scoped_locals_;
+  IndexSet scoped_slots_;
+  struct LocalScope {
+    const Block* parent;
+    Index depth;
+  };
+  std::map<const Block*, LocalScope> local_scopes_;
 };
 
 static const char kImplicitFuncLabel[] = "$Bfunc";
 
+// The types locals and stack vars are declared by, in order.
+static const Type kVarTypes[] = {Type::I32, Type::I64, Type::F32,
+                                 Type::F64, Type::V128, Type::FuncRef,
+                                 Type::ExternRef};
+
+KotlinWriter::KotlinWriter(const KotlinWriter& parent)
+    : options_(parent.options_),
+      module_(parent.module_),
+      class_name_(parent.class_name_),
+      package_name_(parent.package_name_),
+      indent_(parent.indent_),
+      sharded_(!parent.shard_streams_.empty()),
+      global_sym_map_(parent.global_sym_map_),
+      module_import_sym_map_(parent.module_import_sym_map_),
+      global_syms_(parent.global_syms_),
+      import_syms_(parent.import_syms_),
+      global_cells_(parent.global_cells_),
+      module_import_syms_(parent.module_import_syms_),
+      result_fields_sym_map_(parent.result_fields_sym_map_),
+      tail_call_sym_map_(parent.tail_call_sym_map_),
+      tail_object_sym_map_(parent.tail_object_sym_map_),
+      func_ref_sym_map_(parent.func_ref_sym_map_),
+      outline_plans_(parent.outline_plans_) {}
+
 size_t KotlinWriter::MarkTypeStack() const {
   return type_stack_.size();
 }
@@ -611,6 +1229,12 @@ char KotlinWriter::MangleType(Type type) {
       return 'f';
     case Type::F64:
       return 'd';
+    case Type::V128:
+      return 'o';
+    case Type::FuncRef:
+      return 'c';
+    case Type::ExternRef:
+      return 'e';
     default:
       WABT_UNREACHABLE;
   }
@@ -712,11 +1336,46 @@ std::string KotlinWriter::DefineStackVarName(Index index,
 }
 
 void KotlinWriter::DefineCallIndirect(Index index,
-                                      const FuncDeclaration& decl) {
-  if (call_indirect_decl_map_.find(index) != call_indirect_decl_map_.end()) {
+                                      const FuncDeclaration& decl,
+                                      bool tail) {
+  CallIndirectDeclMap& decl_map =
+      tail ? return_call_indirect_decl_map_ : call_indirect_decl_map_;
+  if (decl_map.find(index) != decl_map.end()) {
     return;
   }
-  call_indirect_decl_map_.insert(CallIndirectDeclMap::value_type(index, decl));
+  decl_map.insert(CallIndirectDeclMap::value_type(index, decl));
+}
+
+std::string KotlinWriter::DefineTypedFunc(const FuncSignature& sig) {
+  // Kotlin can't implement function types with more parameters than this.
+  const Index kMaxTypedFuncParams = 22;
+  if (sig.GetNumParams() > kMaxTypedFuncParams) {
+    return "";
+  }
+  // Named after the signature rather than the type index, so that equivalent
+  // types share an interface, same as they share a func_types id.
+  std::string name = "Fn_" + MangleSignature(sig);
+  typed_func_map_.emplace(name, sig);
+  return name;
+}
+
+// static
+std::string KotlinWriter::MangleSignature(const FuncSignature& sig) {
+  std::string result;
+  for (Type type : sig.param_types) {
+    result += MangleType(type);
+  }
+  if (sig.param_types.empty()) {
+    result += 'v';
+  }
+  result += '_';
+  for (Type type : sig.result_types) {
+    result += MangleType(type);
+  }
+  if (sig.result_types.empty()) {
+    result += 'v';
+  }
+  return result;
 }
 
 void KotlinWriter::Indent(int size) {
@@ -880,11 +1539,17 @@ void KotlinWriter::Write(const LabelDecl& label) {
 void KotlinWriter::Write(const GlobalVar& var) {
   assert(var.var.is_name());
   Write(GetGlobalName(var.var.name()));
+  if (IsGlobalCell(var.var.name())) {
+    Write(".value");
+  }
 }
 
 void KotlinWriter::WriteValue(const GlobalVar& var) {
   assert(var.var.is_name());
   WriteValue(GetGlobalName(var.var.name()));
+  if (IsGlobalCell(var.var.name())) {
+    WriteValue(".value");
+  }
 }
 
 void KotlinWriter::WriteValue(const StackVar& sv) {
@@ -937,6 +1602,15 @@ void KotlinWriter::Write(Type type) {
     case Type::F64:
       Write("Double");
       break;
+    case Type::V128:
+      Write(WASM_RT_PKG ".V128");
+      break;
+    case Type::FuncRef:
+      Write(WASM_RT_PKG ".Elem?");
+      break;
+    case Type::ExternRef:
+      Write("Any?");
+      break;
     default:
       WABT_UNREACHABLE;
   }
@@ -956,24 +1630,14 @@ void KotlinWriter::WriteValue(Type type) {
     case Type::F64:
       WriteValue("Double");
       break;
-    default:
-      WABT_UNREACHABLE;
-  }
-}
-
-void KotlinWriter::Write(TypeEnum type) {
-  switch (type.type) {
-    case Type::I32:
-      Write("Int::class");
-      break;
-    case Type::I64:
-      Write("Long::class");
+    case Type::V128:
+      WriteValue(WASM_RT_PKG ".V128");
       break;
-    case Type::F32:
-      Write("Float::class");
+    case Type::FuncRef:
+      WriteValue(WASM_RT_PKG ".Elem?");
       break;
-    case Type::F64:
-      Write("Double::class");
+    case Type::ExternRef:
+      WriteValue("Any?");
       break;
     default:
       WABT_UNREACHABLE;
@@ -1081,6 +1745,10 @@ void KotlinWriter::WriteValue(const Const& const_) {
       break;
     }
 
+    case Type::V128:
+      WriteValue(V128Literal(const_.vec128()));
+      break;
+
     default:
       WABT_UNREACHABLE;
   }
@@ -1166,6 +1834,10 @@ void KotlinWriter::Write(const Const& const_) {
       break;
     }
 
+    case Type::V128:
+      Write(V128Literal(const_.vec128()));
+      break;
+
     default:
       WABT_UNREACHABLE;
   }
@@ -1182,8 +1854,23 @@ void KotlinWriter::WriteInitExpr(const ExprList& expr_list) {
       Write(cast<ConstExpr>(expr)->const_);
       break;
 
-    case ExprType::GlobalGet:
-      Write(GlobalVar(cast<GlobalGetExpr>(expr)->var));
+    case ExprType::GlobalGet: {
+      const Var& var = cast<GlobalGetExpr>(expr)->var;
+      if (const Const* const_ = ConstantGlobalValue(var)) {
+        Write(*const_);
+      } else {
+        Write(GlobalVar(var));
+      }
+      break;
+    }
+
+    case ExprType::RefFunc:
+      Write(func_ref_sym_map_[module_->GetFunc(cast<RefFuncExpr>(expr)->var)
+                                  ->name]);
+      break;
+
+    case ExprType::RefNull:
+      Write("null");
       break;
 
     default:
@@ -1196,26 +1883,34 @@ void KotlinWriter::WriteSourceTop() {
     Write("package ", package_name_, Newline());
   }
   Write(s_source_includes);
-  Write("@Suppress(\"NAME_SHADOWING\", \"UNUSED_VALUE\", \"UNUSED_VARIABLE\", ",
-        "\"UNUSED_PARAMETER\", \"UNREACHABLE_CODE\", \"UNUSED_EXPRESSION\", ",
-        "\"VARIABLE_WITH_REDUNDANT_INITIALIZER\", ",
-        "\"ASSIGNED_BUT_NEVER_ACCESSED_VARIABLE\")", Newline());
+  WriteSuppressions("@");
   Write("class ", class_name_,
         " (moduleRegistry: " WASM_RT_PKG ".ModuleRegistry, name: String)",
         OpenBrace());
-  Write(s_source_inner);
+  if (sharded_) {
+    // The shards need to see Delegate too.
+    std::string_view inner = s_source_inner;
+    size_t pos = inner.find("private class");
+    assert(pos != std::string_view::npos);
+    Write(inner.substr(0, pos), "internal");
+    Write(inner.substr(pos + sizeof("private") - 1));
+  } else {
+    Write(s_source_inner);
+  }
+}
+
+void KotlinWriter::WriteSuppressions(const char* annotation) {
+  Write(annotation, "Suppress(\"NAME_SHADOWING\", \"UNUSED_VALUE\", ",
+        "\"UNUSED_VARIABLE\", \"UNUSED_PARAMETER\", \"UNREACHABLE_CODE\", ",
+        "\"UNUSED_EXPRESSION\", \"VARIABLE_WITH_REDUNDANT_INITIALIZER\", ",
+        "\"ASSIGNED_BUT_NEVER_ACCESSED_VARIABLE\", \"SENSELESS_COMPARISON\")",
+        Newline());
 }
 
 void KotlinWriter::WriteImport(const char* type,
                                const std::string& module,
-                               const std::string& mangled,
-                               bool delegate) {
-  if (delegate) {
-    Write(" by ");
-  } else {
-    Write(" = ");
-  }
-  Write("moduleRegistry.import", type, "(\"");
+                               const std::string& mangled) {
+  Write(" = moduleRegistry.import", type, "(\"");
   Write(MangleName(module), "\", \"", mangled, "\");");
 }
 
@@ -1224,34 +1919,46 @@ void KotlinWriter::WriteSourceBottom() {
   Write("}");
 }
 
+void KotlinWriter::WriteFuel() {
+  if (!options_.fuel) {
+    return;
+  }
+  Write(Newline(), MemberVisibility(), "val fuel: " WASM_RT_PKG
+        ".Fuel = moduleRegistry.fuel", Newline());
+}
+
+void KotlinWriter::WriteFuelSlice() {
+  Write("val ", fuel_name_, " = fuel.slice()", Newline());
+}
+
+void KotlinWriter::WriteFuelCheck() {
+  // A field decrement and a compare; refill() does the rest once a slice.
+  if (options_.fuel) {
+    Write("if (--", fuel_name_, ".left < 0) ", fuel_name_, ".refill()",
+          Newline());
+    func_includes_.insert(fuel_name_);
+  }
+}
+
 void KotlinWriter::WriteFuncTypes() {
   if (!module_->types.size()) {
     return;
   }
+  // The ids only depend on the signatures, so they're looked up once per
+  // class rather than once per instance.
   Write(Newline());
-  Writef("private val func_types: IntArray = IntArray(%" PRIzd ")",
-         module_->types.size());
-  Write(Newline(), Newline());
-  Write("init /* func_types */", OpenBrace());
-  Index func_type_index = 0;
+  Write(MemberVisibility(), "val func_types: IntArray = func_type_ids",
+        Newline(), Newline());
+  Write("private companion object ", OpenBrace());
+  Write("val func_type_ids: IntArray = intArrayOf(");
+  Indent(4);
   for (TypeEntry* type : module_->types) {
     FuncType* func_type = cast<FuncType>(type);
-    Index num_params = func_type->GetNumParams();
-    Index num_results = func_type->GetNumResults();
-    Write("func_types[", func_type_index,
-          "] = " WASM_RT_PKG ".register_func_type(", num_params, ", ",
-          num_results);
-    for (Index i = 0; i < num_params; ++i) {
-      Write(", ", TypeEnum(func_type->GetParamType(i)));
-    }
-
-    for (Index i = 0; i < num_results; ++i) {
-      Write(", ", TypeEnum(func_type->GetResultType(i)));
-    }
-
-    Write(");", Newline());
-    ++func_type_index;
+    Write(Newline(), WASM_RT_PKG ".func_type_id(\"",
+          MangleSignature(func_type->sig), "\"),");
   }
+  Dedent(4);
+  Write(Newline(), ")", Newline());
   Write(CloseBrace(), Newline());
 }
 
@@ -1266,7 +1973,7 @@ void KotlinWriter::WriteTags() {
        it != module_->tags.cend(); ++it) {
     const Tag* tag = *it;
 
-    Write("private var ");
+    Write(MemberVisibility(), "var ");
     WriteTag(tag, DefineGlobalScopeName(tag->name));
     Write(" = " WASM_RT_PKG ".Tag()", Newline());
   }
@@ -1294,12 +2001,15 @@ void KotlinWriter::WriteImports() {
 
   // TODO(binji): Write imports ordered by type.
   for (const Import* import : module_->imports) {
+    if (import->kind() == ExternalKind::Func &&
+        !IsFuncUsed(cast<FuncImport>(import)->func)) {
+      continue;
+    }
     Write("/* import: '", import->module_name, "' '", import->field_name,
           "' */", Newline());
-    Write("private ");
+    Write(MemberVisibility());
     std::string mangled;
     const char* type;
-    bool delegate = false;
     switch (import->kind()) {
       case ExternalKind::Func: {
         Write("val ");
@@ -1307,6 +2017,26 @@ void KotlinWriter::WriteImports() {
         mangled = MangleName(import->field_name);
         std::string name =
             DefineImportName(func.name, import->module_name, mangled);
+        std::string typed = DefineTypedFunc(func.decl.sig);
+        if (!typed.empty()) {
+          // Use the import as-is if it already has our interface, otherwise
+          // wrap it once here rather than boxing on every call.
+          Write(name, ": ", typed, " = moduleRegistry.importFunc(\"",
+                MangleName(import->module_name), "\", \"", mangled, "\", ",
+                typed, "::class.java) { w2k_func: ");
+          WriteFuncType(func.decl);
+          Write(" ->", Newline());
+          Indent(4);
+          Write("object : ", typed, " { override fun invoke(");
+          WriteTypedFuncParams(func.decl.sig);
+          Write("): ", ResultType(func.decl.sig.result_types),
+                " = w2k_func(");
+          WriteTypedFuncArgs(func.decl.sig);
+          Write(") } }");
+          Dedent(4);
+          Write(Newline());
+          continue;
+        }
         Write(name, ": ");
         WriteFuncType(func.decl);
         type = "Func";
@@ -1315,17 +2045,18 @@ void KotlinWriter::WriteImports() {
 
       case ExternalKind::Global: {
         const Global& global = cast<GlobalImport>(import)->global;
+        Write("val ");
+        mangled = MangleName(import->field_name);
+        std::string name =
+            DefineImportName(global.name, import->module_name, mangled);
         if (global.mutable_) {
-          Write("var ");
+          global_cells_.insert(global.name);
+          Write(name, ": ", GlobalCellType(global.type));
           type = "Global";
-          delegate = true;
         } else {
-          Write("val ");
+          WriteGlobal(global, name);
           type = "Constant";
         }
-        mangled = MangleName(import->field_name);
-        WriteGlobal(global, DefineImportName(global.name, import->module_name,
-                                             mangled));
         break;
       }
 
@@ -1361,7 +2092,7 @@ void KotlinWriter::WriteImports() {
       default:
         WABT_UNREACHABLE;
     }
-    WriteImport(type, import->module_name, mangled, delegate);
+    WriteImport(type, import->module_name, mangled);
 
     Write(Newline());
   }
@@ -1378,6 +2109,65 @@ void KotlinWriter::WriteFuncType(const FuncDeclaration& decl) {
   Write(") -> ", ResultType(decl.sig.result_types));
 }
 
+void KotlinWriter::WriteTypedFuncParams(const FuncSignature& sig) {
+  Indent(4);
+  for (Index i = 0; i < sig.GetNumParams(); ++i) {
+    if (i != 0) {
+      Write(", ");
+      if ((i % 8) == 0)
+        Write(Newline());
+    }
+    Writef("w2k_p%u", i);
+    Write(": ", sig.GetParamType(i));
+  }
+  Dedent(4);
+}
+
+void KotlinWriter::WriteTypedFuncArgs(const FuncSignature& sig) {
+  for (Index i = 0; i < sig.GetNumParams(); ++i) {
+    if (i != 0) {
+      Write(", ");
+    }
+    Writef("w2k_p%u", i);
+  }
+}
+
+void KotlinWriter::WriteTypedFuncRef(const Func& func) {
+  std::string type = DefineTypedFunc(func.decl.sig);
+  if (type.empty()) {
+    Write(ExternalPtr(func.name));
+    return;
+  }
+  if (UsesTrampoline(func)) {
+    // So that indirect tail calls to it can go through the trampoline too.
+    Write("(", tail_object_sym_map_[func.name], " as ", type, ")");
+    return;
+  }
+  Write("object : ", type, " { override fun invoke(");
+  WriteTypedFuncParams(func.decl.sig);
+  Write("): ", ResultType(func.decl.sig.result_types), " = ",
+        GlobalName(func.name), "(");
+  WriteTypedFuncArgs(func.decl.sig);
+  Write(") }");
+}
+
+void KotlinWriter::WriteTypedFuncs() {
+  // One fun interface per signature, with a primitive invoke. They extend the
+  // function type so they can still go anywhere a lambda does, but calls
+  // through the interface itself skip the boxing bridge. They're public so
+  // the host can implement imports with them directly.
+  for (const auto& [name, sig] : typed_func_map_) {
+    FuncDeclaration decl;
+    decl.sig = sig;
+    Write(Newline(), "fun interface ", name, " : ");
+    WriteFuncType(decl);
+    Write(" ", OpenBrace(), "override fun invoke(");
+    WriteTypedFuncParams(sig);
+    Write("): ", ResultType(sig.result_types), Newline());
+    Write(CloseBrace(), Newline());
+  }
+}
+
 void KotlinWriter::AllocateFuncs() {
   if (module_->funcs.size() == module_->num_func_imports)
     return;
@@ -1385,28 +2175,633 @@ void KotlinWriter::AllocateFuncs() {
   Index func_index = 0;
   for (const Func* func : module_->funcs) {
     bool is_import = func_index < module_->num_func_imports;
-    if (!is_import) {
+    if (!is_import && used_funcs_[func_index]) {
       DefineGlobalScopeName(func->name);
+      std::string prefix(StripLeadingDollar(func->name));
+      if (NeedsTrampoline(*func, func->exprs)) {
+        // Multi-value ones return their extra results through the result
+        // fields, like an _mv form would.
+        tail_call_sym_map_.emplace(
+            func->name, DefineName(&global_syms_, prefix + "_tc"));
+        tail_object_sym_map_.emplace(
+            func->name, DefineName(&global_syms_, prefix + "_tail"));
+      } else if (options_.multi_value_fields && func->GetNumResults() > 1) {
+        result_fields_sym_map_.emplace(
+            func->name, DefineName(&global_syms_, prefix + "_mv"));
+      }
     }
     ++func_index;
   }
 }
 
-void KotlinWriter::WriteGlobals() {
-  Index global_index = 0;
-  if (module_->globals.size() != module_->num_global_imports) {
+bool KotlinWriter::UsesResultFields(const Func& func) const {
+  return result_fields_sym_map_.count(func.name) != 0;
+}
+
+bool KotlinWriter::ReturnsThroughFields(const Func& func) const {
+  return UsesResultFields(func) ||
+         (UsesTrampoline(func) && func.GetNumResults() > 1);
+}
+
+std::string KotlinWriter::ResultField(Index index, Type type) {
+  return StringPrintf("mv_%c%u", MangleType(type), index);
+}
+
+std::string KotlinWriter::ScratchArg() {
+  func_includes_.insert(scratch_name_);
+  return scratch_name_;
+}
+
+std::string KotlinWriter::ScratchField(const std::string& field) {
+  return ScratchArg() + "." + field;
+}
+
+void KotlinWriter::WriteScratch() {
+  // The result fields and tail call slots pass values between a call and
+  // its caller or trampoline on the same thread, so each thread gets its own
+  // set. It's looked up once on entry from outside (exports, tables, plain
+  // functions) and passed down to the _mv and _tc functions.
+  if (result_fields_sym_map_.empty() && tail_call_sym_map_.empty()) {
+    return;
+  }
+  Write(Newline(), MemberVisibility(), "class Scratch ", OpenBrace());
+  WriteResultFields();
+  WriteTailCallSlots();
+  Write(CloseBrace(), Newline());
+  Write(MemberVisibility(), "val scratch: ThreadLocal<Scratch> = ",
+        "ThreadLocal.withInitial { Scratch() }", Newline());
+}
+
+void KotlinWriter::WriteScratchLocal() {
+  Write("val ", scratch_name_, " = scratch.get()", Newline());
+}
+
+void KotlinWriter::WriteResultFields() {
+  // Results after the first go in these, shared between all functions. The
+  // caller reads them right after the call returns.
+  std::set<std::pair<Index, Type>> fields;
+  for (const Func* func : module_->funcs) {
+    if (ReturnsThroughFields(*func)) {
+      for (Index i = 1; i < func->GetNumResults(); ++i) {
+        fields.emplace(i, func->GetResultType(i));
+      }
+    }
+  }
+  for (const auto& [index, type] : fields) {
+    Write("@JvmField var ", ResultField(index, type), ": ", type, " = ",
+          ZeroValue(type), Newline());
+  }
+}
+
+void KotlinWriter::WriteResultFieldsAdapter(const Func& func) {
+  // The lambda-returning form, for exports and tables.
+  Write(FunHeader(GetGlobalName(func.name)), "(");
+  Indent(4);
+  for (Index i = 0; i < func.GetNumParams(); ++i) {
+    if (i != 0) {
+      Write(", ");
+      if ((i % 8) == 0)
+        Write(Newline());
+    }
+    Writef("w2k_p%u", i);
+    Write(": ", func.GetParamType(i));
+  }
+  Dedent(4);
+  Write("): ", ResultType(func.decl.sig.result_types), OpenBrace());
+  Write("val w2k_scratch = scratch.get()", Newline());
+  bool trampoline = UsesTrampoline(func);
+  Write("val w2k_r0 = ");
+  if (trampoline) {
+    Write("tc_trampoline_", MangleResults(func.decl.sig.result_types),
+          "(w2k_scratch, ", tail_call_sym_map_[func.name], "(w2k_scratch");
+  } else {
+    Write(result_fields_sym_map_[func.name], "(w2k_scratch");
+  }
+  for (Index i = 0; i < func.GetNumParams(); ++i) {
+    Writef(", w2k_p%u", i);
+  }
+  Write(trampoline ? "))" : ")", Newline());
+  for (Index i = 1; i < func.GetNumResults(); ++i) {
+    Writef("val w2k_r%u = ", i);
+    Write("w2k_scratch.", ResultField(i, func.GetResultType(i)), Newline());
+  }
+  Write("return { it(");
+  for (Index i = 1; i < func.GetNumResults(); ++i) {
+    if (i != 1) {
+      Write(", ");
+    }
+    Writef("w2k_r%u", i);
+  }
+  Write("); w2k_r0 }", Newline());
+  Write(CloseBrace());
+}
+
+// Tail calls to other functions return to a trampoline in the first
+// non-tail caller, which then makes the call, so a chain of them runs in
+// constant stack. A direct tail call only needs it if the callee makes tail
+// calls of its own; calls to imports stay plain.
+bool KotlinWriter::NeedsTrampoline(const Func& func,
+                                   const ExprList& exprs,
+                                   bool check_targets) const {
+  for (const Expr& expr : exprs) {
+    switch (expr.type()) {
+      case ExprType::ReturnCall: {
+        const Var& var = cast<ReturnCallExpr>(&expr)->var;
+        const Func* target = module_->GetFunc(var);
+        if (module_->GetFuncIndex(var) >= module_->num_func_imports &&
+            target != &func &&
+            (!check_targets ||
+             NeedsTrampoline(*target, target->exprs, false))) {
+          return true;
+        }
+        break;
+      }
+
+      case ExprType::ReturnCallIndirect:
+        return true;
+
+      case ExprType::Block:
+        if (NeedsTrampoline(func, cast<BlockExpr>(&expr)->block.exprs,
+                            check_targets)) {
+          return true;
+        }
+        break;
+
+      case ExprType::Loop:
+        if (NeedsTrampoline(func, cast<LoopExpr>(&expr)->block.exprs,
+                            check_targets)) {
+          return true;
+        }
+        break;
+
+      case ExprType::If: {
+        const IfExpr& if_ = *cast<IfExpr>(&expr);
+        if (NeedsTrampoline(func, if_.true_.exprs, check_targets) ||
+            NeedsTrampoline(func, if_.false_, check_targets)) {
+          return true;
+        }
+        break;
+      }
+
+      case ExprType::Try: {
+        const TryExpr& tryexpr = *cast<TryExpr>(&expr);
+        if (NeedsTrampoline(func, tryexpr.block.exprs, check_targets)) {
+          return true;
+        }
+        for (const Catch& c : tryexpr.catches) {
+          if (NeedsTrampoline(func, c.exprs, check_targets)) {
+            return true;
+          }
+        }
+        break;
+      }
+
+      default:
+        break;
+    }
+  }
+  return false;
+}
+
+// static
+bool KotlinWriter::HasSelfTailCall(const Func& func,
+                                   const ExprList& exprs,
+                                   const Module& module) {
+  for (const Expr& expr : exprs) {
+    switch (expr.type()) {
+      case ExprType::ReturnCall:
+        if (module.GetFunc(cast<ReturnCallExpr>(&expr)->var) == &func) {
+          return true;
+        }
+        break;
+
+      case ExprType::Block:
+        if (HasSelfTailCall(func, cast<BlockExpr>(&expr)->block.exprs,
+                            module)) {
+          return true;
+        }
+        break;
+
+      case ExprType::Loop:
+        if (HasSelfTailCall(func, cast<LoopExpr>(&expr)->block.exprs,
+                            module)) {
+          return true;
+        }
+        break;
+
+      case ExprType::If: {
+        const IfExpr& if_ = *cast<IfExpr>(&expr);
+        if (HasSelfTailCall(func, if_.true_.exprs, module) ||
+            HasSelfTailCall(func, if_.false_, module)) {
+          return true;
+        }
+        break;
+      }
+
+      case ExprType::Try: {
+        const TryExpr& tryexpr = *cast<TryExpr>(&expr);
+        if (HasSelfTailCall(func, tryexpr.block.exprs, module)) {
+          return true;
+        }
+        for (const Catch& c : tryexpr.catches) {
+          if (HasSelfTailCall(func, c.exprs, module)) {
+            return true;
+          }
+        }
+        break;
+      }
+
+      default:
+        break;
+    }
+  }
+  return false;
+}
+
+bool KotlinWriter::UsesTrampoline(const Func& func) const {
+  return tail_call_sym_map_.count(func.name) != 0;
+}
+
+bool KotlinWriter::HasTrampolineTarget(const FuncSignature& sig) const {
+  for (const Func* func : module_->funcs) {
+    if (UsesTrampoline(*func) && func->decl.sig == sig) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// static
+std::string KotlinWriter::TailCallSlot(Index index, Type type) {
+  return StringPrintf("tc_%c%u", MangleType(type), index);
+}
+
+// static
+std::string KotlinWriter::MangleResults(const TypeVector& types) {
+  if (types.empty()) {
+    return "v";
+  }
+  std::string result;
+  for (Type type : types) {
+    result += MangleType(type);
+  }
+  return result;
+}
+
+// The part of a multi-value result that the trampoline passes along; the
+// rest is in the result fields.
+// static
+TypeVector KotlinWriter::FirstResult(const TypeVector& types) {
+  return types.empty() ? TypeVector() : TypeVector{types[0]};
+}
+
+// static
+std::string KotlinWriter::TailCallNext(const TypeVector& result_types) {
+  return "tc_next_" + MangleResults(result_types);
+}
+
+// static
+std::string KotlinWriter::TailFnType(const TypeVector& result_types) {
+  return "TailFn_" + MangleResults(result_types);
+}
+
+void KotlinWriter::WriteTailCallSlots() {
+  // The arguments of the next call go in the slots, and what to call in the
+  // next field for its result type. Like the result fields they're shared
+  // between all functions, since the trampoline makes the call as soon as
+  // the function that set them returns.
+  std::map<std::string, TypeVector> results;
+  std::map<char, Index> slots;
+  for (const Func* func : module_->funcs) {
+    if (!UsesTrampoline(*func)) {
+      continue;
+    }
+    results.emplace(TailCallNext(func->decl.sig.result_types),
+                    func->decl.sig.result_types);
+    std::map<char, Index> counts;
+    for (Type type : func->decl.sig.param_types) {
+      Index count = ++counts[MangleType(type)];
+      Index& max = slots[MangleType(type)];
+      max = std::max(max, count);
+    }
+  }
+
+  for (Type type : kVarTypes) {
+    for (Index i = 0; i < slots[MangleType(type)]; ++i) {
+      Write("@JvmField var ", TailCallSlot(i, type), ": ", type, " = ",
+            ZeroValue(type), Newline());
+    }
+  }
+  for (const auto& [next, result_types] : results) {
+    Write("@JvmField var ", next, ": ", TailFnType(result_types),
+          "? = null", Newline());
+  }
+}
+
+void KotlinWriter::WriteTrampolines() {
+  if (tail_call_sym_map_.empty()) {
+    return;
+  }
+  std::map<std::string, TypeVector> results;
+  for (const Func* func : module_->funcs) {
+    if (UsesTrampoline(*func)) {
+      results.emplace(TailCallNext(func->decl.sig.result_types),
+                      func->decl.sig.result_types);
+    }
+  }
+
+  for (const auto& [next, result_types] : results) {
+    std::string type = TailFnType(result_types);
+    Write(Newline(), MemberVisibility(), "interface ", type, " ",
+          OpenBrace());
+    // Only the module that set the slots can make the call.
+    Write("val owner: Any", Newline());
+    Write("fun bounce(w2k_scratch: Scratch): ",
+          ResultType(FirstResult(result_types)), Newline());
+    Write(CloseBrace(), Newline());
+
+    Write(Newline(), MemberVisibility(), "fun tc_trampoline_",
+          MangleResults(result_types), "(w2k_scratch: Scratch");
+    if (!result_types.empty()) {
+      Write(", w2k_r: ", result_types[0]);
+    }
+    Write("): ", ResultType(FirstResult(result_types)), OpenBrace());
+    if (!result_types.empty()) {
+      Write("var w2k_result = w2k_r", Newline());
+    }
+    Write("var w2k_next = w2k_scratch.", next, Newline());
+    Write("while (w2k_next != null) ", OpenBrace());
+    Write("w2k_scratch.", next, " = null", Newline());
+    if (!result_types.empty()) {
+      Write("w2k_result = ");
+    }
+    Write("w2k_next.bounce(w2k_scratch)", Newline());
+    Write("w2k_next = w2k_scratch.", next, Newline());
+    Write(CloseBrace(), Newline());
+    if (!result_types.empty()) {
+      Write("return w2k_result", Newline());
+    }
+    Write(CloseBrace(), Newline());
+  }
+
+  Write(Newline());
+  for (const Func* func : module_->funcs) {
+    if (!UsesTrampoline(*func)) {
+      continue;
+    }
+    const FuncSignature& sig = func->decl.sig;
+    std::string type = TailFnType(sig.result_types);
+    std::string typed = DefineTypedFunc(sig);
+    Write(MemberVisibility(), "val ", tail_object_sym_map_[func->name], ": ",
+          type, " = object : ");
+    if (!typed.empty()) {
+      Write(typed, ", ");
+    }
+    Write(type, " ", OpenBrace());
+    Write("override val owner: Any get() = this@", class_name_, Newline());
+    if (!typed.empty()) {
+      Write("override fun invoke(");
+      WriteTypedFuncParams(sig);
+      Write("): ", ResultType(sig.result_types), " = ",
+            GlobalName(func->name), "(");
+      WriteTypedFuncArgs(sig);
+      Write(")", Newline());
+    }
+    Write("override fun bounce(w2k_scratch: Scratch): ",
+          ResultType(FirstResult(sig.result_types)), " = ",
+          tail_call_sym_map_[func->name], "(w2k_scratch");
+    std::map<char, Index> counts;
+    for (Index i = 0; i < sig.GetNumParams(); ++i) {
+      Type type = sig.GetParamType(i);
+      Write(", w2k_scratch.", TailCallSlot(counts[MangleType(type)]++, type));
+    }
+    Write(")", Newline());
+    Write(CloseBrace(), Newline());
+  }
+}
+
+void KotlinWriter::WriteTailCallAdapter(const Func& func) {
+  // The plain form, for calls that aren't tail calls: runs the trampoline
+  // until the last tail call returns.
+  const FuncSignature& sig = func.decl.sig;
+  Write(FunHeader(GetGlobalName(func.name)), "(");
+  WriteTypedFuncParams(sig);
+  Write("): ", ResultType(sig.result_types), OpenBrace());
+  Write("val w2k_scratch = scratch.get()", Newline());
+  std::string call = tail_call_sym_map_[func.name] + "(w2k_scratch";
+  if (sig.GetNumParams() != 0) {
+    call += ", ";
+  }
+  if (sig.result_types.empty()) {
+    Write(call);
+    WriteTypedFuncArgs(sig);
+    Write(")", Newline(), "tc_trampoline_v(w2k_scratch)", Newline());
+  } else {
+    Write("return tc_trampoline_", MangleResults(sig.result_types),
+          "(w2k_scratch, ", call);
+    WriteTypedFuncArgs(sig);
+    Write("))", Newline());
+  }
+  Write(CloseBrace());
+}
+
+// With |calls|, also collects the targets of direct calls.
+void KotlinWriter::CollectFuncRefs(const ExprList& exprs,
+                                   std::set<Index>* func_indexes,
+                                   bool calls) const {
+  for (const Expr& expr : exprs) {
+    switch (expr.type()) {
+      case ExprType::RefFunc:
+        func_indexes->insert(
+            module_->GetFuncIndex(cast<RefFuncExpr>(&expr)->var));
+        break;
+
+      case ExprType::Call:
+        if (calls) {
+          func_indexes->insert(
+              module_->GetFuncIndex(cast<CallExpr>(&expr)->var));
+        }
+        break;
+
+      case ExprType::ReturnCall:
+        if (calls) {
+          func_indexes->insert(
+              module_->GetFuncIndex(cast<ReturnCallExpr>(&expr)->var));
+        }
+        break;
+
+      case ExprType::Block:
+        CollectFuncRefs(cast<BlockExpr>(&expr)->block.exprs, func_indexes,
+                        calls);
+        break;
+
+      case ExprType::Loop:
+        CollectFuncRefs(cast<LoopExpr>(&expr)->block.exprs, func_indexes,
+                        calls);
+        break;
+
+      case ExprType::If: {
+        const IfExpr& if_ = *cast<IfExpr>(&expr);
+        CollectFuncRefs(if_.true_.exprs, func_indexes, calls);
+        CollectFuncRefs(if_.false_, func_indexes, calls);
+        break;
+      }
+
+      case ExprType::Try: {
+        const TryExpr& tryexpr = *cast<TryExpr>(&expr);
+        CollectFuncRefs(tryexpr.block.exprs, func_indexes, calls);
+        for (const Catch& c : tryexpr.catches) {
+          CollectFuncRefs(c.exprs, func_indexes, calls);
+        }
+        break;
+      }
+
+      default:
+        break;
+    }
+  }
+}
+
+// Toolchains link in much more than is ever called, and kotlinc is slow to
+// compile it all. Functions (and function imports) that can't be reached from
+// the exports, start functions, active or passive elem segments or global
+// initializers can be left out; tables can only hold functions from those or
+// from ref.func.
+void KotlinWriter::FindUsedFuncs() {
+  used_funcs_.assign(module_->funcs.size(), !options_.remove_unused_funcs);
+  if (!options_.remove_unused_funcs) {
+    return;
+  }
+
+  std::set<Index> roots;
+  for (const Export* export_ : module_->exports) {
+    if (export_->kind == ExternalKind::Func) {
+      roots.insert(module_->GetFuncIndex(export_->var));
+    }
+  }
+  for (const Var* var : module_->starts) {
+    roots.insert(module_->GetFuncIndex(*var));
+  }
+  for (const ElemSegment* elem_segment : module_->elem_segments) {
+    // Declared ones only allow ref.func to name their functions.
+    if (elem_segment->kind == SegmentKind::Declared) {
+      continue;
+    }
+    for (const ExprList& elem_expr : elem_segment->elem_exprs) {
+      CollectFuncRefs(elem_expr, &roots);
+    }
+  }
+  for (const Global* global : module_->globals) {
+    CollectFuncRefs(global->init_expr, &roots);
+  }
+
+  std::vector<Index> pending(roots.begin(), roots.end());
+  for (Index func_index : pending) {
+    used_funcs_[func_index] = true;
+  }
+  while (!pending.empty()) {
+    const Func* func = module_->funcs[pending.back()];
+    pending.pop_back();
+    std::set<Index> targets;
+    CollectFuncRefs(func->exprs, &targets, true);
+    for (Index target : targets) {
+      if (!used_funcs_[target]) {
+        used_funcs_[target] = true;
+        pending.push_back(target);
+      }
+    }
+  }
+
+  if (options_.report_stream) {
+    Index num_imports = module_->num_func_imports;
+    Index used_imports = std::count(used_funcs_.begin(),
+                                    used_funcs_.begin() + num_imports, true);
+    Index used_funcs = std::count(used_funcs_.begin() + num_imports,
+                                  used_funcs_.end(), true);
+    Index num_funcs = module_->funcs.size() - num_imports;
+    options_.report_stream->Writef(
+        "removed %" PRIindex " of %" PRIindex " functions and %" PRIindex
+        " of %" PRIindex " function imports\n",
+        num_funcs - used_funcs, num_funcs, num_imports - used_imports,
+        num_imports);
+  }
+}
+
+bool KotlinWriter::IsFuncUsed(const Func& func) const {
+  return used_funcs_[module_->func_bindings.FindIndex(func.name)];
+}
+
+void KotlinWriter::WriteFuncRefs() {
+  // Written before the globals and elem segments, which can hold them. Keyed
+  // by index so the output doesn't depend on where the Funcs were allocated.
+  std::set<Index> func_indexes;
+  for (const Global* global : module_->globals) {
+    CollectFuncRefs(global->init_expr, &func_indexes);
+  }
+  for (const ElemSegment* elem_segment : module_->elem_segments) {
+    if (elem_segment->kind == SegmentKind::Declared) {
+      continue;
+    }
+    for (const ExprList& elem_expr : elem_segment->elem_exprs) {
+      CollectFuncRefs(elem_expr, &func_indexes);
+    }
+  }
+  for (const Func* func : module_->funcs) {
+    if (IsFuncUsed(*func)) {
+      CollectFuncRefs(func->exprs, &func_indexes);
+    }
+  }
+  if (func_indexes.empty()) {
+    return;
+  }
+
+  Write(Newline());
+  for (Index func_index : func_indexes) {
+    const Func* func = module_->funcs[func_index];
+    std::string name = DefineName(
+        &global_syms_, std::string(StripLeadingDollar(func->name)) + "_ref");
+    func_ref_sym_map_.emplace(func->name, name);
+    Write(MemberVisibility(), "val ", name, ": " WASM_RT_PKG ".Elem = ",
+          WASM_RT_PKG ".Elem(func_types[",
+          module_->GetFuncTypeIndex(func->decl.type_var), "], ");
+    if (func_index < module_->num_func_imports) {
+      Write(GlobalName(func->name));
+    } else {
+      WriteTypedFuncRef(*func);
+    }
+    Write(")", Newline());
+  }
+}
+
+void KotlinWriter::WriteGlobals() {
+  for (const Export* export_ : module_->exports) {
+    if (export_->kind == ExternalKind::Global) {
+      const Global* global = module_->GetGlobal(export_->var);
+      if (global->mutable_) {
+        global_cells_.insert(global->name);
+      }
+    }
+  }
+
+  Index global_index = 0;
+  if (module_->globals.size() != module_->num_global_imports) {
     Write(Newline());
 
     for (const Global* global : module_->globals) {
       bool is_import = global_index < module_->num_global_imports;
       if (!is_import) {
-        Write("private ");
-        if (global->mutable_) {
-          Write("var ");
+        Write(MemberVisibility());
+        if (IsGlobalCell(global->name)) {
+          Write("val ", DefineGlobalScopeName(global->name), ": ",
+                GlobalCellType(global->type));
         } else {
-          Write("val ");
+          if (global->mutable_) {
+            Write("var ");
+          } else {
+            Write("val ");
+          }
+          WriteGlobal(*global, DefineGlobalScopeName(global->name));
         }
-        WriteGlobal(*global, DefineGlobalScopeName(global->name));
         Write(";", Newline());
       }
       ++global_index;
@@ -1420,7 +2815,13 @@ void KotlinWriter::WriteGlobals() {
     if (!is_import) {
       assert(!global->init_expr.empty());
       Write(GlobalName(global->name), " = ");
-      WriteInitExpr(global->init_expr);
+      if (IsGlobalCell(global->name)) {
+        Write(GlobalCellType(global->type), "(");
+        WriteInitExpr(global->init_expr);
+        Write(")");
+      } else {
+        WriteInitExpr(global->init_expr);
+      }
       Write(";", Newline());
     }
     ++global_index;
@@ -1432,6 +2833,100 @@ void KotlinWriter::WriteGlobal(const Global& global, const std::string& name) {
   Write(name, ": ", global.type);
 }
 
+// Our own immutable globals initialized with a number can only ever hold
+// that number, so reads of them are written as the literal, like an
+// i32.const, and fold like one too. The field stays for exports. V128s would
+// allocate on every read, and a null literal loses the reference's type.
+const Const* KotlinWriter::ConstantGlobalValue(const Var& var) const {
+  if (module_->GetGlobalIndex(var) < module_->num_global_imports) {
+    return nullptr;
+  }
+  const Global* global = module_->GetGlobal(var);
+  if (global->mutable_ || global->init_expr.size() != 1 ||
+      global->init_expr.front().type() != ExprType::Const) {
+    return nullptr;
+  }
+  const Const& const_ = cast<ConstExpr>(&global->init_expr.front())->const_;
+  switch (const_.type()) {
+    case Type::I32:
+    case Type::I64:
+    case Type::F32:
+    case Type::F64:
+      return &const_;
+    default:
+      return nullptr;
+  }
+}
+
+bool KotlinWriter::IsGlobalCell(const std::string& name) const {
+  return global_cells_.count(name) != 0;
+}
+
+// static
+const char* KotlinWriter::GlobalCellType(Type type) {
+  switch (type) {
+    case Type::I32:
+      return WASM_RT_PKG ".GlobalI32";
+    case Type::I64:
+      return WASM_RT_PKG ".GlobalI64";
+    case Type::F32:
+      return WASM_RT_PKG ".GlobalF32";
+    case Type::F64:
+      return WASM_RT_PKG ".GlobalF64";
+    case Type::V128:
+      return WASM_RT_PKG ".GlobalV128";
+    case Type::FuncRef:
+    case Type::ExternRef:
+      return WASM_RT_PKG ".GlobalRef";
+    default:
+      WABT_UNREACHABLE;
+  }
+}
+
+// static
+const char* KotlinWriter::ZeroValue(Type type) {
+  switch (type) {
+    case Type::I32:
+    case Type::I64:
+      return "0";
+    case Type::F32:
+      return "0.0f";
+    case Type::F64:
+      return "0.0";
+    case Type::V128:
+      return WASM_RT_PKG ".V128.ZERO";
+    case Type::FuncRef:
+    case Type::ExternRef:
+      return "null";
+    default:
+      WABT_UNREACHABLE;
+  }
+}
+
+// static
+std::string KotlinWriter::LongLiteral(uint64_t bits) {
+  int64_t value = static_cast<int64_t>(bits);
+  if (value == std::numeric_limits<int64_t>::min()) {
+    return "(-0x7FFFFFFFFFFFFFFFL - 1L)";
+  }
+  return StringPrintf("%" PRId64 "L", value);
+}
+
+// static
+std::string KotlinWriter::V128Literal(v128 bits) {
+  return WASM_RT_PKG ".V128(" + LongLiteral(bits.u64(0)) + ", " +
+         LongLiteral(bits.u64(1)) + ")";
+}
+
+// static
+std::string KotlinWriter::OpcodeFuncName(Opcode opcode) {
+  // The runtime names each SIMD and atomic helper after its opcode, with '_'
+  // for '.'.
+  std::string name = opcode.GetName();
+  std::replace(name.begin(), name.end(), '.', '_');
+  return name;
+}
+
 void KotlinWriter::WriteMemories() {
   if (module_->memories.size() == module_->num_memory_imports)
     return;
@@ -1442,12 +2937,16 @@ void KotlinWriter::WriteMemories() {
   for (const Memory* memory : module_->memories) {
     bool is_import = memory_index < module_->num_memory_imports;
     if (!is_import) {
-      Write("private var ");
+      Write(MemberVisibility(), "var ");
       WriteMemory(DefineGlobalScopeName(memory->name));
       uint32_t max =
           memory->page_limits.has_max ? memory->page_limits.max : 65536;
       Write(" = " WASM_RT_PKG ".Memory(", memory->page_limits.initial, ", ");
       Writef("%d", static_cast<int32_t>(max));
+      Write(", moduleRegistry.memoryBackend(name, ", memory_index, ")");
+      if (memory->page_limits.is_shared) {
+        Write(", shared = true");
+      }
       Write(");", Newline());
     }
     ++memory_index;
@@ -1465,12 +2964,11 @@ void KotlinWriter::WriteTables() {
 
   Write(Newline());
 
-  assert(module_->tables.size() <= 1);
   Index table_index = 0;
   for (const Table* table : module_->tables) {
     bool is_import = table_index < module_->num_table_imports;
     if (!is_import) {
-      Write("private var ");
+      Write(MemberVisibility(), "var ");
       WriteTable(DefineGlobalScopeName(table->name));
       uint32_t max =
           table->elem_limits.has_max ? table->elem_limits.max : UINT32_MAX;
@@ -1493,38 +2991,30 @@ static inline bool is_droppable(const DataSegment* data_segment) {
 
 // base64 is better, inspired by:
 // https://thephd.dev/implementing-embed-c-and-c++
-const char base64_alphabet[] =
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
 void KotlinWriter::WriteDataSegmentData(const DataSegment* data_segment) {
-  size_t i = 0;
-  uint32_t data = 0;
-  for (uint8_t x : data_segment->data) {
-    data = (data << 8) | x;
-    if ((i++ % 3) == 2) {
-      Writef("%c", base64_alphabet[(data >> 18) & 0x3F]);
-      Writef("%c", base64_alphabet[(data >> 12) & 0x3F]);
-      Writef("%c", base64_alphabet[(data >> 6) & 0x3F]);
-      Writef("%c", base64_alphabet[(data)&0x3F]);
-    }
-  }
-  if ((i % 3) == 1) {
-    data = data << 4;
-    Writef("%c", base64_alphabet[(data >> 6) & 0x3F]);
-    Writef("%c", base64_alphabet[(data)&0x3F]);
-  } else if ((i % 3) == 2) {
-    data = data << 2;
-    Writef("%c", base64_alphabet[(data >> 12) & 0x3F]);
-    Writef("%c", base64_alphabet[(data >> 6) & 0x3F]);
-    Writef("%c", base64_alphabet[(data)&0x3F]);
+  // Encode a chunk at a time, so there's only one write per chunk no matter
+  // how big the segment is.
+  const size_t kChunkSize = 3 * 1024;
+  char buffer[Base64EncodedSize(kChunkSize)];
+  const uint8_t* data = data_segment->data.data();
+  size_t size = data_segment->data.size();
+  for (size_t offset = 0; offset < size; offset += kChunkSize) {
+    size_t chunk_size = std::min(kChunkSize, size - offset);
+    Base64Encode(data + offset, chunk_size, buffer);
+    WriteData(buffer, Base64EncodedSize(chunk_size));
   }
 }
 
 void KotlinWriter::WriteDataInitializers() {
+  if (data_stream_) {
+    WriteDataFileInitializers();
+    return;
+  }
   for (const DataSegment* data_segment : module_->data_segments) {
     DefineGlobalScopeName(data_segment->name);
     if (data_segment->data.size()) {
-      Write(Newline(), "private ", is_droppable(data_segment) ? "var" : "val",
+      Write(Newline(), MemberVisibility(),
+            is_droppable(data_segment) ? "var" : "val",
             " data_segment_data_", GlobalName(data_segment->name),
             ": ByteArray = " WASM_RT_PKG ".loadb64(\"");
       WriteDataSegmentData(data_segment);
@@ -1544,44 +3034,73 @@ void KotlinWriter::WriteDataInitializers() {
     if (data_segment->data.empty()) {
       Write(", byteArrayOf());", Newline());
     } else {
-      Write(", " WASM_RT_PKG ".loadb64(\"");
-      WriteDataSegmentData(data_segment);
-      Write("\"));", Newline());
+      // Already decoded for the field above.
+      Write(", data_segment_data_", GlobalName(data_segment->name), ");",
+            Newline());
     }
   }
 
   Write(CloseBrace(), Newline());
 }
 
-static inline bool is_droppable(const ElemSegment* elem_segment) {
-  return (elem_segment->kind == SegmentKind::Passive) &&
-         (!elem_segment->elem_exprs.empty());
-}
+void KotlinWriter::WriteDataFileInitializers() {
+  // All the segments go in the data file back to back, and are copied from
+  // one read of it. Only passive segments need to keep their bytes.
+  size_t data_size = 0;
+  for (const DataSegment* data_segment : module_->data_segments) {
+    DefineGlobalScopeName(data_segment->name);
+    if (is_droppable(data_segment)) {
+      Write(Newline(), MemberVisibility(), "var data_segment_data_",
+            GlobalName(data_segment->name), ": ByteArray", Newline());
+    }
+    data_size += data_segment->data.size();
+  }
 
-void KotlinWriter::WriteElemSegmentExprs(const ElemSegment* elem_segment) {
-  for (const ExprList& elem_expr : elem_segment->elem_exprs) {
-    assert(elem_expr.size() == 1);
-    const Expr& expr = elem_expr.front();
-    switch (expr.type()) {
-      case ExprType::RefFunc: {
-        const Func* func = module_->GetFunc(cast<RefFuncExpr>(&expr)->var);
-        const Index func_type_index =
-            module_->GetFuncTypeIndex(func->decl.type_var);
-        bool is_import = import_syms_.count(func->name) != 0;
-        Write(WASM_RT_PKG ".Func(", func_type_index, ", ");
-        if (!is_import) {
-          Write(ExternalPtr(func->name));
-        } else {
-          Write(GlobalName(func->name));
-        }
-        Write("), ", Newline());
-      } break;
-      case ExprType::RefNull:
-        Write("null, ", Newline());
-        break;
-      default:
-        WABT_UNREACHABLE;
+  Write(Newline(), "init /* memory */ ", OpenBrace());
+  if (data_size != 0) {
+    Write("val w2k_data = " WASM_RT_PKG ".loadData(", class_name_,
+          "::class.java, \"", data_name_, "\", ", data_size, ")", Newline());
+  }
+  size_t data_offset = 0;
+  for (const DataSegment* data_segment : module_->data_segments) {
+    size_t size = data_segment->data.size();
+    if (size != 0) {
+      data_stream_->WriteData(data_segment->data.data(), size);
+    }
+    if (is_droppable(data_segment)) {
+      Write("data_segment_data_", GlobalName(data_segment->name),
+            " = w2k_data.copyOfRange(", data_offset, ", ", data_offset + size,
+            ")", Newline());
+    } else if (data_segment->kind == SegmentKind::Active) {
+      const Memory* memory =
+          module_->memories[module_->GetMemoryIndex(data_segment->memory_var)];
+      // memory_init does the same checks as put, in the same order.
+      Write(GlobalName(memory->name), ".memory_init(");
+      if (size == 0) {
+        Write("byteArrayOf(), ");
+        WriteInitExpr(data_segment->offset);
+        Write(", 0, 0);", Newline());
+      } else {
+        Write("w2k_data, ");
+        WriteInitExpr(data_segment->offset);
+        Write(", ", data_offset, ", ", size, ");", Newline());
+      }
     }
+    data_offset += size;
+  }
+
+  Write(CloseBrace(), Newline());
+}
+
+static inline bool is_droppable(const ElemSegment* elem_segment) {
+  return (elem_segment->kind == SegmentKind::Passive) &&
+         (!elem_segment->elem_exprs.empty());
+}
+
+void KotlinWriter::WriteElemSegmentExprs(const ElemSegment* elem_segment) {
+  for (const ExprList& elem_expr : elem_segment->elem_exprs) {
+    WriteInitExpr(elem_expr);
+    Write(", ", Newline());
   }
 }
 
@@ -1592,33 +3111,30 @@ void KotlinWriter::WriteElemInitializers() {
     }
 
     DefineGlobalScopeName(elem_segment->name);
-    Write(Newline(), "private var elem_segment_exprs_",
-          GlobalName(elem_segment->name),
-          ": Array<" WASM_RT_PKG ".ElemSegExpr?> = arrayOf(");
+    Write(Newline(), MemberVisibility(), "var elem_segment_exprs_",
+          GlobalName(elem_segment->name), ": Array<Any?> = arrayOf(");
     WriteElemSegmentExprs(elem_segment);
     Write(");", Newline());
   }
 
-  const Table* table = module_->tables.empty() ? nullptr : module_->tables[0];
-
   Write(Newline(), "init /* table */ ", OpenBrace());
   for (const ElemSegment* elem_segment : module_->elem_segments) {
     if (elem_segment->kind != SegmentKind::Active) {
       continue;
     }
 
+    const Table* table = module_->GetTable(elem_segment->table_var);
     Write(GlobalName(table->name), ".table_init(");
     WriteInitExpr(elem_segment->offset);
     if (elem_segment->elem_exprs.empty()) {
       // It's mandatory to handle the case of a zero-length elem segment
       // (even in a module with no types). This must trap if the offset
       // is out of bounds.
-      Write(", arrayOf(), 0, 0, intArrayOf());", Newline());
+      Write(", arrayOf(), 0, 0);", Newline());
     } else {
       Write(", arrayOf(");
       WriteElemSegmentExprs(elem_segment);
-      Write("), 0, ", elem_segment->elem_exprs.size(), ", func_types);",
-            Newline());
+      Write("), 0, ", elem_segment->elem_exprs.size(), ");", Newline());
     }
   }
 
@@ -1656,7 +3172,6 @@ void KotlinWriter::WriteExports() {
         mangled_name = ExportName(MangleName(export_->name));
         internal_name = global->name;
         if (global->mutable_) {
-          external_ptr = true;
           type = "Global";
         } else {
           type = "Constant";
@@ -1692,7 +3207,9 @@ void KotlinWriter::WriteExports() {
         WABT_UNREACHABLE;
     }
     Write("moduleRegistry.export", type, "(name, \"", mangled_name, "\", ");
-    if (external_ptr) {
+    if (export_->kind == ExternalKind::Func && external_ptr) {
+      WriteTypedFuncRef(*module_->GetFunc(export_->var));
+    } else if (external_ptr) {
       Write(ExternalPtr(internal_name));
     } else {
       Write(GlobalName(internal_name));
@@ -1715,13 +3232,138 @@ void KotlinWriter::WriteInit() {
 
 void KotlinWriter::WriteFuncs() {
   Write(Newline());
-  Index func_index = 0;
-  for (const Func* func : module_->funcs) {
-    bool is_import = func_index < module_->num_func_imports;
-    if (!is_import)
-      Write(Newline(), *func, Newline());
-    ++func_index;
+  std::vector<const Func*> funcs;
+  for (Index i = module_->num_func_imports; i < module_->funcs.size(); ++i) {
+    if (used_funcs_[i]) {
+      funcs.push_back(module_->funcs[i]);
+    }
+  }
+  for (const Func* func : funcs) {
+    PlanOutlining(*func);
+    if (!outlined_exprs_.empty()) {
+      outline_plans_[func] = {std::move(outline_regions_),
+                              std::move(outlined_exprs_), frame_class_};
+    }
+  }
+
+  if (sharded_) {
+    WriteShards(funcs);
+    return;
+  }
+  unsigned num_threads = std::min<size_t>(options_.num_threads, funcs.size());
+  if (num_threads > 1) {
+    // Every function starts on a fresh line at the same indent and leaves the
+    // writer the same way, so each one can be written on its own and the
+    // results spliced in order.
+    assert(should_write_indent_next_);
+    for (MemoryStream& output :
+         WriteFuncsToStreams(funcs, num_threads, indent_)) {
+      const std::vector<uint8_t>& data = output.output_buffer().data;
+      stream_->WriteData(data.data(), data.size());
+    }
+    return;
+  }
+  for (const Func* func : funcs) {
+    Write(Newline(), *func, Newline());
+  }
+}
+
+std::vector<MemoryStream> KotlinWriter::WriteFuncsToStreams(
+    const std::vector<const Func*>& funcs,
+    unsigned num_threads,
+    int indent) {
+  std::vector<MemoryStream> outputs(funcs.size());
+  std::vector<std::unique_ptr<KotlinWriter>> workers;
+  std::vector<std::thread> threads;
+  std::atomic<size_t> next_func{0};
+  // no more threads than functions, even if asked for more.
+  num_threads = std::max<unsigned>(
+      std::min<size_t>(num_threads, funcs.size()), 1);
+  for (unsigned i = 0; i < num_threads; ++i) {
+    workers.emplace_back(new KotlinWriter(*this));
+    KotlinWriter* worker = workers.back().get();
+    worker->indent_ = indent;
+    threads.emplace_back([worker, &funcs, &outputs, &next_func]() {
+      size_t index;
+      while ((index = next_func++) < funcs.size()) {
+        worker->kotlin_stream_ = worker->stream_ = &outputs[index];
+        worker->should_write_indent_next_ = true;
+        worker->Write(Newline(), *funcs[index], Newline());
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  for (const auto& worker : workers) {
+    call_indirect_decl_map_.insert(worker->call_indirect_decl_map_.begin(),
+                                   worker->call_indirect_decl_map_.end());
+    return_call_indirect_decl_map_.insert(
+        worker->return_call_indirect_decl_map_.begin(),
+        worker->return_call_indirect_decl_map_.end());
+    result_ |= worker->result_;
+  }
+  return outputs;
+}
+
+// static
+size_t KotlinWriter::ShardIndex(const Func& func, size_t num_shards) {
+  // FNV-1a of the name, so a function stays in its shard no matter what else
+  // is added or removed.
+  uint32_t hash = 2166136261u;
+  for (unsigned char c : func.name) {
+    hash = (hash ^ c) * 16777619u;
+  }
+  return hash % num_shards;
+}
+
+void KotlinWriter::WriteShards(const std::vector<const Func*>& funcs) {
+  // Each function becomes an extension function on the class, so whatever it
+  // uses in the class is internal instead of private.
+  std::vector<MemoryStream> outputs =
+      WriteFuncsToStreams(funcs, options_.num_threads, 0);
+  std::vector<std::vector<size_t>> shards(shard_streams_.size());
+  for (size_t i = 0; i < funcs.size(); ++i) {
+    shards[ShardIndex(*funcs[i], shards.size())].push_back(i);
+  }
+
+  Stream* class_stream = stream_;
+  int class_indent = indent_;
+  indent_ = 0;
+  for (size_t shard = 0; shard < shards.size(); ++shard) {
+    stream_ = shard_streams_[shard];
+    Write("/* Automatically generated by wasm2kotlin */", Newline());
+    WriteSuppressions("@file:");
+    if (!package_name_.empty()) {
+      Write("package ", package_name_, Newline());
+    }
+    Write(s_source_includes);
+    Write("import ");
+    if (!package_name_.empty()) {
+      Write(package_name_, ".");
+    }
+    Write(class_name_, ".*", Newline());
+    for (size_t index : shards[shard]) {
+      const std::vector<uint8_t>& data = outputs[index].output_buffer().data;
+      stream_->WriteData(data.data(), data.size());
+    }
+  }
+  stream_ = class_stream;
+  indent_ = class_indent;
+}
+
+const char* KotlinWriter::MemberVisibility() const {
+  return sharded_ ? "internal " : "private ";
+}
+
+std::string KotlinWriter::FunHeader(const std::string& name,
+                                    bool shared) const {
+  if (!sharded_) {
+    return "private fun " + name;
   }
+  return std::string(shared ? "internal" : "private") + " fun " +
+         class_name_ + "." + name;
 }
 
 void KotlinWriter::PushFuncSection(const std::string_view include_condition) {
@@ -1731,27 +3373,98 @@ void KotlinWriter::PushFuncSection(const std::string_view include_condition) {
 
 void KotlinWriter::Write(const Func& func) {
   func_ = &func;
+  outline_regions_.clear();
+  outlined_exprs_.clear();
+  auto plan = outline_plans_.find(&func);
+  if (plan != outline_plans_.end()) {
+    outline_regions_ = plan->second.regions;
+    outlined_exprs_ = plan->second.outlined_exprs;
+    frame_class_ = plan->second.frame_class;
+  }
   // Copy symbols from global symbol table so we don't shadow them.
   local_syms_ = global_syms_;
   local_sym_map_.clear();
   stack_var_sym_map_.clear();
   func_sections_.clear();
   func_includes_.clear();
+  checked_ranges_.clear();
+  checked_scopes_.clear();
+  assigned_locals_.clear();
 
   std::vector<std::string> index_to_name;
   std::vector<std::string> to_shadow;
   MakeTypeBindingReverseMapping(func_->GetNumParamsAndLocals(), func_->bindings,
                                 &index_to_name);
-
-  Write("private fun ", GlobalName(func.name), "(");
+  local_names_ = index_to_name;
+  PlanLocalSlots(func);
+  for (OutlineRegion& region : outline_regions_) {
+    // Locals sharing a variable are moved through the frame once.
+    for (auto* locals : {&region.used_locals, &region.assigned_locals}) {
+      std::set<std::string> slots;
+      for (const std::string& local : *locals) {
+        slots.insert(LocalSlotName(Var(local, Location())));
+      }
+      *locals = std::move(slots);
+    }
+  }
+  SymbolSet assigned;
+  CollectAssignedLocals(func.exprs, &assigned);
+
+  bool result_fields = ReturnsThroughFields(func);
+  bool trampoline = UsesTrampoline(func);
+  // The _mv and _tc forms get the thread's Scratch from their caller.
+  bool scratch_param = result_fields || trampoline;
+  scratch_name_ = DefineName(&local_syms_, "scratch");
+  std::string scratch_decl;
+  if (scratch_param) {
+    scratch_decl = scratch_name_ + ": Scratch";
+    if (func.GetNumParams() != 0) {
+      scratch_decl += ", ";
+    }
+  }
+  if (trampoline) {
+    Write(FunHeader(tail_call_sym_map_[func.name]), "(", scratch_decl);
+  } else if (result_fields) {
+    Write(FunHeader(result_fields_sym_map_[func.name]), "(", scratch_decl);
+  } else {
+    Write(FunHeader(GetGlobalName(func.name)), "(", scratch_decl);
+  }
   WriteParams(index_to_name, to_shadow);
-  Write(": ", ResultType(func.decl.sig.result_types), OpenBrace());
+  if (result_fields) {
+    Write(": ", func.GetResultType(0), OpenBrace());
+  } else {
+    Write(": ", ResultType(func.decl.sig.result_types), OpenBrace());
+  }
   WriteLocals(index_to_name, to_shadow);
+  if (options_.fuel) {
+    // Looked up once per call, as each thread burns its own slice.
+    fuel_name_ = DefineName(&local_syms_, "fuel");
+    WriteFuelSlice();
+  }
+  if (!outlined_exprs_.empty()) {
+    frame_name_ = DefineName(&local_syms_, "frame");
+    Write("val ", frame_name_, " = ", frame_class_, "()", Newline());
+    func_local_syms_ = local_syms_;
+  }
   Write("try ", OpenBrace());
 
+  if (!scratch_param) {
+    // Only needed if the function has multi-value calls or calls to
+    // functions with tail calls.
+    PushFuncSection(scratch_name_);
+    WriteScratchLocal();
+  }
   PushFuncSection();
 
   std::string label = DefineLocalScopeName(kImplicitFuncLabel);
+  tail_label_.clear();
+  if (HasSelfTailCall(func, func.exprs, *module_)) {
+    // Self tail calls set the params and start over.
+    tail_label_ = DefineName(&local_syms_, "Tfunc");
+    Write(LabelDecl(tail_label_), "while (true) ", OpenBrace());
+  }
+  // Inside the self tail call loop, so that each of those calls burns fuel.
+  WriteFuelCheck();
   value_stack_.clear();
   ResetTypeStack(0);
   std::string empty;  // Must not be temporary, since address is taken by Label.
@@ -1771,11 +3484,20 @@ void KotlinWriter::Write(const Func& func) {
     PushVar();
   }
   Write(CloseBrace(), " while (false);", Newline());
+  if (!tail_label_.empty()) {
+    Write("break;", Newline(), CloseBrace(), Newline());
+  }
 
   // Return the top of the stack implicitly.
   Index num_results = func.GetNumResults();
   if (num_results == 1) {
     Write("return ", StackVar(0), ";", Newline());
+  } else if (result_fields) {
+    for (Index i = 1; i < num_results; ++i) {
+      Write(ScratchField(ResultField(i, func.GetResultType(i))), " = ",
+            StackVar(num_results - i - 1), ";", Newline());
+    }
+    Write("return ", StackVar(num_results - 1), ";", Newline());
   } else if (num_results >= 2) {
     Write("return ", OpenBrace());
     Write("it(");
@@ -1783,32 +3505,575 @@ void KotlinWriter::Write(const Func& func) {
       if (i != 1) {
         Write(", ");
       }
-      Write(StackVar(num_results - i - 1));
+      Write(StackVar(num_results - i - 1));
+    }
+    Write(");", Newline(), StackVar(num_results - 1), Newline());
+    Write(CloseBrace(), Newline());
+  }
+
+  WriteFuncSections();
+
+  Write(CloseBrace(), " catch(e: StackOverflowError) ", OpenBrace(),
+        "throw " WASM_RT_PKG ".ExhaustionException(null, e)", Newline());
+  Write(CloseBrace(), " catch (d: Delegate) ", OpenBrace(), "throw d.ex",
+        Newline());
+  Write(CloseBrace(), Newline());
+
+  Write(CloseBrace());
+
+  if (result_fields) {
+    Write(Newline(), Newline());
+    WriteResultFieldsAdapter(func);
+  } else if (trampoline) {
+    Write(Newline(), Newline());
+    WriteTailCallAdapter(func);
+  }
+
+  if (!outlined_exprs_.empty()) {
+    for (const OutlineRegion& region : outline_regions_) {
+      if (region.outlined) {
+        Write(Newline(), Newline());
+        WriteOutlinedFunc(region);
+      }
+    }
+    Write(Newline(), Newline());
+    WriteFrameClass();
+  }
+
+  func_ = nullptr;
+}
+
+void KotlinWriter::WriteFuncSections() {
+  stream_ = kotlin_stream_;
+
+  WriteStackVarDeclarations();
+
+  for (auto& [condition, stream] : func_sections_) {
+    std::unique_ptr<OutputBuffer> buf = stream.ReleaseOutputBuffer();
+    if (condition.empty() || func_includes_.count(condition)) {
+      stream_->WriteData(buf->data.data(), buf->data.size());
+    }
+  }
+}
+
+// HotSpot won't JIT methods over 8000 bytes of bytecode, and kotlinc can't
+// emit methods over 64K at all. Functions larger than max_function_size get
+// blocks and loops moved into helper functions until every piece fits, or no
+// more can be moved. A region can be moved if control can only leave it by
+// falling through (or trapping/throwing), it takes no values from the stack,
+// produces at most one, and isn't inside a try. The helpers share the
+// function's locals through a frame object.
+void KotlinWriter::PlanOutlining(const Func& func) {
+  static const Index kMinOutlineSize = 16;
+
+  outline_regions_.clear();
+  outlined_exprs_.clear();
+  Index max_size = options_.max_function_size;
+  if (max_size == 0) {
+    return;
+  }
+
+  std::vector<const std::string*> labels;
+  outline_regions_.emplace_back();
+  ScanOutlineRegions(func.exprs, 0, &labels, false);
+  if (outline_regions_[0].size <= max_size) {
+    return;
+  }
+
+  std::vector<size_t> units = {0};
+  while (!units.empty()) {
+    size_t unit = units.back();
+    units.pop_back();
+    while (outline_regions_[unit].size > max_size) {
+      // Prefer the largest region that fits in a helper by itself.
+      size_t best = 0;
+      bool best_fits = false;
+      for (size_t i = 1; i < outline_regions_.size(); ++i) {
+        const OutlineRegion& region = outline_regions_[i];
+        if (!region.eligible || region.outlined ||
+            region.size < kMinOutlineSize) {
+          continue;
+        }
+        size_t owner = region.parent;
+        while (owner != 0 && !outline_regions_[owner].outlined) {
+          owner = outline_regions_[owner].parent;
+        }
+        if (owner != unit) {
+          continue;
+        }
+        bool fits = region.size <= max_size;
+        if (best == 0 || (fits && !best_fits) ||
+            (fits == best_fits &&
+             region.size > outline_regions_[best].size)) {
+          best = i;
+          best_fits = fits;
+        }
+      }
+      if (best == 0) {
+        break;
+      }
+      OutlineRegion& region = outline_regions_[best];
+      region.outlined = true;
+      Index removed = region.size - 1;
+      size_t ancestor = best;
+      do {
+        ancestor = outline_regions_[ancestor].parent;
+        outline_regions_[ancestor].size -= removed;
+      } while (ancestor != unit);
+      units.push_back(best);
+    }
+  }
+
+  std::set<std::string> frame_locals;
+  Index count = 0;
+  std::string prefix(StripLeadingDollar(func.name));
+  for (size_t i = 1; i < outline_regions_.size(); ++i) {
+    OutlineRegion& region = outline_regions_[i];
+    if (region.outlined) {
+      region.name = DefineName(&global_syms_,
+                               prefix + "_part" + std::to_string(count++));
+      outlined_exprs_.emplace(region.expr, i);
+      frame_locals.insert(region.used_locals.begin(),
+                          region.used_locals.end());
+    }
+  }
+  if (!outlined_exprs_.empty()) {
+    // In shards the frame class is top-level, next to other modules' ones.
+    frame_class_ = DefineName(
+        &global_syms_,
+        (sharded_ ? class_name_ + "_" : std::string()) + prefix + "_frame");
+    // The function body's region holds the frame's fields from here on.
+    outline_regions_[0].used_locals = std::move(frame_locals);
+  }
+}
+
+void KotlinWriter::ScanOutlineRegions(const ExprList& exprs,
+                                      size_t region,
+                                      std::vector<const std::string*>* labels,
+                                      bool in_try) {
+  for (const Expr& expr : exprs) {
+    outline_regions_[region].size++;
+    switch (expr.type()) {
+      case ExprType::LocalGet:
+        outline_regions_[region].used_locals.insert(
+            cast<LocalGetExpr>(&expr)->var.name());
+        break;
+
+      case ExprType::LocalSet:
+      case ExprType::LocalTee: {
+        const Var& var = expr.type() == ExprType::LocalSet
+                             ? cast<LocalSetExpr>(&expr)->var
+                             : cast<LocalTeeExpr>(&expr)->var;
+        outline_regions_[region].used_locals.insert(var.name());
+        outline_regions_[region].assigned_locals.insert(var.name());
+        break;
+      }
+
+      case ExprType::Br:
+        EscapeOutlineRegions(region, *labels, cast<BrExpr>(&expr)->var);
+        break;
+
+      case ExprType::BrIf:
+        EscapeOutlineRegions(region, *labels, cast<BrIfExpr>(&expr)->var);
+        break;
+
+      case ExprType::BrTable: {
+        const auto* bt_expr = cast<BrTableExpr>(&expr);
+        for (const Var& var : bt_expr->targets) {
+          EscapeOutlineRegions(region, *labels, var);
+        }
+        EscapeOutlineRegions(region, *labels, bt_expr->default_target);
+        break;
+      }
+
+      case ExprType::Rethrow:
+        EscapeOutlineRegions(region, *labels, cast<RethrowExpr>(&expr)->var);
+        break;
+
+      case ExprType::Return:
+      case ExprType::ReturnCall:
+      case ExprType::ReturnCallIndirect:
+        EscapeOutlineRegions(region, *labels, Var(0, expr.loc));
+        break;
+
+      case ExprType::Block:
+      case ExprType::Loop: {
+        const Block& block = expr.type() == ExprType::Block
+                                 ? cast<BlockExpr>(&expr)->block
+                                 : cast<LoopExpr>(&expr)->block;
+        size_t inner = outline_regions_.size();
+        outline_regions_.emplace_back();
+        OutlineRegion& child = outline_regions_.back();
+        child.expr = &expr;
+        child.parent = region;
+        child.label_index = labels->size();
+        child.eligible = !in_try && block.decl.GetNumParams() == 0 &&
+                         block.decl.GetNumResults() <= 1 &&
+                         !block.exprs.empty();
+        labels->push_back(&block.label);
+        ScanOutlineRegions(block.exprs, inner, labels, in_try);
+        labels->pop_back();
+        // |child| may have been invalidated by the recursion.
+        OutlineRegion& done = outline_regions_[inner];
+        OutlineRegion& parent = outline_regions_[region];
+        parent.size += done.size;
+        parent.used_locals.insert(done.used_locals.begin(),
+                                  done.used_locals.end());
+        parent.assigned_locals.insert(done.assigned_locals.begin(),
+                                      done.assigned_locals.end());
+        break;
+      }
+
+      case ExprType::If: {
+        const IfExpr& if_ = *cast<IfExpr>(&expr);
+        labels->push_back(&if_.true_.label);
+        ScanOutlineRegions(if_.true_.exprs, region, labels, in_try);
+        ScanOutlineRegions(if_.false_, region, labels, in_try);
+        labels->pop_back();
+        break;
+      }
+
+      case ExprType::Try: {
+        const TryExpr& tryexpr = *cast<TryExpr>(&expr);
+        labels->push_back(&tryexpr.block.label);
+        ScanOutlineRegions(tryexpr.block.exprs, region, labels, true);
+        for (const Catch& c : tryexpr.catches) {
+          ScanOutlineRegions(c.exprs, region, labels, true);
+        }
+        labels->pop_back();
+        if (tryexpr.kind == TryKind::Delegate) {
+          EscapeOutlineRegions(region, *labels, tryexpr.delegate_target);
+        }
+        break;
+      }
+
+      default:
+        break;
+    }
+  }
+}
+
+// Marks the regions a branch to |var| leaves as not outlinable.
+void KotlinWriter::EscapeOutlineRegions(
+    size_t region,
+    const std::vector<const std::string*>& labels,
+    const Var& var) {
+  // Index vars only refer to the implicit function label.
+  int target = -1;
+  if (var.is_name()) {
+    for (size_t i = labels.size(); i > 0; --i) {
+      if (*labels[i - 1] == var.name()) {
+        target = i - 1;
+        break;
+      }
+    }
+  }
+  while (region != 0 && outline_regions_[region].label_index > target) {
+    outline_regions_[region].eligible = false;
+    region = outline_regions_[region].parent;
+  }
+}
+
+const Block& KotlinWriter::OutlinedBlock(const OutlineRegion& region) const {
+  if (region.expr->type() == ExprType::Block) {
+    return cast<BlockExpr>(region.expr)->block;
+  }
+  return cast<LoopExpr>(region.expr)->block;
+}
+
+void KotlinWriter::WriteOutlinedCall(const OutlineRegion& region) {
+  const Block& block = OutlinedBlock(region);
+  SpillValues();
+  for (const std::string& local : region.used_locals) {
+    Write(frame_name_, ".", LocalName(local), " = ", LocalName(local), ";",
+          Newline());
+  }
+  for (const std::string& local : region.assigned_locals) {
+    ForgetCheckedRanges(local);
+  }
+  PushTypes(block.decl.sig.result_types);
+  while (value_stack_.size() < type_stack_.size()) {
+    PushVar();
+  }
+  if (block.decl.GetNumResults() != 0) {
+    Write(StackVar(0), " = ");
+  }
+  Write(region.name, "(", frame_name_, ");", Newline());
+  for (const std::string& local : region.assigned_locals) {
+    Write(LocalName(local), " = ", frame_name_, ".", LocalName(local), ";",
+          Newline());
+  }
+}
+
+void KotlinWriter::WriteOutlinedFunc(const OutlineRegion& region) {
+  const Block& block = OutlinedBlock(region);
+  local_syms_ = func_local_syms_;
+  stack_var_sym_map_.clear();
+  func_sections_.clear();
+  func_includes_.clear();
+  checked_ranges_.clear();
+  checked_scopes_.clear();
+  value_stack_.clear();
+  ResetTypeStack(0);
+
+  Write(FunHeader(region.name, false), "(", frame_name_, ": ",
+        frame_class_,
+        "): ", ResultType(block.decl.sig.result_types), OpenBrace());
+  for (const std::string& local : region.used_locals) {
+    Write("var ", LocalName(local), " = ", frame_name_, ".", LocalName(local),
+          Newline());
+  }
+  if (options_.fuel) {
+    // Only needed if the region has a loop.
+    PushFuncSection(fuel_name_);
+    WriteFuelSlice();
+  }
+  PushFuncSection(scratch_name_);
+  WriteScratchLocal();
+  PushFuncSection();
+  if (region.expr->type() == ExprType::Block) {
+    EnterCheckedScope(*region.expr);
+    Write(block);
+    LeaveCheckedScope();
+  } else {
+    Write(*cast<LoopExpr>(region.expr));
+  }
+  SpillValues();
+  for (const std::string& local : region.assigned_locals) {
+    Write(frame_name_, ".", LocalName(local), " = ", LocalName(local), ";",
+          Newline());
+  }
+  if (block.decl.GetNumResults() != 0) {
+    Write("return ", StackVar(0), ";", Newline());
+  }
+  WriteFuncSections();
+  Write(CloseBrace());
+}
+
+void KotlinWriter::WriteFrameClass() {
+  Write("private class ", frame_class_, " ", OpenBrace());
+  for (const std::string& local : outline_regions_[0].used_locals) {
+    Type type = func_->GetLocalType(Var(local, Location()));
+    Write("@JvmField var ", LocalName(local), ": ", type, " = ",
+          ZeroValue(type));
+    Write(Newline());
+  }
+  Write(CloseBrace());
+}
+
+// Every local gets its own slot in the JVM frame, so functions with many
+// short-lived locals run out of slots and leave C2 many more values to
+// allocate registers for. Locals of the same type whose live ranges don't
+// overlap share a Kotlin variable, and each variable is declared in the
+// innermost block, loop or if that holds all its uses and isn't entered with
+// it live, so kotlinc can reuse its slot after that. Helpers of outlined
+// functions copy locals in and out through the frame, so their variables all
+// stay at the top.
+void KotlinWriter::PlanLocalSlots(const Func& func) {
+  Index num_params = func.GetNumParams();
+  Index num_locals = func.GetNumParamsAndLocals();
+  local_slots_.resize(num_locals);
+  for (Index i = 0; i < num_locals; ++i) {
+    local_slots_[i] = i;
+  }
+  entry_live_slots_.clear();
+  scoped_locals_.clear();
+  scoped_slots_.clear();
+  local_scopes_.clear();
+
+  LocalLiveness liveness(func);
+  LiveSet entry_live = liveness.Analyze();
+
+  // Going through the locals by where their range starts, each one takes the
+  // variable of its type whose range ended first, if it ended before. Locals
+  // that are never used fit in any variable of their type.
+  std::vector<Index> order;
+  for (Index i = num_params; i < num_locals; ++i) {
+    order.push_back(i);
+  }
+  std::stable_sort(order.begin(), order.end(), [&](Index a, Index b) {
+    return liveness.Range(a).lo < liveness.Range(b).lo;
+  });
+  struct Slot {
+    std::vector<Index> members;
+    LiveRange range;
+  };
+  std::vector<Slot> slots;
+  // By type, the variables by where their range ends, earliest on top.
+  using FreeSlots =
+      std::priority_queue<std::pair<Index, size_t>,
+                          std::vector<std::pair<Index, size_t>>,
+                          std::greater<std::pair<Index, size_t>>>;
+  std::vector<std::pair<Type, FreeSlots>> free_slots;
+  for (Index i : order) {
+    Type type = func.GetLocalType(i);
+    const LiveRange& range = liveness.Range(i);
+    auto iter = std::find_if(
+        free_slots.begin(), free_slots.end(),
+        [&](const std::pair<Type, FreeSlots>& entry) {
+          return entry.first == type;
+        });
+    if (iter == free_slots.end()) {
+      free_slots.emplace_back(type, FreeSlots());
+      iter = free_slots.end() - 1;
+    }
+    FreeSlots& free = iter->second;
+    size_t slot = slots.size();
+    if (!free.empty() && (range.empty() || free.top().first < range.lo)) {
+      slot = free.top().second;
+      if (!range.empty()) {
+        free.pop();
+      }
+    } else {
+      slots.push_back(Slot{{}, LiveRange()});
+      if (range.empty()) {
+        free.emplace(0, slot);
+      }
+    }
+    slots[slot].members.push_back(i);
+    if (!range.empty()) {
+      slots[slot].range.Extend(range);
+      free.emplace(slots[slot].range.hi, slot);
+    }
+  }
+
+  // Each variable is named after the lowest local in it.
+  for (Slot& slot : slots) {
+    std::sort(slot.members.begin(), slot.members.end());
+  }
+  std::sort(slots.begin(), slots.end(), [](const Slot& a, const Slot& b) {
+    return a.members.front() < b.members.front();
+  });
+  for (const Slot& slot : slots) {
+    Index index = slot.members.front();
+    for (Index member : slot.members) {
+      local_slots_[member] = index;
+      if (entry_live.count(member)) {
+        entry_live_slots_.insert(index);
+      }
+    }
+  }
+
+  std::vector<const Block*> homes(num_locals);
+  IndexSet used;
+  ScanLocalScopes(func.exprs, nullptr, &homes, &used);
+  bool outlined = outline_plans_.count(&func) != 0;
+  for (const Slot& slot : slots) {
+    Index index = slot.members.front();
+    if (!used.count(index)) {
+      scoped_slots_.insert(index);
+      continue;
+    }
+    const Block* home = outlined ? nullptr : homes[index];
+    while (home && !liveness.Extent(home).Contains(slot.range)) {
+      home = local_scopes_[home].parent;
+    }
+    if (home) {
+      scoped_locals_[home].push_back(index);
+      scoped_slots_.insert(index);
+    }
+  }
+}
+
+// Finds the innermost block, loop or if holding all uses of each variable.
+void KotlinWriter::ScanLocalScopes(const ExprList& exprs,
+                                   const Block* scope,
+                                   std::vector<const Block*>* homes,
+                                   IndexSet* used) {
+  for (const Expr& expr : exprs) {
+    const Var* var = nullptr;
+    const Block* inner = nullptr;
+    switch (expr.type()) {
+      case ExprType::LocalGet:
+        var = &cast<LocalGetExpr>(&expr)->var;
+        break;
+
+      case ExprType::LocalSet:
+        var = &cast<LocalSetExpr>(&expr)->var;
+        break;
+
+      case ExprType::LocalTee:
+        var = &cast<LocalTeeExpr>(&expr)->var;
+        break;
+
+      case ExprType::Block:
+        inner = &cast<BlockExpr>(&expr)->block;
+        break;
+
+      case ExprType::Loop:
+        inner = &cast<LoopExpr>(&expr)->block;
+        break;
+
+      case ExprType::If:
+        inner = &cast<IfExpr>(&expr)->true_;
+        break;
+
+      case ExprType::Try: {
+        const TryExpr& tryexpr = *cast<TryExpr>(&expr);
+        ScanLocalScopes(tryexpr.block.exprs, scope, homes, used);
+        for (const Catch& c : tryexpr.catches) {
+          ScanLocalScopes(c.exprs, scope, homes, used);
+        }
+        break;
+      }
+
+      default:
+        break;
+    }
+
+    if (var) {
+      Index slot = LocalSlot(*var);
+      if (!used->count(slot)) {
+        used->insert(slot);
+        (*homes)[slot] = scope;
+      } else {
+        (*homes)[slot] = CommonLocalScope((*homes)[slot], scope);
+      }
+    } else if (inner) {
+      Index depth = scope ? local_scopes_[scope].depth + 1 : 1;
+      local_scopes_[inner] = LocalScope{scope, depth};
+      ScanLocalScopes(inner->exprs, inner, homes, used);
+      if (expr.type() == ExprType::If) {
+        ScanLocalScopes(cast<IfExpr>(&expr)->false_, inner, homes, used);
+      }
     }
-    Write(");", Newline(), StackVar(num_results - 1), Newline());
-    Write(CloseBrace(), Newline());
   }
+}
 
-  stream_ = kotlin_stream_;
-
-  WriteStackVarDeclarations();
-
-  for (auto& [condition, stream] : func_sections_) {
-    std::unique_ptr<OutputBuffer> buf = stream.ReleaseOutputBuffer();
-    if (condition.empty() || func_includes_.count(condition)) {
-      stream_->WriteData(buf->data.data(), buf->data.size());
+const Block* KotlinWriter::CommonLocalScope(const Block* a,
+                                            const Block* b) const {
+  auto depth = [&](const Block* scope) -> Index {
+    return scope ? local_scopes_.find(scope)->second.depth : 0;
+  };
+  while (a != b) {
+    if (depth(a) >= depth(b)) {
+      a = local_scopes_.find(a)->second.parent;
+    } else {
+      b = local_scopes_.find(b)->second.parent;
     }
   }
+  return a;
+}
 
-  Write(CloseBrace(), " catch(e: StackOverflowError) ", OpenBrace(),
-        "throw " WASM_RT_PKG ".ExhaustionException(null, e)", Newline());
-  Write(CloseBrace(), " catch (d: Delegate) ", OpenBrace(), "throw d.ex",
-        Newline());
-  Write(CloseBrace(), Newline());
+Index KotlinWriter::LocalSlot(const Var& var) const {
+  return local_slots_[func_->GetLocalIndex(var)];
+}
 
-  Write(CloseBrace());
+const std::string& KotlinWriter::LocalSlotName(const Var& var) const {
+  return local_names_[LocalSlot(var)];
+}
 
-  func_ = nullptr;
+void KotlinWriter::WriteScopedLocals(const Block& block) {
+  auto iter = scoped_locals_.find(&block);
+  if (iter == scoped_locals_.end()) {
+    return;
+  }
+  for (Index index : iter->second) {
+    Type type = func_->GetLocalType(index);
+    Write("var ", LocalName(local_names_[index]), ": ", type, " = ",
+          ZeroValue(type));
+    Write(Newline());
+  }
 }
 
 void KotlinWriter::WriteParams(const std::vector<std::string>& index_to_name,
@@ -1838,21 +4103,23 @@ void KotlinWriter::WriteLocals(const std::vector<std::string>& index_to_name,
     }
   }
   Index num_params = func_->GetNumParams();
-  for (Type type : {Type::I32, Type::I64, Type::F32, Type::F64}) {
-    Index local_index = 0;
-    for (Type local_type : func_->local_types) {
-      if (local_type == type) {
-        Write("var ",
-              DefineLocalScopeName(index_to_name[num_params + local_index]),
-              ": ", local_type, " = 0");
-        if (type == Type::F32) {
-          Write(".0f");
-        } else if (type == Type::F64) {
-          Write(".0");
-        }
+  Index num_locals = func_->GetNumParamsAndLocals();
+  for (Type type : kVarTypes) {
+    for (Index i = num_params; i < num_locals; ++i) {
+      if (local_slots_[i] != i || func_->GetLocalType(i) != type) {
+        continue;
+      }
+      std::string name = DefineLocalScopeName(index_to_name[i]);
+      if (!scoped_slots_.count(i)) {
+        Write("var ", name, ": ", type, " = ", ZeroValue(type));
         Write(Newline());
       }
-      ++local_index;
+    }
+  }
+  for (Index i = num_params; i < num_locals; ++i) {
+    if (local_slots_[i] != i) {
+      local_sym_map_[index_to_name[i]] =
+          local_sym_map_[index_to_name[local_slots_[i]]];
     }
   }
 }
@@ -1860,42 +4127,114 @@ void KotlinWriter::WriteLocals(const std::vector<std::string>& index_to_name,
 void KotlinWriter::WriteCallIndirectDefinitions() {
   // Creates CALL_INDIRECT functions, used to adapt between JVM and WASM calling
   // conventions.
-  for (const auto& pair : call_indirect_decl_map_) {
-    Index index = pair.first;
-    const FuncDeclaration& decl = pair.second;
-    Writef("private fun CALL_INDIRECT_%u(w2k_table: " WASM_RT_PKG ".Table, ",
-           index);
-    if (decl.GetNumParams() != 0) {
-      Indent(4);
-      for (Index i = 0; i < decl.GetNumParams(); ++i) {
-        if (i != 0) {
-          Write(", ");
-          if ((i % 8) == 0)
-            Write(Newline());
-        }
-        Writef("w2k_p%u", i);
-        Write(": ", decl.GetParamType(i));
+  for (const auto& [index, decl] : call_indirect_decl_map_) {
+    WriteCallIndirectDefinition(index, decl, false);
+  }
+  for (const auto& [index, decl] : return_call_indirect_decl_map_) {
+    WriteCallIndirectDefinition(index, decl, true);
+  }
+}
+
+void KotlinWriter::WriteCallIndirectDefinition(Index index,
+                                               const FuncDeclaration& decl,
+                                               bool tail) {
+  Writef("%sfun %sCALL_INDIRECT_%u(", MemberVisibility(),
+         tail ? "RETURN_" : "", index);
+  if (tail) {
+    Write("w2k_scratch: Scratch, ");
+  }
+  Write("w2k_table: " WASM_RT_PKG ".Table, ");
+  if (decl.GetNumParams() != 0) {
+    Indent(4);
+    for (Index i = 0; i < decl.GetNumParams(); ++i) {
+      if (i != 0) {
+        Write(", ");
+        if ((i % 8) == 0)
+          Write(Newline());
       }
-      Write(", w2k_index: Int");
-      Dedent(4);
-    } else {
-      Write("w2k_index: Int");
+      Writef("w2k_p%u", i);
+      Write(": ", decl.GetParamType(i));
     }
-    Write("): ", ResultType(decl.sig.result_types), OpenBrace());
-    Write("return " WASM_RT_PKG ".CALL_INDIRECT<");
-    WriteFuncType(decl);
-    Write(">(w2k_table, func_types[");
-    Write(index, "], w2k_index)(");
+    Write(", w2k_index: Int");
+    Dedent(4);
+  } else {
+    Write("w2k_index: Int");
+  }
+  // With tail calls, multi-value results come back like a _tc function's.
+  bool result_fields = tail && decl.GetNumResults() > 1;
+  Write("): ", ResultType(result_fields ? FirstResult(decl.sig.result_types)
+                                        : decl.sig.result_types),
+        OpenBrace());
+  std::string type = DefineTypedFunc(decl.sig);
+  Write("val w2k_func = " WASM_RT_PKG ".CALL_INDIRECT<");
+  WriteFuncType(decl);
+  Write(">(w2k_table, func_types[", index, "], w2k_index)", Newline());
+  if (tail) {
+    // One of our own functions with tail calls; leave the call for the
+    // trampoline like a direct tail call would.
+    Write("if (w2k_func is ", TailFnType(decl.sig.result_types),
+          " && w2k_func.owner === this) ", OpenBrace());
+    std::map<char, Index> counts;
+    for (Index i = 0; i < decl.GetNumParams(); ++i) {
+      Type type = decl.GetParamType(i);
+      Write("w2k_scratch.", TailCallSlot(counts[MangleType(type)]++, type));
+      Writef(" = w2k_p%u", i);
+      Write(Newline());
+    }
+    Write("w2k_scratch.", TailCallNext(decl.sig.result_types), " = w2k_func",
+          Newline());
+    Write("return");
+    if (!decl.sig.result_types.empty()) {
+      Write(" ", ZeroValue(decl.GetResultType(0)));
+    }
+    Write(Newline(), CloseBrace(), Newline());
+  }
+  if (!type.empty()) {
+    // Entries from our own elem segments; anything else (imports, other
+    // modules' functions) goes through the generic invoke.
+    Write("if (w2k_func is ", type, ") ", OpenBrace());
+    Write(result_fields ? "return (w2k_func.invoke("
+                        : "return w2k_func.invoke(");
     for (Index i = 0; i < decl.GetNumParams(); ++i) {
       Writef("w2k_p%u, ", i);
     }
-    Write(")", Newline());
-    Write(CloseBrace(), Newline());
+    Write(")");
+    if (result_fields) {
+      WriteResultFieldsCallback(decl);
+    }
+    Write(Newline(), CloseBrace(), Newline());
+  }
+  Write(result_fields ? "return (w2k_func(" : "return w2k_func(");
+  for (Index i = 0; i < decl.GetNumParams(); ++i) {
+    Writef("w2k_p%u, ", i);
+  }
+  Write(")");
+  if (result_fields) {
+    WriteResultFieldsCallback(decl);
+  }
+  Write(Newline(), CloseBrace(), Newline());
+}
+
+void KotlinWriter::WriteResultFieldsCallback(const FuncDeclaration& decl) {
+  // Closes the parenthesized call to a lambda-returning function and passes
+  // it a callback that stores the extra results in the fields.
+  Write("){");
+  for (Index i = 1; i < decl.GetNumResults(); ++i) {
+    if (i != 1) {
+      Write(",");
+    }
+    Writef("v%u", i);
+  }
+  Write("->");
+  for (Index i = 1; i < decl.GetNumResults(); ++i) {
+    Write("w2k_scratch.", ResultField(i, decl.GetResultType(i)));
+    Writef("=v%u;", i);
   }
+  Write("}");
 }
 
 void KotlinWriter::WriteStackVarDeclarations() {
-  for (Type type : {Type::I32, Type::I64, Type::F32, Type::F64}) {
+  for (Type type : kVarTypes) {
     size_t count = 0;
     for (const auto& [pair, name] : stack_var_sym_map_) {
       Type stp_type = pair.second;
@@ -1904,12 +4243,7 @@ void KotlinWriter::WriteStackVarDeclarations() {
         if (count == 0) {
           Indent(4);
         }
-        Write("var ", name, ": ", type, " = 0");
-        if (type == Type::F32) {
-          Write(".0f");
-        } else if (type == Type::F64) {
-          Write(".0");
-        }
+        Write("var ", name, ": ", type, " = ", ZeroValue(type));
         Write(Newline());
         ++count;
       }
@@ -1942,6 +4276,7 @@ void KotlinWriter::Write(const Block& block) {
   PushFuncSection(label);
   Write(LabelDecl(label), "do ", OpenBrace());
   PushFuncSection();
+  WriteScopedLocals(block);
   Write(block.exprs);
   if (!unreachable_) {
     SpillValues();
@@ -1959,6 +4294,45 @@ void KotlinWriter::Write(const Block& block) {
   PushFuncSection();
 }
 
+void KotlinWriter::Write(const LoopExpr& expr) {
+  const Block& block = expr.block;
+  if (!block.exprs.empty()) {
+    std::string label = DefineLocalScopeName(block.label);
+    SpillValues();
+    PopValues(block.decl.GetNumParams());
+    DropTypes(block.decl.GetNumParams());
+    size_t mark = MarkTypeStack();
+    PushLabel(LabelType::Loop, block.label, block.decl.sig);
+    PushTypes(block.decl.sig.param_types);
+    Write("");  // write indent if needed
+    PushFuncSection(label);
+    Write(LabelDecl(label));
+    PushFuncSection();
+    EnterCheckedScope(expr);
+    Write("while (true) ", OpenBrace());
+    WriteScopedLocals(block);
+    WriteFuelCheck();
+    Write(block.exprs);
+    std::vector<StackValue> output_values;
+    if (!unreachable_) {
+      output_values = PopValues(block.decl.GetNumResults());
+    }
+    unreachable_ = false;
+    ResetTypeStack(mark);
+    PopLabel();
+    PushTypes(block.decl.sig.result_types);
+    for (StackValue& value : output_values) {
+      PushValue(std::move(value));
+    }
+    while (value_stack_.size() < type_stack_.size()) {
+      PushVar();
+    }
+    Write("break;", Newline());
+    Write(CloseBrace(), Newline());
+    LeaveCheckedScope();
+  }
+}
+
 size_t KotlinWriter::BeginTry(const TryExpr& tryexpr) {
   const std::string tlabel = DefineLocalScopeName(tryexpr.block.label);
   std::vector<StackValue> input_values =
@@ -2021,6 +4395,7 @@ void KotlinWriter::WriteTryCatch(const TryExpr& tryexpr) {
     if (it != tryexpr.catches.cbegin()) {
       Write(" else ");
     }
+    ResetCheckedScope();
     Write(*it);
     if (!unreachable_) {
       SpillValues();
@@ -2138,15 +4513,289 @@ void KotlinWriter::WriteTryDelegate(const TryExpr& tryexpr) {
   }
 }
 
+void KotlinWriter::WriteCall(const Var& var) {
+  const Func& func = *module_->GetFunc(var);
+  Index num_params = func.GetNumParams();
+  Index num_results = func.GetNumResults();
+  assert(type_stack_.size() >= num_params);
+  std::vector<StackValue> args = PopValues(num_params);
+  DropTypes(num_params);
+  SpillValues();
+  bool trampoline = UsesTrampoline(func);
+  if (trampoline || UsesResultFields(func)) {
+    // The results must be read out of the fields before any other call,
+    // so don't leave this one on the value stack. Functions with tail calls
+    // run their trampoline here rather than in the plain form, which would
+    // look up Scratch again.
+    std::string scratch = ScratchArg();
+    std::string run =
+        "tc_trampoline_" + MangleResults(func.decl.sig.result_types);
+    PushTypes(func.decl.sig.result_types);
+    while (value_stack_.size() < type_stack_.size()) {
+      PushVar();
+    }
+    if (num_results != 0) {
+      Write(StackVar(num_results - 1), " = ");
+    }
+    if (trampoline) {
+      if (num_results != 0) {
+        Write(run, "(", scratch, ", ");
+      }
+      Write(tail_call_sym_map_[func.name], "(", scratch);
+    } else {
+      Write(result_fields_sym_map_[func.name], "(", scratch);
+    }
+    for (Index i = 0; i < num_params; ++i) {
+      Write(", ", args[i].value);
+    }
+    Write(trampoline && num_results != 0 ? "));" : ");", Newline());
+    if (trampoline && num_results == 0) {
+      Write(run, "(", scratch, ");", Newline());
+    }
+    for (Index i = 1; i < num_results; ++i) {
+      Write(StackVar(num_results - i - 1), " = ",
+            ScratchField(ResultField(i, func.GetResultType(i))), ";",
+            Newline());
+    }
+    return;
+  }
+  StackValue sv;
+  sv.precedence = 2;
+  for (const StackValue& arg : args) {
+    sv.depends_on |= arg.depends_on;
+    sv.side_effects |= arg.side_effects;
+  }
+  sv.side_effects.updates_all_globals = true;
+  sv.side_effects.updates_memory = true;
+  sv.side_effects.can_trap = true;
+  PushValue(sv);
+
+  if (num_results > 1) {
+    WriteValue("(");
+  }
+  WriteValue(GlobalName(var.name()), "(");
+  for (Index i = 0; i < num_params; ++i) {
+    WriteValue(args[i].value, ", ");
+  }
+  WriteValue(")");
+  PushTypes(func.decl.sig.result_types);
+  if (num_results > 1) {
+    WriteValue("){");
+    for (Index i = 1; i < num_results; ++i) {
+      if (i != 1) {
+        WriteValue(",");
+      }
+      WriteValuef("v%d", i);
+    }
+    WriteValue("->");
+    for (Index i = 1; i < num_results; ++i) {
+      WriteValue(StackVar(num_results - i - 1));
+      WriteValuef("=v%d;", i);
+    }
+    WriteValue("}");
+  }
+  while (value_stack_.size() < type_stack_.size()) {
+    PushVar();
+    // FIXME these should have depends_on set to the call StackValue
+  }
+  if (num_results == 0) {
+    DropValue();
+  }
+}
+
+void KotlinWriter::WriteCallIndirect(const Var& table_var,
+                                     const FuncDeclaration& decl,
+                                     bool tail) {
+  Index num_params = decl.GetNumParams();
+  Index num_results = decl.GetNumResults();
+  assert(type_stack_.size() > num_params);
+  StackValue tabkey = PopValue();
+  DropTypes(1);
+  std::vector<StackValue> args = PopValues(num_params);
+  DropTypes(num_params);
+  SpillValues();
+
+  const Table* table = module_->GetTable(table_var);
+  assert(decl.has_func_type);
+  Index func_type_index = module_->GetFuncTypeIndex(decl.type_var);
+  DefineCallIndirect(func_type_index, decl, tail);
+  if (tail && num_results > 1) {
+    // Returns the first result and leaves the others in the fields, as a
+    // trampoline would.
+    PushTypes(decl.sig.result_types);
+    while (value_stack_.size() < type_stack_.size()) {
+      PushVar();
+    }
+    Write(StackVar(num_results - 1), " = RETURN_CALL_INDIRECT_",
+          func_type_index, "(", ScratchArg(), ", ",
+          GetGlobalName(table->name));
+    for (Index i = 0; i < num_params; ++i) {
+      Write(", ", args[i].value);
+    }
+    Write(", ", tabkey.value, ");", Newline());
+    for (Index i = 1; i < num_results; ++i) {
+      Write(StackVar(num_results - i - 1), " = ",
+            ScratchField(ResultField(i, decl.GetResultType(i))), ";",
+            Newline());
+    }
+    return;
+  }
+
+  StackValue sv;
+  sv.precedence = 2;
+  sv.depends_on |= tabkey.depends_on;
+  sv.side_effects |= tabkey.side_effects;
+  for (const StackValue& arg : args) {
+    sv.depends_on |= arg.depends_on;
+    sv.side_effects |= arg.side_effects;
+  }
+  sv.side_effects.updates_all_globals = true;
+  sv.side_effects.updates_memory = true;
+  sv.side_effects.can_trap = true;
+  PushValue(sv);
+
+  if (num_results > 1) {
+    WriteValue("(");
+  }
+  WriteValue(tail ? "RETURN_CALL_INDIRECT_" : "CALL_INDIRECT_");
+  WriteValuef("%u", func_type_index);
+  WriteValue("(");
+  if (tail) {
+    WriteValue(ScratchArg(), ", ");
+  }
+  WriteValue(GetGlobalName(table->name));
+  WriteValue(", ");
+  for (Index i = 0; i < num_params; ++i) {
+    WriteValue(args[i].value, ", ");
+  }
+  WriteValue(tabkey.value, ")");
+  PushTypes(decl.sig.result_types);
+  if (num_results > 1) {
+    WriteValue("){");
+    for (Index i = 1; i < num_results; ++i) {
+      if (i != 1) {
+        WriteValue(",");
+      }
+      WriteValuef("v%d", i);
+    }
+    WriteValue("->");
+    for (Index i = 1; i < num_results; ++i) {
+      WriteValue(StackVar(num_results - i - 1));
+      WriteValuef("=v%d;", i);
+    }
+    WriteValue("}");
+  }
+  while (value_stack_.size() < type_stack_.size()) {
+    PushVar();
+    // FIXME these should have depends_on set to the call StackValue
+  }
+  if (num_results == 0) {
+    DropValue();
+  }
+}
+
+void KotlinWriter::WriteReturn() {
+  // Goto the function label instead; this way we can do shared function
+  // cleanup code in one place.
+  unreachable_ = true;
+  std::vector<StackValue> values = PopValues(func_->GetNumResults());
+  SpillValues();
+  PushValues(std::move(values));
+  assert(!label_stack_.empty());
+  Write(GotoLabel(Var(label_stack_.size() - 1, {})), Newline());
+  // The goto wrote these out already.
+  PopValues(func_->GetNumResults());
+  size_t mark = label_stack_.back().type_stack_size;
+  while (value_stack_.size() > mark) {
+    DropValue();
+  }
+}
+
+// Pops the arguments of a tail call into stack vars, so they're all evaluated
+// before the first one is stored anywhere.
+std::vector<std::string> KotlinWriter::SpillArgs(const TypeVector& types) {
+  Index num_params = types.size();
+  std::vector<StackValue> args = PopValues(num_params);
+  DropTypes(num_params);
+  SpillValues();
+  PushTypes(types);
+  while (value_stack_.size() < type_stack_.size()) {
+    PushVar();
+  }
+  std::vector<StackValue> vars = PopValues(num_params);
+  DropTypes(num_params);
+  std::vector<std::string> names;
+  for (Index i = 0; i < num_params; ++i) {
+    if (args[i].value != vars[i].value) {
+      Write(vars[i].value, " = ", args[i].value, ";", Newline());
+    }
+    names.push_back(vars[i].value);
+  }
+  return names;
+}
+
+void KotlinWriter::WriteSelfTailCall() {
+  assert(!tail_label_.empty());
+  Index num_params = func_->GetNumParams();
+  std::vector<std::string> args = SpillArgs(func_->decl.sig.param_types);
+  for (Index i = 0; i < num_params; ++i) {
+    Write(LocalName(local_names_[i]), " = ", args[i], ";", Newline());
+  }
+  // Only variables read before they're set need to start over at zero.
+  for (Index i = num_params; i < func_->GetNumParamsAndLocals(); ++i) {
+    if (entry_live_slots_.count(i)) {
+      Write(LocalName(local_names_[i]), " = ",
+            ZeroValue(func_->GetLocalType(i)), ";", Newline());
+    }
+  }
+  unreachable_ = true;
+  Write("continue@", tail_label_, ";", Newline());
+  assert(!label_stack_.empty());
+  size_t mark = label_stack_.back().type_stack_size;
+  while (value_stack_.size() > mark) {
+    DropValue();
+  }
+}
+
+void KotlinWriter::WriteTailCall(const Func& func) {
+  // Leave the call for the trampoline and return a placeholder result.
+  const FuncSignature& sig = func.decl.sig;
+  std::vector<std::string> args = SpillArgs(sig.param_types);
+  std::map<char, Index> counts;
+  for (Index i = 0; i < sig.GetNumParams(); ++i) {
+    Type type = sig.GetParamType(i);
+    Write(ScratchField(TailCallSlot(counts[MangleType(type)]++, type)), " = ",
+          args[i], ";", Newline());
+  }
+  Write(ScratchField(TailCallNext(sig.result_types)), " = ",
+        tail_object_sym_map_[func.name], ";", Newline());
+  PushTypes(sig.result_types);
+  for (Type type : sig.result_types) {
+    StackValue sv;
+    sv.value = ZeroValue(type);
+    sv.precedence = 1;
+    PushValue(sv);
+  }
+}
+
 void KotlinWriter::Write(const ExprList& exprs) {
   for (const Expr& expr : exprs) {
+    if (!outlined_exprs_.empty()) {
+      auto iter = outlined_exprs_.find(&expr);
+      if (iter != outlined_exprs_.end()) {
+        WriteOutlinedCall(outline_regions_[iter->second]);
+        continue;
+      }
+    }
     switch (expr.type()) {
       case ExprType::Binary:
         Write(*cast<BinaryExpr>(&expr));
         break;
 
       case ExprType::Block:
+        EnterCheckedScope(expr);
         Write(cast<BlockExpr>(&expr)->block);
+        LeaveCheckedScope();
         break;
 
       case ExprType::Br: {
@@ -2218,124 +4867,13 @@ void KotlinWriter::Write(const ExprList& exprs) {
         return;
       }
 
-      case ExprType::Call: {
-        const Var& var = cast<CallExpr>(&expr)->var;
-        const Func& func = *module_->GetFunc(var);
-        Index num_params = func.GetNumParams();
-        Index num_results = func.GetNumResults();
-        assert(type_stack_.size() >= num_params);
-        std::vector<StackValue> args = PopValues(num_params);
-        DropTypes(num_params);
-        SpillValues();
-        StackValue sv;
-        sv.precedence = 2;
-        for (const StackValue& arg : args) {
-          sv.depends_on |= arg.depends_on;
-          sv.side_effects |= arg.side_effects;
-        }
-        sv.side_effects.updates_globals = global_syms_;
-        sv.side_effects.updates_memory = true;
-        sv.side_effects.can_trap = true;
-        PushValue(sv);
-
-        if (num_results > 1) {
-          WriteValue("(");
-        }
-        WriteValue(GlobalName(var.name()), "(");
-        for (Index i = 0; i < num_params; ++i) {
-          WriteValue(args[i].value, ", ");
-        }
-        WriteValue(")");
-        PushTypes(func.decl.sig.result_types);
-        if (num_results > 1) {
-          WriteValue("){");
-          for (Index i = 1; i < num_results; ++i) {
-            if (i != 1) {
-              WriteValue(",");
-            }
-            WriteValuef("v%d", i);
-          }
-          WriteValue("->");
-          for (Index i = 1; i < num_results; ++i) {
-            WriteValue(StackVar(num_results - i - 1));
-            WriteValuef("=v%d;", i);
-          }
-          WriteValue("}");
-        }
-        while (value_stack_.size() < type_stack_.size()) {
-          PushVar();
-          // FIXME these should have depends_on set to the call StackValue
-        }
-        if (num_results == 0) {
-          DropValue();
-        }
+      case ExprType::Call:
+        WriteCall(cast<CallExpr>(&expr)->var);
         break;
-      }
 
       case ExprType::CallIndirect: {
-        const FuncDeclaration& decl = cast<CallIndirectExpr>(&expr)->decl;
-        Index num_params = decl.GetNumParams();
-        Index num_results = decl.GetNumResults();
-        assert(type_stack_.size() > num_params);
-        StackValue tabkey = PopValue();
-        DropTypes(1);
-        std::vector<StackValue> args = PopValues(num_params);
-        DropTypes(num_params);
-        SpillValues();
-        StackValue sv;
-        sv.precedence = 2;
-        sv.depends_on |= tabkey.depends_on;
-        sv.side_effects |= tabkey.side_effects;
-        for (const StackValue& arg : args) {
-          sv.depends_on |= arg.depends_on;
-          sv.side_effects |= arg.side_effects;
-        }
-        sv.side_effects.updates_globals = global_syms_;
-        sv.side_effects.updates_memory = true;
-        sv.side_effects.can_trap = true;
-        PushValue(sv);
-
-        assert(module_->tables.size() == 1);
-        const Table* table = module_->tables[0];
-
-        assert(decl.has_func_type);
-        Index func_type_index = module_->GetFuncTypeIndex(decl.type_var);
-
-        DefineCallIndirect(func_type_index, decl);
-        if (num_results > 1) {
-          WriteValue("(");
-        }
-        WriteValue("CALL_INDIRECT_");
-        WriteValuef("%u", func_type_index);
-        WriteValue("(", GetGlobalName(table->name));
-        WriteValue(", ");
-        for (Index i = 0; i < num_params; ++i) {
-          WriteValue(args[i].value, ", ");
-        }
-        WriteValue(tabkey.value, ")");
-        PushTypes(decl.sig.result_types);
-        if (num_results > 1) {
-          WriteValue("){");
-          for (Index i = 1; i < num_results; ++i) {
-            if (i != 1) {
-              WriteValue(",");
-            }
-            WriteValuef("v%d", i);
-          }
-          WriteValue("->");
-          for (Index i = 1; i < num_results; ++i) {
-            WriteValue(StackVar(num_results - i - 1));
-            WriteValuef("=v%d;", i);
-          }
-          WriteValue("}");
-        }
-        while (value_stack_.size() < type_stack_.size()) {
-          PushVar();
-          // FIXME these should have depends_on set to the call StackValue
-        }
-        if (num_results == 0) {
-          DropValue();
-        }
+        const auto* ci_expr = cast<CallIndirectExpr>(&expr);
+        WriteCallIndirect(ci_expr->table, ci_expr->decl, false);
         break;
       }
 
@@ -2371,9 +4909,16 @@ void KotlinWriter::Write(const ExprList& exprs) {
         PushType(module_->GetGlobal(var)->type);
         StackValue sv;
         sv.precedence = 1;
-        sv.depends_on.depends_globals.insert(var.name());
+        const Const* const_ = ConstantGlobalValue(var);
+        if (!const_) {
+          sv.depends_on.depends_globals.insert(module_->GetGlobalIndex(var));
+        }
         PushValue(sv);
-        WriteValue(GlobalVar(var));
+        if (const_) {
+          WriteValue(*const_);
+        } else {
+          WriteValue(GlobalVar(var));
+        }
         break;
       }
 
@@ -2399,7 +4944,9 @@ void KotlinWriter::Write(const ExprList& exprs) {
         PushLabel(LabelType::If, if_.true_.label, if_.true_.decl.sig);
         PushTypes(if_.true_.decl.sig.param_types);
         PushValues(args);
+        EnterCheckedScope(expr);
         Write(LabelDecl(label), "do ", OpenBrace());
+        WriteScopedLocals(if_.true_);
         Write("if ((", cond.value, ").inz()) ", OpenBrace());
         Write(if_.true_.exprs);
         if (!if_.false_.empty()) {
@@ -2413,6 +4960,7 @@ void KotlinWriter::Write(const ExprList& exprs) {
           ResetTypeStack(mark);
           PushTypes(if_.true_.decl.sig.param_types);
           PushValues(std::move(args));
+          ResetCheckedScope();
           Write(" else ", OpenBrace(), if_.false_);
         }
         if (!unreachable_) {
@@ -2425,6 +4973,7 @@ void KotlinWriter::Write(const ExprList& exprs) {
         assert(value_stack_.size() == mark);
         ResetTypeStack(mark);
         Write(Newline());
+        LeaveCheckedScope();
         PopLabel();
         PushTypes(if_.true_.decl.sig.result_types);
         while (value_stack_.size() < type_stack_.size()) {
@@ -2442,7 +4991,7 @@ void KotlinWriter::Write(const ExprList& exprs) {
         PushType(func_->GetLocalType(var));
         StackValue sv;
         sv.precedence = 1;
-        sv.depends_on.depends_locals.insert(var.name());
+        sv.depends_on.depends_locals.insert(LocalSlot(var));
         PushValue(sv);
         WriteValue(var);
         break;
@@ -2452,61 +5001,31 @@ void KotlinWriter::Write(const ExprList& exprs) {
         const Var& var = cast<LocalSetExpr>(&expr)->var;
         assert(var.is_name());
         StackValue sv = PopValue();
-        sv.side_effects.updates_locals.insert(var.name());
+        sv.side_effects.updates_locals.insert(LocalSlot(var));
         DropTypes(1);
         SpillValues();
+        ForgetCheckedRanges(LocalSlotName(var));
         Write(var, " = ", sv.value, ";", Newline());
         break;
       }
 
       case ExprType::LocalTee: {
         const Var& var = cast<LocalTeeExpr>(&expr)->var;
-        assert(var.is_name());
-        StackValue sv = PopValue();
-        sv.side_effects.updates_locals.insert(var.name());
-        sv.value = ("(" + sv.value) + ").also ";
-        sv.precedence = 2;
-        PushValue(sv);
-        WriteValue("{", var, "=it}");
-        break;
-      }
-
-      case ExprType::Loop: {
-        const Block& block = cast<LoopExpr>(&expr)->block;
-        if (!block.exprs.empty()) {
-          std::string label = DefineLocalScopeName(block.label);
-          SpillValues();
-          PopValues(block.decl.GetNumParams());
-          DropTypes(block.decl.GetNumParams());
-          size_t mark = MarkTypeStack();
-          PushLabel(LabelType::Loop, block.label, block.decl.sig);
-          PushTypes(block.decl.sig.param_types);
-          Write("");  // write indent if needed
-          PushFuncSection(label);
-          Write(LabelDecl(label));
-          PushFuncSection();
-          Write("while (true) ", OpenBrace());
-          Write(block.exprs);
-          std::vector<StackValue> output_values;
-          if (!unreachable_) {
-            output_values = PopValues(block.decl.GetNumResults());
-          }
-          unreachable_ = false;
-          ResetTypeStack(mark);
-          PopLabel();
-          PushTypes(block.decl.sig.result_types);
-          for (StackValue& value : output_values) {
-            PushValue(std::move(value));
-          }
-          while (value_stack_.size() < type_stack_.size()) {
-            PushVar();
-          }
-          Write("break;", Newline());
-          Write(CloseBrace(), Newline());
-        }
+        assert(var.is_name());
+        StackValue sv = PopValue();
+        sv.side_effects.updates_locals.insert(LocalSlot(var));
+        sv.value = ("(" + sv.value) + ").also ";
+        sv.precedence = 2;
+        PushValue(sv);
+        ForgetCheckedRanges(LocalSlotName(var));
+        WriteValue("{", var, "=it}");
         break;
       }
 
+      case ExprType::Loop:
+        Write(*cast<LoopExpr>(&expr));
+        break;
+
       case ExprType::MemoryFill: {
         const auto inst = cast<MemoryFillExpr>(&expr);
         Memory* memory =
@@ -2572,8 +5091,7 @@ void KotlinWriter::Write(const ExprList& exprs) {
         } else {
           Write(", arrayOf()");
         }
-        Write(", ", srcaddr.value, ", ", svsize.value, ", func_types);",
-              Newline());
+        Write(", ", srcaddr.value, ", ", svsize.value, ");", Newline());
       } break;
 
       case ExprType::DataDrop: {
@@ -2611,16 +5129,113 @@ void KotlinWriter::Write(const ExprList& exprs) {
               srcaddr.value, ", ", svsize.value, ");", Newline());
       } break;
 
-      case ExprType::TableGet:
-      case ExprType::TableSet:
-      case ExprType::TableGrow:
-      case ExprType::TableSize:
-      case ExprType::TableFill:
-      case ExprType::RefFunc:
-      case ExprType::RefNull:
-      case ExprType::RefIsNull:
-        UNIMPLEMENTED("...");
+      case ExprType::TableGet: {
+        const Table* table =
+            module_->GetTable(cast<TableGetExpr>(&expr)->var);
+        StackValue sv = PopValue();
+        DropTypes(1);
+        PushType(table->elem_type);
+        sv.precedence = 2;
+        sv.depends_on.depends_memory = true;
+        sv.side_effects.can_trap = true;
+        std::string index;
+        std::swap(index, sv.value);
+        PushValue(sv);
+        if (table->elem_type == Type::FuncRef) {
+          WriteValue("(", GetGlobalName(table->name), "[", index,
+                     "] as " WASM_RT_PKG ".Elem?)");
+        } else {
+          WriteValue(GetGlobalName(table->name), "[", index, "]");
+        }
+        break;
+      }
+
+      case ExprType::TableSet: {
+        const Table* table =
+            module_->GetTable(cast<TableSetExpr>(&expr)->var);
+        StackValue value = PopValue();
+        StackValue index = PopValue();
+        DropTypes(2);
+        SpillValues();
+        Write(GlobalName(table->name), "[", index.value, "] = ", value.value,
+              ";", Newline());
+        break;
+      }
+
+      case ExprType::TableGrow: {
+        const Table* table =
+            module_->GetTable(cast<TableGrowExpr>(&expr)->var);
+        StackValue delta = PopValue();
+        StackValue sv = PopValue();
+        DropTypes(2);
+        PushType(Type::I32);
+        sv.precedence = 2;
+        sv.depends_on |= delta.depends_on;
+        sv.side_effects |= delta.side_effects;
+        sv.side_effects.updates_memory = true;
+        std::string init;
+        std::swap(init, sv.value);
+        PushValue(sv);
+        WriteValue(GetGlobalName(table->name), ".grow(", init, ", ",
+                   delta.value, ")");
+        break;
+      }
+
+      case ExprType::TableSize: {
+        const Table* table =
+            module_->GetTable(cast<TableSizeExpr>(&expr)->var);
+        PushType(Type::I32);
+        StackValue sv;
+        sv.precedence = 2;
+        sv.depends_on.depends_memory = true;
+        PushValue(sv);
+        WriteValue(GetGlobalName(table->name), ".size");
+        break;
+      }
+
+      case ExprType::TableFill: {
+        const Table* table =
+            module_->GetTable(cast<TableFillExpr>(&expr)->var);
+        StackValue svsize = PopValue();
+        StackValue value = PopValue();
+        StackValue dstaddr = PopValue();
+        DropTypes(3);
+        SpillValues();
+        Write(GlobalName(table->name), ".fill(", dstaddr.value, ", ",
+              value.value, ", ", svsize.value, ");", Newline());
+        break;
+      }
+
+      case ExprType::RefFunc: {
+        const Func* func = module_->GetFunc(cast<RefFuncExpr>(&expr)->var);
+        PushType(Type::FuncRef);
+        StackValue sv;
+        sv.precedence = 1;
+        PushValue(sv);
+        WriteValue(func_ref_sym_map_[func->name]);
+        break;
+      }
+
+      case ExprType::RefNull: {
+        PushType(cast<RefNullExpr>(&expr)->type);
+        StackValue sv;
+        sv.precedence = 1;
+        PushValue(sv);
+        WriteValue("null");
+        break;
+      }
+
+      case ExprType::RefIsNull: {
+        StackValue sv = PopValue();
+        DropTypes(1);
+        PushType(Type::I32);
+        sv.precedence = 2;
+        std::string ref;
+        std::swap(ref, sv.value);
+        PushValue(sv);
+        WriteValue("(", ref, " == null).btoInt()");
         break;
+      }
 
       case ExprType::MemoryGrow: {
         Memory* memory = module_->memories[module_->GetMemoryIndex(
@@ -2655,21 +5270,34 @@ void KotlinWriter::Write(const ExprList& exprs) {
       case ExprType::Nop:
         break;
 
-      case ExprType::Return: {
-        // Goto the function label instead; this way we can do shared function
-        // cleanup code in one place.
-        unreachable_ = true;
-        std::vector<StackValue> values = PopValues(func_->GetNumResults());
-        SpillValues();
-        PushValues(std::move(values));
-        assert(!label_stack_.empty());
-        Write(GotoLabel(Var(label_stack_.size() - 1, {})), Newline());
-        size_t mark = label_stack_.back().type_stack_size;
-        while (value_stack_.size() > mark) {
-          DropValue();
-        }
+      case ExprType::Return:
+        WriteReturn();
         // Stop processing this ExprList, since the following are unreachable.
         return;
+
+      case ExprType::ReturnCall: {
+        const Var& var = cast<ReturnCallExpr>(&expr)->var;
+        const Func& func = *module_->GetFunc(var);
+        if (&func == func_) {
+          WriteSelfTailCall();
+        } else if (UsesTrampoline(func)) {
+          WriteTailCall(func);
+          WriteReturn();
+        } else {
+          WriteCall(var);
+          WriteReturn();
+        }
+        return;
+      }
+
+      case ExprType::ReturnCallIndirect: {
+        const auto* rci_expr = cast<ReturnCallIndirectExpr>(&expr);
+        const FuncDeclaration& decl = rci_expr->decl;
+        WriteCallIndirect(rci_expr->table, decl,
+                          UsesTrampoline(*func_) &&
+                              HasTrampolineTarget(decl.sig));
+        WriteReturn();
+        return;
       }
 
       case ExprType::Select: {
@@ -2785,6 +5413,7 @@ void KotlinWriter::Write(const ExprList& exprs) {
 
       case ExprType::Try: {
         const TryExpr& tryexpr = *cast<TryExpr>(&expr);
+        EnterCheckedScope(expr);
         switch (tryexpr.kind) {
           case TryKind::Plain:
             Write(tryexpr.block);
@@ -2796,17 +5425,50 @@ void KotlinWriter::Write(const ExprList& exprs) {
             WriteTryDelegate(tryexpr);
             break;
         }
+        LeaveCheckedScope();
       } break;
 
-      case ExprType::AtomicLoad:
-      case ExprType::AtomicRmw:
-      case ExprType::AtomicRmwCmpxchg:
-      case ExprType::AtomicStore:
-      case ExprType::AtomicWait:
+      case ExprType::AtomicLoad: {
+        auto* inst = cast<AtomicLoadExpr>(&expr);
+        WriteAtomicExpr(inst->opcode, inst->memidx, inst->offset, 1);
+        break;
+      }
+
+      case ExprType::AtomicStore: {
+        auto* inst = cast<AtomicStoreExpr>(&expr);
+        WriteAtomicExpr(inst->opcode, inst->memidx, inst->offset, 2);
+        break;
+      }
+
+      case ExprType::AtomicRmw: {
+        auto* inst = cast<AtomicRmwExpr>(&expr);
+        WriteAtomicExpr(inst->opcode, inst->memidx, inst->offset, 2);
+        break;
+      }
+
+      case ExprType::AtomicRmwCmpxchg: {
+        auto* inst = cast<AtomicRmwCmpxchgExpr>(&expr);
+        WriteAtomicExpr(inst->opcode, inst->memidx, inst->offset, 3);
+        break;
+      }
+
+      case ExprType::AtomicWait: {
+        auto* inst = cast<AtomicWaitExpr>(&expr);
+        WriteAtomicExpr(inst->opcode, inst->memidx, inst->offset, 3);
+        break;
+      }
+
+      case ExprType::AtomicNotify: {
+        auto* inst = cast<AtomicNotifyExpr>(&expr);
+        WriteAtomicExpr(inst->opcode, inst->memidx, inst->offset, 2);
+        break;
+      }
+
       case ExprType::AtomicFence:
-      case ExprType::AtomicNotify:
-      case ExprType::ReturnCall:
-      case ExprType::ReturnCallIndirect:
+        SpillValues();
+        Write(WASM_RT_PKG ".atomic_fence();", Newline());
+        break;
+
       case ExprType::CallRef:
         UNIMPLEMENTED("...");
         break;
@@ -2880,6 +5542,72 @@ void KotlinWriter::WritePrefixBinaryExpr(Opcode opcode,
   PushValue(sv_left);
 }
 
+// static
+bool KotlinWriter::ParseIntLiteral(std::string_view value, int64_t* result) {
+  // Undoes WriteValue(const Const&).
+  if (value == LongLiteral(std::numeric_limits<int64_t>::min())) {
+    *result = std::numeric_limits<int64_t>::min();
+    return true;
+  }
+  if (value.size() > 2 && value.front() == '(' && value.back() == ')') {
+    value = value.substr(1, value.size() - 2);
+  }
+  if (!value.empty() && value.back() == 'L') {
+    value.remove_suffix(1);
+  }
+  const char* end = value.data() + value.size();
+  auto [ptr, ec] = std::from_chars(value.data(), end, *result);
+  return ec == std::errc() && ptr == end;
+}
+
+void KotlinWriter::WriteDivExpr(Opcode opcode) {
+  bool is_rem = opcode == Opcode::I32RemS || opcode == Opcode::I64RemS ||
+                opcode == Opcode::I32RemU || opcode == Opcode::I64RemU;
+  bool is_signed = opcode == Opcode::I32DivS || opcode == Opcode::I64DivS ||
+                   opcode == Opcode::I32RemS || opcode == Opcode::I64RemS;
+  bool is_i64 = opcode.GetResultType() == Type::I64;
+  int64_t divisor;
+  if (ParseIntLiteral(value_stack_.back().value, &divisor) && divisor != 0) {
+    // A literal divisor can't trap, so skip the checks.
+    if (is_signed && (is_rem || divisor != -1)) {
+      // The JVM's remainder of the minimum by -1 is 0 too.
+      WriteInfixBinaryExpr(opcode, is_rem ? "%" : "/", 4);
+      return;
+    }
+    if (!is_signed) {
+      uint64_t bits = is_i64 ? static_cast<uint64_t>(divisor)
+                             : static_cast<uint32_t>(divisor);
+      if ((bits & (bits - 1)) == 0) {
+        if (is_rem) {
+          value_stack_.back().value =
+              is_i64 ? LongLiteral(bits - 1) : std::to_string(bits - 1);
+          WriteInfixBinaryExpr(opcode, "and", 7);
+        } else {
+          value_stack_.back().value = std::to_string(Ctz(bits));
+          WriteInfixBinaryExpr(opcode, "ushr", 7);
+        }
+      } else {
+        std::string func = is_i64 ? "java.lang.Long." : "java.lang.Integer.";
+        func += is_rem ? "remainderUnsigned" : "divideUnsigned";
+        WritePrefixBinaryExpr(opcode, func.c_str());
+      }
+      return;
+    }
+  }
+
+  const char* func;
+  if (is_signed) {
+    if (is_i64) {
+      func = is_rem ? WASM_RT_PKG ".I64_REM_S" : WASM_RT_PKG ".I64_DIV_S";
+    } else {
+      func = is_rem ? WASM_RT_PKG ".I32_REM_S" : WASM_RT_PKG ".I32_DIV_S";
+    }
+  } else {
+    func = is_rem ? WASM_RT_PKG ".REM_U" : WASM_RT_PKG ".DIV_U";
+  }
+  WritePrefixBinaryExpr(opcode, func, true);
+}
+
 void KotlinWriter::WriteUnsignedCompareExpr(Opcode opcode, const char* op) {
   Type result_type = opcode.GetResultType();
   Type type = opcode.GetParamType1();
@@ -2907,6 +5635,11 @@ void KotlinWriter::WriteUnsignedCompareExpr(Opcode opcode, const char* op) {
 }
 
 void KotlinWriter::Write(const BinaryExpr& expr) {
+  if (expr.opcode.GetPrefix() == 0xfd) {
+    std::string func = WASM_RT_PKG "." + OpcodeFuncName(expr.opcode);
+    WritePrefixBinaryExpr(expr.opcode, func.c_str());
+    return;
+  }
   switch (expr.opcode) {
     case Opcode::I32Add:
     case Opcode::I64Add:
@@ -2930,16 +5663,14 @@ void KotlinWriter::Write(const BinaryExpr& expr) {
       break;
 
     case Opcode::I32DivS:
-      WritePrefixBinaryExpr(expr.opcode, WASM_RT_PKG ".I32_DIV_S", true);
-      break;
-
     case Opcode::I64DivS:
-      WritePrefixBinaryExpr(expr.opcode, WASM_RT_PKG ".I64_DIV_S", true);
-      break;
-
     case Opcode::I32DivU:
     case Opcode::I64DivU:
-      WritePrefixBinaryExpr(expr.opcode, WASM_RT_PKG ".DIV_U", true);
+    case Opcode::I32RemS:
+    case Opcode::I64RemS:
+    case Opcode::I32RemU:
+    case Opcode::I64RemU:
+      WriteDivExpr(expr.opcode);
       break;
 
     case Opcode::F32Div:
@@ -2947,19 +5678,6 @@ void KotlinWriter::Write(const BinaryExpr& expr) {
       WriteInfixBinaryExpr(expr.opcode, "/", 4);
       break;
 
-    case Opcode::I32RemS:
-      WritePrefixBinaryExpr(expr.opcode, WASM_RT_PKG ".I32_REM_S", true);
-      break;
-
-    case Opcode::I64RemS:
-      WritePrefixBinaryExpr(expr.opcode, WASM_RT_PKG ".I64_REM_S", true);
-      break;
-
-    case Opcode::I32RemU:
-    case Opcode::I64RemU:
-      WritePrefixBinaryExpr(expr.opcode, WASM_RT_PKG ".REM_U", true);
-      break;
-
     case Opcode::I32And:
     case Opcode::I64And:
       WriteInfixBinaryExpr(expr.opcode, "and", 7);
@@ -3039,6 +5757,11 @@ void KotlinWriter::Write(const BinaryExpr& expr) {
 }
 
 void KotlinWriter::Write(const CompareExpr& expr) {
+  if (expr.opcode.GetPrefix() == 0xfd) {
+    std::string func = WASM_RT_PKG "." + OpcodeFuncName(expr.opcode);
+    WritePrefixBinaryExpr(expr.opcode, func.c_str());
+    return;
+  }
   switch (expr.opcode) {
     case Opcode::I32Eq:
     case Opcode::I64Eq:
@@ -3108,6 +5831,11 @@ void KotlinWriter::Write(const CompareExpr& expr) {
 }
 
 void KotlinWriter::Write(const ConvertExpr& expr) {
+  if (expr.opcode.GetPrefix() == 0xfd) {
+    std::string func = WASM_RT_PKG "." + OpcodeFuncName(expr.opcode);
+    WriteSimpleUnaryExpr(expr.opcode.GetResultType(), func.c_str());
+    return;
+  }
   switch (expr.opcode) {
     case Opcode::I32Eqz:
     case Opcode::I64Eqz:
@@ -3256,7 +5984,177 @@ void KotlinWriter::Write(const ConvertExpr& expr) {
   }
 }
 
+const char* KotlinWriter::MemoryAccessSuffix() const {
+  return options_.explicit_bounds_checks ? "_chk" : "";
+}
+
+// Records, for each block-like expression, the locals assigned anywhere
+// inside it. Used to invalidate checked ranges on entry to such expressions.
+void KotlinWriter::CollectAssignedLocals(const ExprList& exprs,
+                                         SymbolSet* assigned) {
+  for (const Expr& expr : exprs) {
+    SymbolSet inner;
+    switch (expr.type()) {
+      case ExprType::LocalSet:
+        assigned->insert(LocalSlotName(cast<LocalSetExpr>(&expr)->var));
+        continue;
+
+      case ExprType::LocalTee:
+        assigned->insert(LocalSlotName(cast<LocalTeeExpr>(&expr)->var));
+        continue;
+
+      case ExprType::Block:
+        CollectAssignedLocals(cast<BlockExpr>(&expr)->block.exprs, &inner);
+        break;
+
+      case ExprType::Loop:
+        CollectAssignedLocals(cast<LoopExpr>(&expr)->block.exprs, &inner);
+        break;
+
+      case ExprType::If:
+        CollectAssignedLocals(cast<IfExpr>(&expr)->true_.exprs, &inner);
+        CollectAssignedLocals(cast<IfExpr>(&expr)->false_, &inner);
+        break;
+
+      case ExprType::Try: {
+        const TryExpr& tryexpr = *cast<TryExpr>(&expr);
+        CollectAssignedLocals(tryexpr.block.exprs, &inner);
+        for (const Catch& c : tryexpr.catches) {
+          CollectAssignedLocals(c.exprs, &inner);
+        }
+        break;
+      }
+
+      default:
+        continue;
+    }
+    assigned->insert(inner.begin(), inner.end());
+    assigned_locals_[&expr] = std::move(inner);
+  }
+}
+
+// Checked ranges only flow forward through straight-line code. On entry to a
+// block-like expression the ranges of locals assigned inside it are dropped,
+// since loops and branches can reach any point inside it with those locals
+// changed; on exit (and at the start of each else/catch) we go back to what
+// was known on entry.
+void KotlinWriter::EnterCheckedScope(const Expr& expr) {
+  auto iter = assigned_locals_.find(&expr);
+  if (iter != assigned_locals_.end()) {
+    for (const std::string& local : iter->second) {
+      ForgetCheckedRanges(local);
+    }
+  }
+  checked_scopes_.push_back(checked_ranges_);
+}
+
+void KotlinWriter::ResetCheckedScope() {
+  assert(!checked_scopes_.empty());
+  checked_ranges_ = checked_scopes_.back();
+}
+
+void KotlinWriter::LeaveCheckedScope() {
+  ResetCheckedScope();
+  checked_scopes_.pop_back();
+}
+
+void KotlinWriter::ForgetCheckedRanges(const std::string& local) {
+  for (auto iter = checked_ranges_.begin(); iter != checked_ranges_.end();) {
+    if (iter->first.second == local) {
+      iter = checked_ranges_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+bool KotlinWriter::IsCheckedRange(const std::string& memory,
+                                  const std::string& local,
+                                  uint64_t end) const {
+  auto iter = checked_ranges_.find({memory, local});
+  return iter != checked_ranges_.end() && end <= iter->second;
+}
+
+void KotlinWriter::AddCheckedRange(const std::string& memory,
+                                   const std::string& local,
+                                   uint64_t end) {
+  // Memories never shrink, so a successful access keeps the range valid for
+  // as long as the local isn't reassigned. Larger ends can't be in bounds.
+  if (end > static_cast<uint64_t>(std::numeric_limits<int32_t>::max())) {
+    return;
+  }
+  uint64_t& checked = checked_ranges_[{memory, local}];
+  checked = std::max(checked, end);
+}
+
+// Returns the accessor call for an access of |size| bytes at |addr| +
+// |offset|, without the closing parenthesis (or the stored value). Constant
+// addresses are folded into the offset, and an access that an earlier access
+// on every path already proved in bounds uses the unchecked accessors.
+std::string KotlinWriter::MemoryAccess(const Memory& memory,
+                                       const char* func,
+                                       const StackValue& addr,
+                                       uint64_t offset,
+                                       uint64_t size,
+                                       const SideEffects& later_effects) {
+  std::string call = GetGlobalName(memory.name) + "." + func;
+  bool simple = addr.precedence == 1 && addr.side_effects.empty() &&
+                !addr.depends_on.depends_memory &&
+                addr.depends_on.depends_globals.empty();
+  if (simple && addr.depends_on.depends_locals.empty()) {
+    // i32.const, as written by WriteValue(const Const&).
+    std::string_view digits = addr.value;
+    if (digits.size() > 2 && digits.front() == '(' && digits.back() == ')') {
+      digits = digits.substr(1, digits.size() - 2);
+    }
+    int32_t value;
+    const char* end = digits.data() + digits.size();
+    auto [ptr, ec] = std::from_chars(digits.data(), end, value);
+    if (ec == std::errc() && ptr == end &&
+        static_cast<uint64_t>(static_cast<uint32_t>(value)) + offset <=
+            std::numeric_limits<uint32_t>::max()) {
+      uint64_t folded = static_cast<uint32_t>(value) + offset;
+      std::string pos =
+          static_cast<int32_t>(folded) < 0
+              ? StringPrintf("(%d)", static_cast<int32_t>(folded))
+              : StringPrintf("%d", static_cast<int32_t>(folded));
+      if (IsCheckedRange(memory.name, "", folded + size)) {
+        return call + "_nochk(" + pos;
+      }
+      AddCheckedRange(memory.name, "", folded + size);
+      return call + MemoryAccessSuffix() + "(" + pos;
+    }
+  } else if (simple && addr.depends_on.depends_locals.size() == 1) {
+    Index local_index = addr.depends_on.depends_locals.front();
+    const std::string& local = local_names_[local_index];
+    if (local_sym_map_[local] == addr.value) {
+      if (IsCheckedRange(memory.name, local, offset + size)) {
+        if (offset == 0) {
+          return call + "_nochk(" + addr.value;
+        }
+        return call + "_nochk(" + addr.value +
+               StringPrintf(" + %d", static_cast<int32_t>(offset));
+      }
+      // The address is read before |later_effects| happen.
+      if (!later_effects.updates_locals.count(local_index)) {
+        AddCheckedRange(memory.name, local, offset + size);
+        AddCheckedRange(memory.name, "", offset + size);
+      }
+    }
+  }
+  std::string result = call + MemoryAccessSuffix() + "(" + addr.value;
+  if (offset != 0) {
+    result += StringPrintf(", %d", static_cast<int32_t>(offset));
+  }
+  return result;
+}
+
 void KotlinWriter::Write(const LoadExpr& expr) {
+  if (expr.opcode.GetPrefix() == 0xfd) {
+    WriteSimdLoad(expr.opcode, expr.memidx, expr.offset);
+    return;
+  }
+
   const char* func = nullptr;
   switch (expr.opcode) {
     case Opcode::I32Load:
@@ -3312,19 +6210,27 @@ void KotlinWriter::Write(const LoadExpr& expr) {
   StackValue sv = PopValue();
   DropTypes(1);
   PushType(result_type);
-  std::string pos;
-  std::swap(sv.value, pos);
+  std::string access = MemoryAccess(*memory, func, sv, expr.offset,
+                                    expr.opcode.GetMemorySize(), SideEffects());
+  sv.value.clear();
   sv.precedence = 2;
   sv.depends_on.depends_memory = true;
   sv.side_effects.can_trap = true;
   PushValue(sv);
-  WriteValue(GlobalName(memory->name), ".", func, "(", pos);
-  if (expr.offset != 0)
-    WriteValuef(", %d", static_cast<int32_t>(expr.offset));
-  WriteValue(")");
+  WriteValue(access, ")");
 }
 
 void KotlinWriter::Write(const StoreExpr& expr) {
+  if (expr.opcode.GetPrefix() == 0xfd) {
+    StackValue sv_right = PopValue();
+    StackValue sv_left = PopValue();
+    DropTypes(2);
+    SpillValues();
+    Write(OffsetMemoryAccess(expr.opcode, expr.memidx, sv_left, expr.offset),
+          ", ", sv_right.value, ");", Newline());
+    return;
+  }
+
   const char* func = nullptr;
   switch (expr.opcode) {
     case Opcode::I32Store:
@@ -3365,13 +6271,17 @@ void KotlinWriter::Write(const StoreExpr& expr) {
   StackValue sv_left = PopValue();
   DropTypes(2);
   SpillValues();
-  Write(GlobalName(memory->name), ".", func, "(", sv_left.value);
-  if (expr.offset != 0)
-    Writef(", %d", static_cast<int32_t>(expr.offset));
-  Write(", ", sv_right.value, ");", Newline());
+  Write(MemoryAccess(*memory, func, sv_left, expr.offset,
+                     expr.opcode.GetMemorySize(), sv_right.side_effects),
+        ", ", sv_right.value, ");", Newline());
 }
 
 void KotlinWriter::Write(const UnaryExpr& expr) {
+  if (expr.opcode.GetPrefix() == 0xfd) {
+    std::string func = WASM_RT_PKG "." + OpcodeFuncName(expr.opcode);
+    WriteSimpleUnaryExpr(expr.opcode.GetResultType(), func.c_str());
+    return;
+  }
   switch (expr.opcode) {
     case Opcode::I32Clz:
       WritePostfixUnaryExpr(expr.opcode.GetResultType(),
@@ -3466,13 +6376,20 @@ void KotlinWriter::Write(const UnaryExpr& expr) {
 void KotlinWriter::Write(const TernaryExpr& expr) {
   switch (expr.opcode) {
     case Opcode::V128BitSelect: {
-      // Type result_type = expr.opcode.GetResultType();
-      // Write(StackVar(2, result_type), " = ", "v128.bitselect", "(",
-      // StackVar(0),
-      //       ", ", StackVar(1), ", ", StackVar(2), ");", Newline());
-      // DropTypes(3);
-      // PushType(result_type);
-      UNIMPLEMENTED("SIMD support");
+      StackValue sv_mask = PopValue();
+      StackValue sv_right = PopValue();
+      StackValue sv_left = PopValue();
+      DropTypes(3);
+      PushType(expr.opcode.GetResultType());
+      sv_left.value = WASM_RT_PKG "." + OpcodeFuncName(expr.opcode) + "(" +
+                      sv_left.value + ", " + sv_right.value + ", " +
+                      sv_mask.value + ")";
+      sv_left.precedence = 2;
+      sv_left.depends_on |= sv_right.depends_on;
+      sv_left.depends_on |= sv_mask.depends_on;
+      sv_left.side_effects |= sv_right.side_effects;
+      sv_left.side_effects |= sv_mask.side_effects;
+      PushValue(sv_left);
       break;
     }
     default:
@@ -3481,7 +6398,8 @@ void KotlinWriter::Write(const TernaryExpr& expr) {
 }
 
 void KotlinWriter::Write(const SimdLaneOpExpr& expr) {
-  Type result_type = expr.opcode.GetResultType();
+  std::string func = WASM_RT_PKG "." + OpcodeFuncName(expr.opcode);
+  std::string lane = std::to_string(expr.val);
 
   switch (expr.opcode) {
     case Opcode::I8X16ExtractLaneS:
@@ -3492,10 +6410,12 @@ void KotlinWriter::Write(const SimdLaneOpExpr& expr) {
     case Opcode::I64X2ExtractLane:
     case Opcode::F32X4ExtractLane:
     case Opcode::F64X2ExtractLane: {
-      // Write(StackVar(0, result_type), " = ", expr.opcode.GetName(), "(",
-      //       StackVar(0), ", lane Imm: ", expr.val, ");", Newline());
-      // DropTypes(1);
-      UNIMPLEMENTED("SIMD support");
+      StackValue sv = PopValue();
+      DropTypes(1);
+      PushType(expr.opcode.GetResultType());
+      sv.value = func + "(" + sv.value + ", " + lane + ")";
+      sv.precedence = 2;
+      PushValue(sv);
       break;
     }
     case Opcode::I8X16ReplaceLane:
@@ -3504,66 +6424,142 @@ void KotlinWriter::Write(const SimdLaneOpExpr& expr) {
     case Opcode::I64X2ReplaceLane:
     case Opcode::F32X4ReplaceLane:
     case Opcode::F64X2ReplaceLane: {
-      // Write(StackVar(1, result_type), " = ", expr.opcode.GetName(), "(",
-      //       StackVar(0), ", ", StackVar(1), ", lane Imm: ", expr.val, ");",
-      //       Newline());
-      // DropTypes(2);
-      UNIMPLEMENTED("SIMD support");
+      StackValue sv_right = PopValue();
+      StackValue sv_left = PopValue();
+      DropTypes(2);
+      PushType(expr.opcode.GetResultType());
+      sv_left.value = func + "(" + sv_left.value + ", " + sv_right.value +
+                      ", " + lane + ")";
+      sv_left.precedence = 2;
+      sv_left.depends_on |= sv_right.depends_on;
+      sv_left.side_effects |= sv_right.side_effects;
+      PushValue(sv_left);
       break;
     }
     default:
       WABT_UNREACHABLE;
   }
+}
+
+std::string KotlinWriter::OffsetMemoryAccess(Opcode opcode,
+                                             const Var& memidx,
+                                             const StackValue& addr,
+                                             Address offset) {
+  // Unlike MemoryAccess, there are no _chk/_nochk variants: the v128 and
+  // atomic helpers always take an offset and check the whole access
+  // themselves.
+  Memory* memory = module_->memories[module_->GetMemoryIndex(memidx)];
+  return GetGlobalName(memory->name) + "." + OpcodeFuncName(opcode) + "(" +
+         addr.value + StringPrintf(", %d", static_cast<int32_t>(offset));
+}
+
+void KotlinWriter::WriteSimdLoad(Opcode opcode,
+                                 const Var& memidx,
+                                 Address offset) {
+  StackValue sv = PopValue();
+  DropTypes(1);
+  PushType(opcode.GetResultType());
+  sv.value = OffsetMemoryAccess(opcode, memidx, sv, offset) + ")";
+  sv.precedence = 2;
+  sv.depends_on.depends_memory = true;
+  sv.side_effects.can_trap = true;
+  PushValue(sv);
+}
 
+void KotlinWriter::WriteAtomicExpr(Opcode opcode,
+                                   const Var& memidx,
+                                   Address offset,
+                                   Index num_operands) {
+  // Atomics are ordered like calls: everything before them is written out
+  // first, and they count as a memory update.
+  std::vector<StackValue> args = PopValues(num_operands);
+  DropTypes(num_operands);
+  SpillValues();
+  std::string call = OffsetMemoryAccess(opcode, memidx, args[0], offset);
+  for (Index i = 1; i < num_operands; ++i) {
+    call += ", " + args[i].value;
+  }
+  call += ")";
+  Type result_type = opcode.GetResultType();
+  if (result_type == Type::Void) {
+    Write(call, ";", Newline());
+    return;
+  }
+  StackValue sv;
+  sv.value = call;
+  sv.precedence = 2;
+  for (const StackValue& arg : args) {
+    sv.depends_on |= arg.depends_on;
+    sv.side_effects |= arg.side_effects;
+  }
+  sv.depends_on.depends_memory = true;
+  sv.side_effects.updates_memory = true;
+  sv.side_effects.can_trap = true;
   PushType(result_type);
+  PushValue(sv);
 }
 
 void KotlinWriter::Write(const SimdLoadLaneExpr& expr) {
-  UNIMPLEMENTED("SIMD support");
+  StackValue sv_vec = PopValue();
+  StackValue sv = PopValue();
+  DropTypes(2);
+  PushType(expr.opcode.GetResultType());
+  sv.value = OffsetMemoryAccess(expr.opcode, expr.memidx, sv, expr.offset) +
+             ", " + sv_vec.value + ", " + std::to_string(expr.val) + ")";
+  sv.precedence = 2;
+  sv.depends_on |= sv_vec.depends_on;
+  sv.depends_on.depends_memory = true;
+  sv.side_effects |= sv_vec.side_effects;
+  sv.side_effects.can_trap = true;
+  PushValue(sv);
 }
 
 void KotlinWriter::Write(const SimdStoreLaneExpr& expr) {
-  UNIMPLEMENTED("SIMD support");
+  StackValue sv_vec = PopValue();
+  StackValue sv = PopValue();
+  DropTypes(2);
+  SpillValues();
+  Write(OffsetMemoryAccess(expr.opcode, expr.memidx, sv, expr.offset), ", ",
+        sv_vec.value, ", ", std::to_string(expr.val), ");", Newline());
 }
 
 void KotlinWriter::Write(const SimdShuffleOpExpr& expr) {
-  // Type result_type = expr.opcode.GetResultType();
-  // Write(StackVar(1, result_type), " = ", expr.opcode.GetName(), "(",
-  //       StackVar(1), " ", StackVar(0), ", lane Imm: $0x%08x %08x %08x %08x",
-  //       expr.val.u32(0), expr.val.u32(1), expr.val.u32(2), expr.val.u32(3),
-  //       ")", Newline());
-  // DropTypes(2);
-  // PushType(result_type);
-  UNIMPLEMENTED("SIMD support");
+  StackValue sv_right = PopValue();
+  StackValue sv_left = PopValue();
+  DropTypes(2);
+  PushType(expr.opcode.GetResultType());
+  // The 16 lane indices are passed as the bytes of two Longs.
+  sv_left.value = WASM_RT_PKG "." + OpcodeFuncName(expr.opcode) + "(" +
+                  sv_left.value + ", " + sv_right.value + ", " +
+                  LongLiteral(expr.val.u64(0)) + ", " +
+                  LongLiteral(expr.val.u64(1)) + ")";
+  sv_left.precedence = 2;
+  sv_left.depends_on |= sv_right.depends_on;
+  sv_left.side_effects |= sv_right.side_effects;
+  PushValue(sv_left);
 }
 
 void KotlinWriter::Write(const LoadSplatExpr& expr) {
-  // assert(module_->memories.size() == 1);
-  // Memory* memory = module_->memories[0];
-
-  // Type result_type = expr.opcode.GetResultType();
-  // Write(StackVar(0, result_type), " = ", expr.opcode.GetName(), "(",
-  //       ExternalPtr(memory->name), ", (long)(", StackVar(0));
-  // if (expr.offset != 0)
-  //   Write(" + ", expr.offset);
-  // Write("));", Newline());
-  // DropTypes(1);
-  // PushType(result_type);
-  UNIMPLEMENTED("SIMD support");
+  WriteSimdLoad(expr.opcode, expr.memidx, expr.offset);
 }
 
 void KotlinWriter::Write(const LoadZeroExpr& expr) {
-  UNIMPLEMENTED("SIMD support");
+  WriteSimdLoad(expr.opcode, expr.memidx, expr.offset);
 }
 
 void KotlinWriter::WriteKotlinSource() {
   stream_ = kotlin_stream_;
   Write("/* Automatically generated by wasm2kotlin */", Newline());
   WriteSourceTop();
+  FindUsedFuncs();
   WriteFuncTypes();
+  WriteFuel();
   WriteImports();
   WriteTags();
   AllocateFuncs();
+  WriteScratch();
+  WriteTrampolines();
+  WriteFuncRefs();
   WriteGlobals();
   WriteMemories();
   WriteTables();
@@ -3573,11 +6569,11 @@ void KotlinWriter::WriteKotlinSource() {
   WriteFuncs();
   WriteInit();
   WriteCallIndirectDefinitions();
+  WriteTypedFuncs();
   WriteSourceBottom();
 }
 
 Result KotlinWriter::WriteModule(const Module& module) {
-  WABT_USE(options_);
   module_ = &module;
   WriteKotlinSource();
   return result_;
@@ -3585,12 +6581,15 @@ Result KotlinWriter::WriteModule(const Module& module) {
 
 }  // end anonymous namespace
 
-Result WriteKotlin(Stream* kotlin_stream,
+Result WriteKotlin(std::vector<Stream*>&& kotlin_streams,
+                   Stream* data_stream,
+                   const char* data_name,
                    const char* class_name,
                    const char* package_name,
                    const Module* module,
                    const WriteKotlinOptions& options) {
-  KotlinWriter kotlin_writer(kotlin_stream, class_name, package_name, options);
+  KotlinWriter kotlin_writer(std::move(kotlin_streams), data_stream, data_name,
+                             class_name, package_name, options);
   return kotlin_writer.WriteModule(*module);
 }
 
@@ -17,6 +17,8 @@
 #ifndef WABT_C_WRITER_H_
 #define WABT_C_WRITER_H_
 
+#include <vector>
+
 #include "src/common.h"
 
 namespace wabt {
@@ -24,9 +26,39 @@ namespace wabt {
 struct Module;
 class Stream;
 
-struct WriteKotlinOptions {};
+struct WriteKotlinOptions {
+  // Use the Memory accessors that do an explicit range check instead of
+  // catching the ByteBuffer's IndexOutOfBoundsException.
+  bool explicit_bounds_checks = false;
+  // Return the extra results of multi-value functions through per-instance
+  // fields instead of a callback lambda, for direct calls.
+  bool multi_value_fields = false;
+  // Move blocks and loops out of functions larger than this many
+  // instructions into helper functions, so the JVM will still compile them.
+  // 0 disables outlining.
+  Index max_function_size = 0;
+  // Write functions on this many threads. The output doesn't depend on it.
+  unsigned num_threads = 1;
+  // Leave out functions and function imports that can't be reached from the
+  // exports, start functions, elem segments or global initializers.
+  bool remove_unused_funcs = false;
+  // If given, how many were left out is reported to it.
+  Stream* report_stream = nullptr;
+  // Burn a unit of the registry's fuel at each function entry and loop
+  // iteration, so that running out or an interrupt stops the module.
+  bool fuel = false;
+};
 
-Result WriteKotlin(Stream* kotlin_stream,
+// If data_stream is given, the contents of data segments are written to it
+// instead of the Kotlin source, and loaded at instantiation from the class
+// resource data_name.
+//
+// The class is written to kotlin_streams[0]. If there are more streams, the
+// functions are spread over them as extension functions on the class, each
+// always going to the same one.
+Result WriteKotlin(std::vector<Stream*>&& kotlin_streams,
+              Stream* data_stream,
+              const char* data_name,
               const char* class_name,
               const char* package_name,
               const Module*,
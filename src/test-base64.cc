@@ -0,0 +1,59 @@
+/*
+ * Copyright 2021 WebAssembly Community Group participants
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "gtest/gtest.h"
+
+#include <string>
+#include <string_view>
+
+#include "src/base64.h"
+
+using namespace wabt;
+
+namespace {
+
+std::string Encode(std::string_view s) {
+  std::string result(Base64EncodedSize(s.size()), '\0');
+  Base64Encode(s.data(), s.size(), result.data());
+  return result;
+}
+
+}  // end anonymous namespace
+
+TEST(Base64, Empty) {
+  EXPECT_EQ("", Encode(""));
+}
+
+TEST(Base64, Remainders) {
+  EXPECT_EQ("Zg", Encode("f"));
+  EXPECT_EQ("Zm8", Encode("fo"));
+  EXPECT_EQ("Zm9v", Encode("foo"));
+  EXPECT_EQ("Zm9vYg", Encode("foob"));
+  EXPECT_EQ("Zm9vYmE", Encode("fooba"));
+  EXPECT_EQ("Zm9vYmFy", Encode("foobar"));
+}
+
+TEST(Base64, AllBytes) {
+  std::string bytes;
+  for (int i = 0; i < 256; ++i) {
+    bytes.push_back(static_cast<char>(i));
+  }
+  std::string encoded = Encode(bytes);
+  ASSERT_EQ(342u, encoded.size());
+  EXPECT_EQ("AAECAwQFBgcICQoLDA0ODxAREhMUFRYXGBkaGxwdHh8g",
+            encoded.substr(0, 44));
+  EXPECT_EQ("y8/T19vf4+fr7/P3+/w", encoded.substr(323));
+}
@@ -30,8 +30,11 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cinttypes>
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
 
@@ -55,11 +58,14 @@ static int s_verbose;
 static std::string s_infile;
 static std::string s_outfile;
 static std::string s_package;
+static std::string s_data_file;
+static int s_num_shards = 0;
 static std::string s_class;
 static Features s_features;
 static WriteKotlinOptions s_write_kotlin_options;
 static bool s_read_debug_names = true;
 static std::unique_ptr<FileStream> s_log_stream;
+static std::unique_ptr<FileStream> s_report_stream;
 
 static const char s_description[] =
     R"(  Read a file in the WebAssembly binary format, and convert it to
@@ -75,13 +81,31 @@ examples:
 
 static const std::string supported_features[] = {
     "multi-memory", "multi-value", "sign-extend", "saturating-float-to-int",
-    "exceptions"};
+    "exceptions", "simd", "threads", "tail-call"};
 
 static bool IsFeatureSupported(const std::string& feature) {
   return std::find(std::begin(supported_features), std::end(supported_features),
                    feature) != std::end(supported_features);
 };
 
+// Parses the value of a numeric option, exiting with an error unless it is a
+// decimal number from min to max.
+static unsigned long ParseNumberOption(const char* name,
+                                       const std::string& argument,
+                                       unsigned long min,
+                                       unsigned long max) {
+  unsigned long value = 0;
+  const char* end = argument.data() + argument.size();
+  auto [ptr, ec] = std::from_chars(argument.data(), end, value);
+  if (argument.empty() || ec != std::errc() || ptr != end || value < min ||
+      value > max) {
+    fprintf(stderr, "--%s expects a number from %lu to %lu, got \"%s\"\n",
+            name, min, max, argument.c_str());
+    exit(1);
+  }
+  return value;
+}
+
 static void ParseOptions(int argc, char** argv) {
   OptionParser parser("wasm2kotlin", s_description);
 
@@ -107,6 +131,60 @@ static void ParseOptions(int argc, char** argv) {
   s_features.AddOptions(&parser);
   parser.AddOption("no-debug-names", "Ignore debug names in the binary file",
                    []() { s_read_debug_names = false; });
+  parser.AddOption("explicit-bounds-checks",
+                   "Range check memory accesses explicitly instead of "
+                   "relying on ByteBuffer's index checks",
+                   []() {
+                     s_write_kotlin_options.explicit_bounds_checks = true;
+                   });
+  parser.AddOption("multi-value-fields",
+                   "Return extra results of multi-value functions through "
+                   "fields instead of a callback lambda",
+                   []() { s_write_kotlin_options.multi_value_fields = true; });
+  parser.AddOption('\0', "max-function-size", "SIZE",
+                   "Outline parts of functions with more than SIZE "
+                   "instructions into helper functions",
+                   [](const std::string& argument) {
+                     s_write_kotlin_options.max_function_size =
+                         ParseNumberOption("max-function-size", argument, 0,
+                                           UINT32_MAX);
+                   });
+  parser.AddOption('\0', "jobs", "N",
+                   "Write functions on N threads at once (the output is the "
+                   "same for any N)",
+                   [](const std::string& argument) {
+                     s_write_kotlin_options.num_threads =
+                         ParseNumberOption("jobs", argument, 1, UINT_MAX);
+                   });
+  parser.AddOption("remove-unused",
+                   "Leave out functions and function imports that can't be "
+                   "reached from the exports, start function or tables, and "
+                   "report how many",
+                   []() {
+                     s_write_kotlin_options.remove_unused_funcs = true;
+                     s_report_stream = FileStream::CreateStderr();
+                     s_write_kotlin_options.report_stream =
+                         s_report_stream.get();
+                   });
+  parser.AddOption("fuel",
+                   "Burn the module registry's fuel at function entries and "
+                   "loop iterations, so the module can be limited or "
+                   "interrupted",
+                   []() { s_write_kotlin_options.fuel = true; });
+  parser.AddOption('\0', "data-file", "FILENAME",
+                   "Write the contents of data segments to FILENAME, to be "
+                   "loaded as a class resource, instead of the Kotlin source",
+                   [](const std::string& argument) {
+                     s_data_file = argument;
+                     ConvertBackslashToSlash(&s_data_file);
+                   });
+  parser.AddOption('\0', "shards", "N",
+                   "Write the functions to N more files next to the output "
+                   "file FOO.kt, named FOO_shard0.kt and so on",
+                   [](const std::string& argument) {
+                     s_num_shards =
+                         ParseNumberOption("shards", argument, 0, INT_MAX);
+                   });
   parser.AddArgument("filename", OptionParser::ArgumentCount::One,
                      [](const char* argument) {
                        s_infile = argument;
@@ -114,6 +192,11 @@ static void ParseOptions(int argc, char** argv) {
                      });
   parser.Parse(argc, argv);
 
+  if (s_num_shards > 0 && s_outfile.empty()) {
+    fprintf(stderr, "--shards requires an output file (-o)\n");
+    exit(1);
+  }
+
   bool any_non_supported_feature = false;
 #define WABT_FEATURE(variable, flag, default_, help)   \
   any_non_supported_feature |=                         \
@@ -179,23 +262,49 @@ int ProgramMain(int argc, char** argv) {
       }
 
       if (Succeeded(result)) {
+        std::unique_ptr<FileStream> data_stream;
+        std::string data_name;
+        if (!s_data_file.empty()) {
+          data_stream = std::make_unique<FileStream>(s_data_file.c_str());
+          if (!data_stream->is_open()) {
+            fprintf(stderr, "unable to open data file \"%s\"\n",
+                    s_data_file.c_str());
+            return 1;
+          }
+          // Resources are looked up relative to the class' package.
+          data_name = s_data_file.substr(s_data_file.find_last_of('/') + 1);
+        }
         if (!s_outfile.empty()) {
           FileStream kotlin_stream(s_outfile.c_str());
           std::string class_name = std::move(s_class);
           if (class_name.empty()) {
             class_name = get_classname(s_outfile);
           }
-          result =
-              WriteKotlin(&kotlin_stream, class_name.c_str(), s_package.c_str(),
-                          &module, s_write_kotlin_options);
+          std::vector<std::unique_ptr<FileStream>> shard_streams;
+          std::vector<Stream*> kotlin_streams{&kotlin_stream};
+          std::string shard_prefix(
+              s_outfile.substr(0, s_outfile.find_last_of('/') + 1));
+          shard_prefix += get_classname(s_outfile);
+          for (int i = 0; i < s_num_shards; ++i) {
+            std::string shard_file =
+                shard_prefix + "_shard" + std::to_string(i) + ".kt";
+            shard_streams.push_back(
+                std::make_unique<FileStream>(shard_file.c_str()));
+            kotlin_streams.push_back(shard_streams.back().get());
+          }
+          result = WriteKotlin(std::move(kotlin_streams), data_stream.get(),
+                               data_name.c_str(), class_name.c_str(),
+                               s_package.c_str(), &module,
+                               s_write_kotlin_options);
         } else {
           FileStream stream(stdout);
           std::string class_name = std::move(s_class);
           if (class_name.empty()) {
             class_name = "Wasm";
           }
-          result = WriteKotlin(&stream, class_name.c_str(), s_package.c_str(),
-                               &module, s_write_kotlin_options);
+          result = WriteKotlin({&stream}, data_stream.get(), data_name.c_str(),
+                               class_name.c_str(), s_package.c_str(), &module,
+                               s_write_kotlin_options);
         }
       }
     }
@@ -121,6 +121,7 @@ fun ASSERT_RETURN_F64(f: () -> Double, expected: Double, name: BMap) = ASSERT_RE
 fun ASSERT_RETURN_F64_I32(f: () -> (((Int) -> Unit) -> Double), exp1: Double, exp2: Int, name: BMap) = ASSERT_RETURN_TU(f, exp1, exp2, ::is_equal_f64, ::is_equal_u32, name)
 fun ASSERT_RETURN_I32_F64(f: () -> (((Double) -> Unit) -> Int), exp1: Int, exp2: Double, name: BMap) = ASSERT_RETURN_TU(f, exp1, exp2, ::is_equal_u32, ::is_equal_f64, name)
 fun ASSERT_RETURN_I64_I32(f: () -> (((Int) -> Unit) -> Long), exp1: Long, exp2: Int, name: BMap) = ASSERT_RETURN_TU(f, exp1, exp2, ::is_equal_u64, ::is_equal_u32, name)
+fun ASSERT_RETURN_I64_I64(f: () -> (((Long) -> Unit) -> Long), exp1: Long, exp2: Long, name: BMap) = ASSERT_RETURN_TU(f, exp1, exp2, ::is_equal_u64, ::is_equal_u64, name)
 
 fun ASSERT_RETURN_CANONICAL_NAN_F32(f: () -> Float, name: BMap) = ASSERT_RETURN_NAN_T(f, ::is_canonical_nan_f32, name, "canonical")
 fun ASSERT_RETURN_CANONICAL_NAN_F64(f: () -> Double, name: BMap) = ASSERT_RETURN_NAN_T(f, ::is_canonical_nan_f64, name, "canonical")
@@ -132,6 +133,51 @@ fun is_equal_u64(x: Long, y: Long): Boolean = x == y
 fun is_equal_f32(x: Float, y: Float): Boolean = x.toRawBits() == y.toRawBits()
 fun is_equal_f64(x: Double, y: Double): Boolean = x.toRawBits() == y.toRawBits()
 
+fun v128_lane_bits(v128: BMap): Int = when ((v128.get("lane_type") as Bytes).toString()) {
+    "i8" -> 8
+    "i16" -> 16
+    "i32", "f32" -> 32
+    else -> 64
+}
+fun v128_lanes(v128: BMap): List<String> = (v128.get("value") as BList).list.map { (it as Bytes).toString() }
+fun v128_lane(x: wasm_rt_impl.V128, i: Int, bits: Int): Long =
+    ((if (i * bits < 64) x.lo else x.hi) ushr ((i * bits) and 63)) and (-1L ushr (64 - bits))
+
+// nan lanes are left as 0; is_equal_v128 checks them.
+fun make_v128(v128: BMap): wasm_rt_impl.V128 {
+    val bits = v128_lane_bits(v128)
+    var lo = 0L
+    var hi = 0L
+    v128_lanes(v128).forEachIndexed { i, lane ->
+        if (!lane.startsWith("nan:")) {
+            val x = (BigInteger(lane).toLong() and (-1L ushr (64 - bits))) shl ((i * bits) and 63)
+            if (i * bits < 64) lo = lo or x else hi = hi or x
+        }
+    }
+    return wasm_rt_impl.V128(lo, hi)
+}
+fun is_equal_v128(x: wasm_rt_impl.V128, v128: BMap): Boolean {
+    val bits = v128_lane_bits(v128)
+    return v128_lanes(v128).withIndex().all { (i, lane) ->
+        val actual = v128_lane(x, i, bits)
+        when (lane) {
+            "nan:canonical" -> if (bits == 32) is_canonical_nan_f32(Float.fromBits(actual.toInt())) else is_canonical_nan_f64(Double.fromBits(actual))
+            "nan:arithmetic" -> if (bits == 32) is_arithmetic_nan_f32(Float.fromBits(actual.toInt())) else is_arithmetic_nan_f64(Double.fromBits(actual))
+            else -> actual == BigInteger(lane).toLong() and (-1L ushr (64 - bits))
+        }
+    }
+}
+
+// the host can't name a function, so a funcref result is only checked for
+// being non-null.
+val NON_NULL_FUNCREF: Any = Any()
+fun make_ref(type: String, value: String): Any? = when {
+    value == "null" -> null
+    type == "funcref" -> NON_NULL_FUNCREF
+    else -> value.toLong()
+}
+fun is_equal_ref(x: Any?, y: Any?): Boolean = if (y === NON_NULL_FUNCREF) x is wasm_rt_impl.Elem else x == y
+
 fun make_nan_f32(x: Int): Float = Float.fromBits(x or 0x7f800000)
 fun make_nan_f64(x: Long): Double = Double.fromBits(x or 0x7ff0000000000000L)
 
@@ -141,7 +187,7 @@ fun is_canonical_nan_f64(x: Double):  Boolean = (x.toRawBits() and 0x7ffffffffff
 fun is_arithmetic_nan_f64(x: Double): Boolean = (x.toRawBits() and 0x7ff8000000000000L) == 0x7ff8000000000000L
 
 
-class Z_spectest(moduleRegistry: wasm_rt_impl.ModuleRegistry, name: String) {
+class Z_spectest(val moduleRegistry: wasm_rt_impl.ModuleRegistry, name: String) {
   
   /*
    * spectest implementations
@@ -184,6 +230,31 @@ class Z_spectest(moduleRegistry: wasm_rt_impl.ModuleRegistry, name: String) {
     print(")\n");
   }
   
+  // runs the () -> () funcref `f` on `n` threads at once, and rethrows what
+  // the first of them to fail threw.
+  fun spectest_parallel(f: wasm_rt_impl.Elem?, n: Int) {
+    @Suppress("UNCHECKED_CAST")
+    val func = f!!.func as () -> Unit
+    val thrown = java.util.concurrent.atomic.AtomicReference<Throwable>()
+    val threads = List(n) {
+      Thread {
+        try {
+          func()
+        } catch (e: Throwable) {
+          thrown.compareAndSet(null, e)
+        }
+      }
+    }
+    threads.forEach { it.start() }
+    threads.forEach { it.join() }
+    thrown.get()?.let { throw it }
+  }
+
+  // for modules built with --fuel.
+  fun spectest_refuel(budget: Long) {
+    moduleRegistry.fuel.reset(budget)
+  }
+  
   var spectest_table: wasm_rt_impl.Table = wasm_rt_impl.Table(10, 20)
   var spectest_memory: wasm_rt_impl.Memory = wasm_rt_impl.Memory(1, 2)
   var spectest_global_i32: Int = 666
@@ -198,6 +269,8 @@ class Z_spectest(moduleRegistry: wasm_rt_impl.ModuleRegistry, name: String) {
       moduleRegistry.exportFunc(name, "Z_print_i32_f32", this@Z_spectest::spectest_print_i32_f32);
       moduleRegistry.exportFunc(name, "Z_print_f64", this@Z_spectest::spectest_print_f64);
       moduleRegistry.exportFunc(name, "Z_print_f64_f64", this@Z_spectest::spectest_print_f64_f64);
+      moduleRegistry.exportFunc(name, "Z_parallel", this@Z_spectest::spectest_parallel);
+      moduleRegistry.exportFunc(name, "Z_refuel", this@Z_spectest::spectest_refuel);
 
       moduleRegistry.exportTable(name, "Z_table", spectest_table);
       moduleRegistry.exportMemory(name, "Z_memory", spectest_memory);
@@ -210,9 +283,17 @@ class Z_spectest(moduleRegistry: wasm_rt_impl.ModuleRegistry, name: String) {
 
 }
 
+@Suppress("UNCHECKED_CAST")
 fun <T> getGlobal(moduleRegistry: wasm_rt_impl.ModuleRegistry, modname: String, fieldname: String): T {
     try {
-        return moduleRegistry.importGlobal<T>(modname, fieldname).get()
+        return when (val global = moduleRegistry.importGlobal<wasm_rt_impl.Global>(modname, fieldname)) {
+            is wasm_rt_impl.GlobalI32 -> global.value
+            is wasm_rt_impl.GlobalI64 -> global.value
+            is wasm_rt_impl.GlobalF32 -> global.value
+            is wasm_rt_impl.GlobalF64 -> global.value
+            is wasm_rt_impl.GlobalV128 -> global.value
+            is wasm_rt_impl.GlobalRef -> global.value
+        } as T
     } catch (e: NullPointerException) {
         return moduleRegistry.importConstant<T>(modname, fieldname)
     }
@@ -397,13 +478,19 @@ class Runner(val moduleRegistry: wasm_rt_impl.ModuleRegistry) {
                     "f64i32" -> ASSERT_RETURN_F64_I32({ action(command) as ((Int) -> Unit) -> Double }, Double.fromBits(value1.toLong()), value2.toInt(), command)
                     "i32f64" -> ASSERT_RETURN_I32_F64({ action(command) as ((Double) -> Unit) -> Int }, value1.toInt(), Double.fromBits(value2.toLong()), command)
                     "i64i32" -> ASSERT_RETURN_I64_I32({ action(command) as ((Int) -> Unit) -> Long }, value1.toLong(), value2.toInt(), command)
+                    "i64i64" -> ASSERT_RETURN_I64_I64({ action(command) as ((Long) -> Unit) -> Long }, value1.toLong(), value2.toLong(), command)
                     else -> FAIL(command)
                 }
             }
+        } else if (expected.list.size == 1 && (expected.list.get(0) as BMap).get("value") is BList) {
+            val v128 = expected.list.get(0) as BMap
+            ASSERT_RETURN_T({ action(command) as wasm_rt_impl.V128 }, make_v128(v128), { x, _ -> is_equal_v128(x, v128) }, command)
         } else if (expected.list.size == 1) {
             val type = ((expected.list.get(0) as BMap).get("type") as Bytes).toString()
             val value = ((expected.list.get(0) as BMap).get("value") as Bytes).toString()
-            if (value == "nan:canonical") {
+            if (type == "externref" || type == "funcref") {
+                ASSERT_RETURN_T({ action(command) }, make_ref(type, value), ::is_equal_ref, command)
+            } else if (value == "nan:canonical") {
                 when (type) {
                     "f32" -> ASSERT_RETURN_CANONICAL_NAN_F32({ action(command) as Float }, command)
                     "f64" -> ASSERT_RETURN_CANONICAL_NAN_F64({ action(command) as Double }, command)
@@ -451,7 +538,7 @@ class Runner(val moduleRegistry: wasm_rt_impl.ModuleRegistry) {
         }
     }
 
-    fun action(command: BMap): Any {
+    fun action(command: BMap): Any? {
         val action = command.get("action") as BMap
         val type = (action.get("type") as Bytes).toString()
         val module = (command.get("mangled_module_name") as Bytes).toString()
@@ -464,6 +551,12 @@ class Runner(val moduleRegistry: wasm_rt_impl.ModuleRegistry) {
                     is BList -> Array<Any?>(action_args.list.size) {
                         val arg = action_args.list.get(it) as BMap
                         val valtype = (arg.get("type") as Bytes).toString()
+                        if (valtype == "v128") {
+                            return@Array make_v128(arg)
+                        }
+                        if (valtype == "externref" || valtype == "funcref") {
+                            return@Array make_ref(valtype, (arg.get("value") as Bytes).toString())
+                        }
                         val value = BigInteger((arg.get("value") as Bytes).toString())
                         when (valtype) {
                             "f32" -> Float.fromBits(value.toInt())
@@ -478,7 +571,7 @@ class Runner(val moduleRegistry: wasm_rt_impl.ModuleRegistry) {
                 val cls = func::class.java
                 val invoke = cls.getDeclaredMethod("invoke", *Array(args.size) { java.lang.Object::class.java })
                 try {
-                    return invoke.invoke(func, *args) ?: Unit
+                    return invoke.invoke(func, *args)
                 } catch (e: java.lang.reflect.InvocationTargetException) {
                     // unwrap exception
                     throw e.getTargetException()
@@ -490,8 +583,22 @@ class Runner(val moduleRegistry: wasm_rt_impl.ModuleRegistry) {
     }
 }
 
-fun main() {
-    val moduleRegistry = wasm_rt_impl.ModuleRegistry()
+// keeps module memories in the backend named by --memory-backend.
+class SpecModuleRegistry(val backend: String?) : wasm_rt_impl.ModuleRegistry() {
+    override fun memoryBackend(modname: String, index: Int): wasm_rt_impl.MemoryBackend = when (backend) {
+        null, "heap" -> wasm_rt_impl.HeapMemoryBackend
+        "direct" -> wasm_rt_impl.DirectMemoryBackend
+        "mapped" -> {
+            val path = java.nio.file.Files.createTempFile("spec-memory", null)
+            path.toFile().deleteOnExit()
+            wasm_rt_impl.MappedMemoryBackend(path)
+        }
+        else -> throw RuntimeException("unknown memory backend " + backend)
+    }
+}
+
+fun main(args: Array<String>) {
+    val moduleRegistry = SpecModuleRegistry(args.getOrNull(0))
     Z_spectest(moduleRegistry, "Z_spectest");
     run_spec_tests(moduleRegistry);
 
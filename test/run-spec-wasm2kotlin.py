@@ -66,7 +66,7 @@ def bencode(data):
 
 
 def MangleType(t):
-    return {'i32': 'i', 'i64': 'j', 'f32': 'f', 'f64': 'd',
+    return {'i32': 'i', 'i64': 'j', 'f32': 'f', 'f64': 'd', 'v128': 'o',
             'externref': 'e', 'funcref': 'c'}[t]
 
 
@@ -111,12 +111,13 @@ def IsModuleCommand(command):
 
 class CWriter(object):
 
-    def __init__(self, spec_json, prefix, out_file, out_dir):
+    def __init__(self, spec_json, prefix, out_file, out_dir, fuel=None):
         self.source_filename = os.path.basename(spec_json['source_filename'])
         self.commands = spec_json['commands']
         self.out_file = out_file
         self.out_dir = out_dir
         self.prefix = prefix
+        self.fuel = fuel
         self.module_idx = 0
         self.module_name_to_idx = {}
         self.idx_to_module_name = {}
@@ -130,6 +131,8 @@ class CWriter(object):
         self._CacheModulePrefixes()
         self.out_file.write(self.prefix)
         self.out_file.write("\nfun run_spec_tests(moduleRegistry: wasm_rt_impl.ModuleRegistry) {\n\n")
+        if self.fuel is not None:
+            self.out_file.write("moduleRegistry.fuel.reset(%dL)\n" % self.fuel)
         self.out_file.write("runString(moduleRegistry, \"")
         for command in self.commands:
             self._WriteCommand(command)
@@ -286,8 +289,23 @@ def main(args):
     parser.add_argument('file', help='wast file.')
     parser.add_argument('--enable-exceptions', action='store_true')
     parser.add_argument('--enable-multi-memory', action='store_true')
+    parser.add_argument('--enable-threads', action='store_true')
+    parser.add_argument('--enable-tail-call', action='store_true')
     parser.add_argument('--disable-bulk-memory', action='store_true')
     parser.add_argument('--disable-reference-types', action='store_true')
+    parser.add_argument('--explicit-bounds-checks', action='store_true')
+    parser.add_argument('--multi-value-fields', action='store_true')
+    parser.add_argument('--max-function-size', metavar='SIZE')
+    parser.add_argument('--jobs', metavar='N')
+    parser.add_argument('--shards', metavar='N', type=int, default=0)
+    parser.add_argument('--remove-unused', action='store_true')
+    parser.add_argument('--fuel', metavar='UNITS', type=int,
+                        help='build with --fuel and give the tests UNITS of '
+                             'fuel.')
+    parser.add_argument('--data-file', action='store_true',
+                        help='write data segments to class resources.')
+    parser.add_argument('--memory-backend', choices=['heap', 'direct', 'mapped'],
+                        help='MemoryBackend for the modules\' memories.')
     options = parser.parse_args(args)
 
     with utils.TempDirectory(options.out_dir, 'run-spec-wasm2kotlin-') as out_dir:
@@ -300,6 +318,8 @@ def main(args):
             '-v': options.verbose,
             '--enable-exceptions': options.enable_exceptions,
             '--enable-multi-memory': options.enable_multi_memory,
+            '--enable-threads': options.enable_threads,
+            '--enable-tail-call': options.enable_tail_call,
             '--disable-bulk-memory': options.disable_bulk_memory,
             '--disable-reference-types': options.disable_reference_types})
 
@@ -313,7 +333,16 @@ def main(args):
         wasm2kotlin.verbose = options.print_cmd
         wasm2kotlin.AppendOptionalArgs({
             '--enable-exceptions': options.enable_exceptions,
-            '--enable-multi-memory': options.enable_multi_memory})
+            '--enable-multi-memory': options.enable_multi_memory,
+            '--enable-threads': options.enable_threads,
+            '--enable-tail-call': options.enable_tail_call,
+            '--explicit-bounds-checks': options.explicit_bounds_checks,
+            '--multi-value-fields': options.multi_value_fields,
+            '--max-function-size': options.max_function_size,
+            '--jobs': options.jobs,
+            '--shards': options.shards,
+            '--remove-unused': options.remove_unused,
+            '--fuel': options.fuel is not None})
 
         kotlinc = utils.Executable(options.kotlinc, *options.ktflags,
                                    forward_stderr=True, forward_stdout=True)
@@ -330,7 +359,7 @@ def main(args):
                 prefix = prefix_file.read() + '\n'
 
         output = io.StringIO()
-        cwriter = CWriter(spec_json, prefix, output, out_dir)
+        cwriter = CWriter(spec_json, prefix, output, out_dir, options.fuel)
         cwriter.Write()
 
         main_filename = utils.ChangeExt(json_file_path, '_main.kt')
@@ -338,6 +367,10 @@ def main(args):
             out_main_file.write(output.getvalue())
 
         kotlin_filenames = []
+        resource_dir = os.path.join(out_dir, 'resources')
+        package_dir = os.path.join(resource_dir, 'wabt', 'spec_test')
+        if options.data_file:
+            os.makedirs(package_dir, exist_ok=True)
 
         # Compile wasm-rt-impl.
         kotlin_filenames.append(os.path.join(options.wasmrt_dir, 'wasm_rt_impl.kt'))
@@ -346,16 +379,29 @@ def main(args):
             wasm_filename = os.path.join(out_dir, wasm_filename)
             kotlin_filename = utils.ChangeExt(wasm_filename, '.kt')
             prefix = cwriter.GetModulePrefix(i)
-            wasm2kotlin.RunWithArgs(wasm_filename, '-p', 'wabt.spec_test', '-c', prefix, '-o', kotlin_filename)
+            data_args = []
+            if options.data_file:
+                data_filename = os.path.join(package_dir, prefix + '.data')
+                data_args = ['--data-file=' + data_filename]
+            wasm2kotlin.RunWithArgs(wasm_filename, '-p', 'wabt.spec_test', '-c', prefix, '-o', kotlin_filename, *data_args)
             if options.compile:
                 kotlin_filenames.append(kotlin_filename)
+                base = os.path.splitext(kotlin_filename)[0]
+                kotlin_filenames.extend('{}_shard{}.kt'.format(base, shard)
+                                        for shard in range(options.shards))
 
         if options.compile:
             main_kt = main_filename
             main_jar = Compile(kotlinc, utils.ChangeExt(main_kt, ".jar"), kotlin_filenames + [main_kt])
 
             if options.run:
-                kotlin.RunWithArgs("-J-ea", "-classpath", main_jar, "wabt.spec_test.SpecTestMain")
+                classpath = main_jar
+                if options.data_file:
+                    classpath = os.pathsep.join([main_jar, resource_dir])
+                run_args = []
+                if options.memory_backend:
+                    run_args.append(options.memory_backend)
+                kotlin.RunWithArgs("-J-ea", "-classpath", classpath, "wabt.spec_test.SpecTestMain", *run_args)
 
     return 0
 
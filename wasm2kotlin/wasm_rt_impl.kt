@@ -30,14 +30,13 @@
 
 package wasm_rt_impl;
 
-import kotlin.reflect.KMutableProperty0
 import kotlin.reflect.KProperty0
 import kotlin.Function
 
 open class ModuleRegistry {
-    private var funcs: HashMap<Pair<String, String>, Any> = HashMap<Pair<String, String>, Any>();
+    private var funcs: HashMap<Pair<String, String>, Function<*>> = HashMap<Pair<String, String>, Function<*>>();
     private var tables: HashMap<Pair<String, String>, Table> = HashMap<Pair<String, String>, Table>();
-    private var globals: HashMap<Pair<String, String>, KMutableProperty0<*>> = HashMap<Pair<String, String>, KMutableProperty0<*>>();
+    private var globals: HashMap<Pair<String, String>, Global> = HashMap<Pair<String, String>, Global>();
     private var constants: HashMap<Pair<String, String>, Any> = HashMap<Pair<String, String>, Any>();
     private var memories: HashMap<Pair<String, String>, Memory> = HashMap<Pair<String, String>, Memory>();
     private var tags: HashMap<Pair<String, String>, Tag<*>> = HashMap<Pair<String, String>, Tag<*>>();
@@ -48,7 +47,7 @@ open class ModuleRegistry {
     open fun exportTable(modname: String, fieldname: String, value: Table) {
         tables.put(Pair(modname, fieldname), value)
     }
-    open fun <T> exportGlobal(modname: String, fieldname: String, value: KMutableProperty0<T>) {
+    open fun exportGlobal(modname: String, fieldname: String, value: Global) {
         globals.put(Pair(modname, fieldname), value)
     }
     open fun <T> exportConstant(modname: String, fieldname: String, value: T) {
@@ -66,12 +65,24 @@ open class ModuleRegistry {
     open fun <T: Function<U>, U> importFunc(modname: String, fieldname: String): T {
         return funcs.get(Pair(modname, fieldname)) as T
     }
+    /**
+     * Imports a function as the typed interface `T`, using `adapt` to wrap it
+     * if it doesn't already implement `T`.
+     */
+    @Suppress("UNCHECKED_CAST")
+    open fun <F: Function<*>, T: Function<*>> importFunc(modname: String, fieldname: String, type: Class<T>, adapt: (F) -> T): T {
+        val func = funcs.get(Pair(modname, fieldname))!!
+        if (type.isInstance(func)) {
+            return type.cast(func)
+        }
+        return adapt(func as F)
+    }
     open fun importTable(modname: String, fieldname: String): Table {
         return tables.get(Pair(modname, fieldname))!!
     }
     @Suppress("UNCHECKED_CAST")
-    open fun <T> importGlobal(modname: String, fieldname: String): KMutableProperty0<T> {
-        return globals.get(Pair(modname, fieldname)) as KMutableProperty0<T>
+    open fun <T: Global> importGlobal(modname: String, fieldname: String): T {
+        return globals.get(Pair(modname, fieldname))!! as T
     }
     @Suppress("UNCHECKED_CAST")
     open fun <T> importConstant(modname: String, fieldname: String): T {
@@ -85,23 +96,255 @@ open class ModuleRegistry {
     open fun <T: Function<Unit>> importTag(modname: String, fieldname: String): Tag<T> {
         return tags.get(Pair(modname, fieldname)) as Tag<T>
     }
+
+    /**
+     * Picks the backend for memory `index` of module `modname`, when the
+     * module defines it. Override to keep memories off-heap or in a file.
+     */
+    open fun memoryBackend(modname: String, index: Int): MemoryBackend {
+        return HeapMemoryBackend
+    }
+
+    /**
+     * The fuel burnt by modules built with `--fuel`. Every module sharing the
+     * registry draws from it; it starts out unlimited.
+     */
+    open val fuel: Fuel = Fuel()
+}
+
+/**
+ * A budget of work for modules built with `--fuel`. Each function call and
+ * loop iteration burns a unit. Every thread running the modules takes the
+ * fuel a slice at a time into its own [Slice], which generated code looks up
+ * once per call and counts down, calling refill() once it goes negative.
+ * That takes the next slice from the budget, or throws OutOfFuelException.
+ * interrupt() may be called from any thread and is noticed by each thread's
+ * next refill, at most FUEL_SLICE units later.
+ */
+class Fuel(budget: Long = Long.MAX_VALUE) {
+    // may go below zero once threads have asked for more than was left.
+    private val remaining = java.util.concurrent.atomic.AtomicLong(budget)
+    @Volatile private var interrupted: Boolean = false
+    private val slices = ThreadLocal.withInitial { Slice(this) }
+
+    class Slice(private val fuel: Fuel) {
+        @JvmField var left: Int = 0
+
+        fun refill() {
+            fuel.refill(this)
+        }
+    }
+
+    /** The calling thread's slice. */
+    fun slice(): Slice = slices.get()
+
+    /**
+     * The fuel not burnt yet, leaving out what other threads hold in their
+     * slices.
+     */
+    val left: Long
+        get() = maxOf(remaining.get(), 0L) + maxOf(slice().left, 0)
+
+    /**
+     * Sets the budget to `budget` units and clears any interrupt. Threads
+     * still burn what is left of their current slice.
+     */
+    fun reset(budget: Long = Long.MAX_VALUE) {
+        slice().left = 0
+        remaining.set(budget)
+        interrupted = false
+    }
+
+    /** Makes running code throw OutOfFuelException, until reset. */
+    fun interrupt() {
+        interrupted = true
+    }
+
+    private fun refill(slice: Slice) {
+        if (interrupted) {
+            throw OutOfFuelException("interrupted", true)
+        }
+        val before = remaining.getAndAdd(-FUEL_SLICE.toLong())
+        if (before <= 0) {
+            throw OutOfFuelException("out of fuel", false)
+        }
+        // the unit that ran out of the last slice comes out of this one
+        slice.left = minOf(before, FUEL_SLICE.toLong()).toInt() - 1
+    }
+}
+
+const val FUEL_SLICE: Int = 10000;
+
+/**
+ * A mutable global shared between modules. Modules read and write the value
+ * field directly.
+ */
+sealed class Global {
+}
+class GlobalI32(@JvmField var value: Int): Global() {
+}
+class GlobalI64(@JvmField var value: Long): Global() {
+}
+class GlobalF32(@JvmField var value: Float): Global() {
+}
+class GlobalF64(@JvmField var value: Double): Global() {
+}
+class GlobalV128(@JvmField var value: V128): Global() {
+}
+class GlobalRef(@JvmField var value: Any?): Global() {
 }
 
 const val PAGE_SIZE: Int = 65536;
 
-class Memory(initial_pages: Int, max_pages: Int) {
+// a ByteBuffer can't hold a full 65536 pages
+const val MAX_BUFFER_PAGES: Int = Int.MAX_VALUE / PAGE_SIZE;
+
+/**
+ * Where a Memory keeps its bytes. Buffers must start out zeroed.
+ */
+interface MemoryBackend {
+    fun allocate(size: Int): java.nio.ByteBuffer
+
+    /**
+     * Returns a buffer of the given size holding the contents of `old`, from
+     * position 0 to its limit. Past that it must be zero.
+     */
+    fun grow(old: java.nio.ByteBuffer, size: Int): java.nio.ByteBuffer {
+        val mem = allocate(size)
+        mem.duplicate().put(old.duplicate())
+        return mem
+    }
+
+    /**
+     * Returns a buffer of the given size for a shared memory. Those never
+     * move once threads use them, so they get their maximum size up front.
+     * The buffer must not be a heap buffer, since the atomic instructions
+     * can't use those on newer JDKs. By default it is allocated off-heap,
+     * which commits all of it right away; see [TempFileMemoryBackend] for
+     * one that only takes up memory for the pages that are touched.
+     */
+    fun reserve(size: Int): java.nio.ByteBuffer {
+        return java.nio.ByteBuffer.allocateDirect(size)
+    }
+}
+
+/**
+ * Keeps memory in a heap array. This is the default.
+ */
+object HeapMemoryBackend : MemoryBackend {
+    override fun allocate(size: Int): java.nio.ByteBuffer {
+        return java.nio.ByteBuffer.allocate(size)
+    }
+}
+
+/**
+ * Keeps memory off-heap, so large memories don't weigh on the GC.
+ */
+object DirectMemoryBackend : MemoryBackend {
+    override fun allocate(size: Int): java.nio.ByteBuffer {
+        return java.nio.ByteBuffer.allocateDirect(size)
+    }
+}
+
+/**
+ * Maps memory from a temporary file that is deleted right away, so a buffer
+ * takes address space but no memory until its pages are written to. This
+ * suits shared memories with a large maximum. Written pages may be flushed to
+ * the file system, so keep the temporary directory in memory (e.g. tmpfs) to
+ * avoid disk traffic.
+ */
+object TempFileMemoryBackend : MemoryBackend {
+    override fun allocate(size: Int): java.nio.ByteBuffer {
+        val path = java.nio.file.Files.createTempFile("wasm-memory", null)
+        java.nio.channels.FileChannel.open(path,
+            java.nio.file.StandardOpenOption.READ,
+            java.nio.file.StandardOpenOption.WRITE,
+            java.nio.file.StandardOpenOption.DELETE_ON_CLOSE).use { channel ->
+            // the mapping outlives the channel, and mapping past the end of
+            // the file extends it with zeroes without writing them.
+            return channel.map(java.nio.channels.FileChannel.MapMode.READ_WRITE, 0, size.toLong())
+        }
+    }
+
+    override fun reserve(size: Int): java.nio.ByteBuffer {
+        return allocate(size)
+    }
+}
+
+/**
+ * Maps memory from a file, which is truncated first. Growing maps a larger
+ * region of the same file, so nothing gets copied, and the file holds a
+ * snapshot of the memory at any time (use `force` to flush it). Use one per
+ * memory.
+ */
+class MappedMemoryBackend(path: java.nio.file.Path) : MemoryBackend {
+    private val channel = java.nio.channels.FileChannel.open(path,
+        java.nio.file.StandardOpenOption.CREATE,
+        java.nio.file.StandardOpenOption.READ,
+        java.nio.file.StandardOpenOption.WRITE,
+        java.nio.file.StandardOpenOption.TRUNCATE_EXISTING)
+    private var mapped: java.nio.MappedByteBuffer? = null
+
+    override fun allocate(size: Int): java.nio.ByteBuffer {
+        // mapping past the end of the file extends it with zeroes
+        val mem = channel.map(java.nio.channels.FileChannel.MapMode.READ_WRITE, 0, size.toLong())
+        mapped = mem
+        return mem
+    }
+
+    override fun grow(old: java.nio.ByteBuffer, size: Int): java.nio.ByteBuffer {
+        return allocate(size)
+    }
+
+    override fun reserve(size: Int): java.nio.ByteBuffer {
+        return allocate(size)
+    }
+
+    fun force() {
+        mapped?.force()
+    }
+}
+
+// how much fill and copy_from move at a time in off-heap memories.
+private const val BULK_CHUNK_SIZE: Int = 64 * 1024
+
+// views of a memory buffer for the atomic instructions.
+private val INT_HANDLE = java.lang.invoke.MethodHandles.byteBufferViewVarHandle(IntArray::class.java, java.nio.ByteOrder.LITTLE_ENDIAN)
+private val LONG_HANDLE = java.lang.invoke.MethodHandles.byteBufferViewVarHandle(LongArray::class.java, java.nio.ByteOrder.LITTLE_ENDIAN)
+
+/**
+ * A wasm memory. A shared memory can be used from several threads: its
+ * buffer is reserved for `max_pages` up front (see [MemoryBackend.reserve])
+ * and never replaced, so growing it only moves the limit. Other threads see
+ * the new size once they synchronize with the growing thread, e.g. through an
+ * atomic access.
+ */
+class Memory(initial_pages: Int, max_pages: Int, backend: MemoryBackend = HeapMemoryBackend, shared: Boolean = false) {
     private val max_pages = max_pages
+    private val backend = backend
+    val shared = shared
 
+    // the buffer's limit is the memory size, its capacity may be larger to
+    // leave room for growth.
     private var mem: java.nio.ByteBuffer
 
     init {
-        mem = java.nio.ByteBuffer.allocate(initial_pages * PAGE_SIZE);
+        mem = if (shared) {
+            val reserved = backend.reserve(minOf(max_pages, MAX_BUFFER_PAGES) * PAGE_SIZE)
+            if (!reserved.isDirect) {
+                throw IllegalArgumentException("shared memory needs a direct or mapped buffer")
+            }
+            reserved
+        } else {
+            backend.allocate(initial_pages * PAGE_SIZE)
+        }
         mem.order(java.nio.ByteOrder.LITTLE_ENDIAN);
+        mem.limit(initial_pages * PAGE_SIZE)
     }
 
-    // TODO(Soni): store pages somewhere for performance?
-    val pages: Int
-        get() = mem.capacity() / PAGE_SIZE;
+    @Volatile
+    var pages: Int = initial_pages
+        private set
 
     @Deprecated("replaced with base64 and ByteArray")
     fun put(offset: Int, bytes_as_ucs2: String, size: Int) {
@@ -141,13 +384,22 @@ class Memory(initial_pages: Int, max_pages: Int) {
         if (offset < 0 || len < 0 || offset > mem.limit() || mem.limit() - offset < len) {
             throw RangeException()
         }
-        val temp = mem.duplicate()
         val b = value.toByte()
-        temp.order(java.nio.ByteOrder.LITTLE_ENDIAN)
+        if (mem.hasArray()) {
+            val start = mem.arrayOffset() + offset
+            java.util.Arrays.fill(mem.array(), start, start + len, b)
+            return
+        }
+        // off-heap: put a filled chunk at a time.
+        val chunk = ByteArray(minOf(len, BULK_CHUNK_SIZE))
+        if (b != 0.toByte()) {
+            java.util.Arrays.fill(chunk, b)
+        }
+        val temp = mem.duplicate()
         temp.position(offset)
         temp.limit(offset+len)
         while (temp.remaining() > 0) {
-            temp.put(b)
+            temp.put(chunk, 0, minOf(temp.remaining(), chunk.size))
         }
     }
 
@@ -155,10 +407,12 @@ class Memory(initial_pages: Int, max_pages: Int) {
         if (srcoff < 0 || dstoff < 0 || len < 0 || dstoff > mem.limit() || mem.limit() - dstoff < len || srcoff > bytes.size || bytes.size - srcoff < len) {
             throw RangeException()
         }
+        if (mem.hasArray()) {
+            System.arraycopy(bytes, srcoff, mem.array(), mem.arrayOffset() + dstoff, len)
+            return
+        }
         val tempdst = mem.duplicate()
-        tempdst.order(java.nio.ByteOrder.LITTLE_ENDIAN)
         tempdst.position(dstoff)
-        tempdst.limit(dstoff+len)
         tempdst.put(bytes, srcoff, len)
     }
 
@@ -166,20 +420,30 @@ class Memory(initial_pages: Int, max_pages: Int) {
         if (srcoff < 0 || dstoff < 0 || len < 0 || dstoff > mem.limit() || mem.limit() - dstoff < len || srcoff > src.mem.limit() || src.mem.limit() - srcoff < len) {
             throw RangeException()
         }
+        if (len == 0) {
+            return
+        }
+        if (mem.hasArray() && src.mem.hasArray()) {
+            // arraycopy copies as if through a temporary array, so overlap
+            // is fine.
+            System.arraycopy(src.mem.array(), src.mem.arrayOffset() + srcoff, mem.array(), mem.arrayOffset() + dstoff, len)
+            return
+        }
+        // ByteBuffer.put doesn't say what happens with overlapping buffers,
+        // so go through a chunk at a time, starting from the end when
+        // copying forward over the source.
+        val chunk = ByteArray(minOf(len, BULK_CHUNK_SIZE))
         val tempdst = mem.duplicate()
         val tempsrc = src.mem.duplicate()
-        tempdst.order(java.nio.ByteOrder.LITTLE_ENDIAN)
-        tempsrc.order(java.nio.ByteOrder.LITTLE_ENDIAN)
-        if (dstoff < srcoff) {
-            tempdst.position(dstoff)
-            tempsrc.position(srcoff)
-            tempdst.limit(dstoff+len)
-            tempsrc.limit(srcoff+len)
-            tempdst.put(tempsrc)
-        } else {
-            for (x in len-1 downTo 0) {
-                tempdst.put(dstoff+x, tempsrc.get(srcoff+x))
-            }
+        var done = 0
+        while (done < len) {
+            val size = minOf(len - done, chunk.size)
+            val x = if (dstoff > srcoff) len - done - size else done
+            tempsrc.position(srcoff+x)
+            tempsrc.get(chunk, 0, size)
+            tempdst.position(dstoff+x)
+            tempdst.put(chunk, 0, size)
+            done += size
         }
     }
 
@@ -255,80 +519,435 @@ class Memory(initial_pages: Int, max_pages: Int) {
     fun i64_load32_s(position: Int): Long = protect { mem.getInt(position)   }.toLong()
     fun i64_load32_u(position: Int): Long = protect { mem.getInt(position)   }.toLong() and 0xFFFFFFFFL
 
-    // NOTE: Not thread-safe.
+    // explicit range checks, used with wasm2kotlin --explicit-bounds-checks.
+    // one unsigned compare per access instead of protect { } + offsetp().
+    @Suppress("NAME_SHADOWING")
+    private fun checkp(pos: Int, offset: Int, size: Int): Int {
+        val pos = (pos.toLong() and 0xFFFFFFFFL) + (offset.toLong() and 0xFFFFFFFFL)
+        if (pos > (mem.limit() - size).toLong()) {
+            throw RangeException()
+        }
+        return pos.toInt()
+    }
+
+    private fun checkp(pos: Int, size: Int): Int {
+        if ((pos.toLong() and 0xFFFFFFFFL) > (mem.limit() - size).toLong()) {
+            throw RangeException()
+        }
+        return pos
+    }
+
+    fun i32_store_chk(position: Int, offset: Int, value: Int)    { mem.putInt(checkp(position, offset, 4), value)    }
+    fun i64_store_chk(position: Int, offset: Int, value: Long)   { mem.putLong(checkp(position, offset, 8), value)   }
+    fun f32_store_chk(position: Int, offset: Int, value: Float)  { mem.putFloat(checkp(position, offset, 4), value)  }
+    fun f64_store_chk(position: Int, offset: Int, value: Double) { mem.putDouble(checkp(position, offset, 8), value) }
+
+    fun i32_store8_chk(position: Int, offset: Int, value: Int)   { mem.put(checkp(position, offset, 1), value.toByte())       }
+    fun i64_store8_chk(position: Int, offset: Int, value: Long)  { mem.put(checkp(position, offset, 1), value.toByte())       }
+    fun i32_store16_chk(position: Int, offset: Int, value: Int)  { mem.putShort(checkp(position, offset, 2), value.toShort()) }
+    fun i64_store16_chk(position: Int, offset: Int, value: Long) { mem.putShort(checkp(position, offset, 2), value.toShort()) }
+    fun i64_store32_chk(position: Int, offset: Int, value: Long) { mem.putInt(checkp(position, offset, 4), value.toInt())     }
+
+    fun i32_load_chk(position: Int, offset: Int): Int    = mem.getInt(checkp(position, offset, 4))
+    fun i64_load_chk(position: Int, offset: Int): Long   = mem.getLong(checkp(position, offset, 8))
+    fun f32_load_chk(position: Int, offset: Int): Float  = mem.getFloat(checkp(position, offset, 4))
+    fun f64_load_chk(position: Int, offset: Int): Double = mem.getDouble(checkp(position, offset, 8))
+
+    fun i32_load8_s_chk(position: Int, offset: Int): Int   = mem.get(checkp(position, offset, 1)).toInt()
+    fun i64_load8_s_chk(position: Int, offset: Int): Long  = mem.get(checkp(position, offset, 1)).toLong()
+    fun i32_load8_u_chk(position: Int, offset: Int): Int   = mem.get(checkp(position, offset, 1)).toInt() and 0xFF
+    fun i64_load8_u_chk(position: Int, offset: Int): Long  = mem.get(checkp(position, offset, 1)).toLong() and 0xFFL
+    fun i32_load16_s_chk(position: Int, offset: Int): Int  = mem.getShort(checkp(position, offset, 2)).toInt()
+    fun i64_load16_s_chk(position: Int, offset: Int): Long = mem.getShort(checkp(position, offset, 2)).toLong()
+    fun i32_load16_u_chk(position: Int, offset: Int): Int  = mem.getShort(checkp(position, offset, 2)).toInt() and 0xFFFF
+    fun i64_load16_u_chk(position: Int, offset: Int): Long = mem.getShort(checkp(position, offset, 2)).toLong() and 0xFFFFL
+    fun i64_load32_s_chk(position: Int, offset: Int): Long = mem.getInt(checkp(position, offset, 4)).toLong()
+    fun i64_load32_u_chk(position: Int, offset: Int): Long = mem.getInt(checkp(position, offset, 4)).toLong() and 0xFFFFFFFFL
+
+    fun i32_store_chk(position: Int, value: Int)    { mem.putInt(checkp(position, 4), value)    }
+    fun i64_store_chk(position: Int, value: Long)   { mem.putLong(checkp(position, 8), value)   }
+    fun f32_store_chk(position: Int, value: Float)  { mem.putFloat(checkp(position, 4), value)  }
+    fun f64_store_chk(position: Int, value: Double) { mem.putDouble(checkp(position, 8), value) }
+
+    fun i32_store8_chk(position: Int, value: Int)   { mem.put(checkp(position, 1), value.toByte())       }
+    fun i64_store8_chk(position: Int, value: Long)  { mem.put(checkp(position, 1), value.toByte())       }
+    fun i32_store16_chk(position: Int, value: Int)  { mem.putShort(checkp(position, 2), value.toShort()) }
+    fun i64_store16_chk(position: Int, value: Long) { mem.putShort(checkp(position, 2), value.toShort()) }
+    fun i64_store32_chk(position: Int, value: Long) { mem.putInt(checkp(position, 4), value.toInt())     }
+
+    fun i32_load_chk(position: Int): Int    = mem.getInt(checkp(position, 4))
+    fun i64_load_chk(position: Int): Long   = mem.getLong(checkp(position, 8))
+    fun f32_load_chk(position: Int): Float  = mem.getFloat(checkp(position, 4))
+    fun f64_load_chk(position: Int): Double = mem.getDouble(checkp(position, 8))
+
+    fun i32_load8_s_chk(position: Int): Int   = mem.get(checkp(position, 1)).toInt()
+    fun i64_load8_s_chk(position: Int): Long  = mem.get(checkp(position, 1)).toLong()
+    fun i32_load8_u_chk(position: Int): Int   = mem.get(checkp(position, 1)).toInt() and 0xFF
+    fun i64_load8_u_chk(position: Int): Long  = mem.get(checkp(position, 1)).toLong() and 0xFFL
+    fun i32_load16_s_chk(position: Int): Int  = mem.getShort(checkp(position, 2)).toInt()
+    fun i64_load16_s_chk(position: Int): Long = mem.getShort(checkp(position, 2)).toLong()
+    fun i32_load16_u_chk(position: Int): Int  = mem.getShort(checkp(position, 2)).toInt() and 0xFFFF
+    fun i64_load16_u_chk(position: Int): Long = mem.getShort(checkp(position, 2)).toLong() and 0xFFFFL
+    fun i64_load32_s_chk(position: Int): Long = mem.getInt(checkp(position, 4)).toLong()
+    fun i64_load32_u_chk(position: Int): Long = mem.getInt(checkp(position, 4)).toLong() and 0xFFFFFFFFL
+
+    // no range check at all, used by wasm2kotlin where an earlier access
+    // already proved the range to be in bounds.
+    fun i32_store_nochk(position: Int, value: Int)    { mem.putInt(position, value)    }
+    fun i64_store_nochk(position: Int, value: Long)   { mem.putLong(position, value)   }
+    fun f32_store_nochk(position: Int, value: Float)  { mem.putFloat(position, value)  }
+    fun f64_store_nochk(position: Int, value: Double) { mem.putDouble(position, value) }
+
+    fun i32_store8_nochk(position: Int, value: Int)   { mem.put(position, value.toByte())       }
+    fun i64_store8_nochk(position: Int, value: Long)  { mem.put(position, value.toByte())       }
+    fun i32_store16_nochk(position: Int, value: Int)  { mem.putShort(position, value.toShort()) }
+    fun i64_store16_nochk(position: Int, value: Long) { mem.putShort(position, value.toShort()) }
+    fun i64_store32_nochk(position: Int, value: Long) { mem.putInt(position, value.toInt())     }
+
+    fun i32_load_nochk(position: Int): Int    = mem.getInt(position)
+    fun i64_load_nochk(position: Int): Long   = mem.getLong(position)
+    fun f32_load_nochk(position: Int): Float  = mem.getFloat(position)
+    fun f64_load_nochk(position: Int): Double = mem.getDouble(position)
+
+    fun i32_load8_s_nochk(position: Int): Int   = mem.get(position).toInt()
+    fun i64_load8_s_nochk(position: Int): Long  = mem.get(position).toLong()
+    fun i32_load8_u_nochk(position: Int): Int   = mem.get(position).toInt() and 0xFF
+    fun i64_load8_u_nochk(position: Int): Long  = mem.get(position).toLong() and 0xFFL
+    fun i32_load16_s_nochk(position: Int): Int  = mem.getShort(position).toInt()
+    fun i64_load16_s_nochk(position: Int): Long = mem.getShort(position).toLong()
+    fun i32_load16_u_nochk(position: Int): Int  = mem.getShort(position).toInt() and 0xFFFF
+    fun i64_load16_u_nochk(position: Int): Long = mem.getShort(position).toLong() and 0xFFFFL
+    fun i64_load32_s_nochk(position: Int): Long = mem.getInt(position).toLong()
+    fun i64_load32_u_nochk(position: Int): Long = mem.getInt(position).toLong() and 0xFFFFFFFFL
+
+    // v128 accesses always check the whole range first, so a store that is
+    // partly out of bounds writes nothing.
+    fun v128_load(position: Int, offset: Int): V128 {
+        val p = checkp(position, offset, 16)
+        return V128(mem.getLong(p), mem.getLong(p + 8))
+    }
+    fun v128_store(position: Int, offset: Int, value: V128) {
+        val p = checkp(position, offset, 16)
+        mem.putLong(p, value.lo)
+        mem.putLong(p + 8, value.hi)
+    }
+
+    fun v128_load8x8_s(position: Int, offset: Int): V128  = i16x8_extend_low_i8x16_s(V128(mem.getLong(checkp(position, offset, 8)), 0L))
+    fun v128_load8x8_u(position: Int, offset: Int): V128  = i16x8_extend_low_i8x16_u(V128(mem.getLong(checkp(position, offset, 8)), 0L))
+    fun v128_load16x4_s(position: Int, offset: Int): V128 = i32x4_extend_low_i16x8_s(V128(mem.getLong(checkp(position, offset, 8)), 0L))
+    fun v128_load16x4_u(position: Int, offset: Int): V128 = i32x4_extend_low_i16x8_u(V128(mem.getLong(checkp(position, offset, 8)), 0L))
+    fun v128_load32x2_s(position: Int, offset: Int): V128 = i64x2_extend_low_i32x4_s(V128(mem.getLong(checkp(position, offset, 8)), 0L))
+    fun v128_load32x2_u(position: Int, offset: Int): V128 = i64x2_extend_low_i32x4_u(V128(mem.getLong(checkp(position, offset, 8)), 0L))
+
+    fun v128_load8_splat(position: Int, offset: Int): V128  = i8x16_splat(mem.get(checkp(position, offset, 1)).toInt())
+    fun v128_load16_splat(position: Int, offset: Int): V128 = i16x8_splat(mem.getShort(checkp(position, offset, 2)).toInt())
+    fun v128_load32_splat(position: Int, offset: Int): V128 = i32x4_splat(mem.getInt(checkp(position, offset, 4)))
+    fun v128_load64_splat(position: Int, offset: Int): V128 = i64x2_splat(mem.getLong(checkp(position, offset, 8)))
+
+    fun v128_load32_zero(position: Int, offset: Int): V128 = V128(mem.getInt(checkp(position, offset, 4)).toLong() and 0xFFFFFFFFL, 0L)
+    fun v128_load64_zero(position: Int, offset: Int): V128 = V128(mem.getLong(checkp(position, offset, 8)), 0L)
+
+    fun v128_load8_lane(position: Int, offset: Int, v: V128, lane: Int): V128  = i8x16_replace_lane(v, mem.get(checkp(position, offset, 1)).toInt(), lane)
+    fun v128_load16_lane(position: Int, offset: Int, v: V128, lane: Int): V128 = i16x8_replace_lane(v, mem.getShort(checkp(position, offset, 2)).toInt(), lane)
+    fun v128_load32_lane(position: Int, offset: Int, v: V128, lane: Int): V128 = i32x4_replace_lane(v, mem.getInt(checkp(position, offset, 4)), lane)
+    fun v128_load64_lane(position: Int, offset: Int, v: V128, lane: Int): V128 = i64x2_replace_lane(v, mem.getLong(checkp(position, offset, 8)), lane)
+
+    fun v128_store8_lane(position: Int, offset: Int, v: V128, lane: Int)  { mem.put(checkp(position, offset, 1), i8x16_extract_lane_u(v, lane).toByte())       }
+    fun v128_store16_lane(position: Int, offset: Int, v: V128, lane: Int) { mem.putShort(checkp(position, offset, 2), i16x8_extract_lane_u(v, lane).toShort()) }
+    fun v128_store32_lane(position: Int, offset: Int, v: V128, lane: Int) { mem.putInt(checkp(position, offset, 4), i32x4_extract_lane(v, lane))              }
+    fun v128_store64_lane(position: Int, offset: Int, v: V128, lane: Int) { mem.putLong(checkp(position, offset, 8), i64x2_extract_lane(v, lane))             }
+
+    // atomics. narrow accesses go through the aligned int around them, as
+    // there's no VarHandle view for bytes and shorts.
+    private fun checka(pos: Int, offset: Int, size: Int): Int {
+        val p = checkp(pos, offset, size)
+        if ((p and (size - 1)) != 0) {
+            throw UnalignedAtomicException()
+        }
+        return p
+    }
+
+    private fun load32(p: Int): Int = INT_HANDLE.getVolatile(mem, p) as Int
+    private fun load64(p: Int): Long = LONG_HANDLE.getVolatile(mem, p) as Long
+
+    private fun loadNarrow(p: Int, size: Int): Int =
+        (load32(p and 3.inv()) ushr ((p and 3) shl 3)) and ((1 shl (size shl 3)) - 1)
+
+    // atomically replaces the `size` bytes at p with f of them, returning
+    // the old ones.
+    private inline fun rmw32(p: Int, size: Int, f: (Int) -> Int): Int {
+        val word = p and 3.inv()
+        val shift = (p and 3) shl 3
+        val mask = if (size == 4) -1 else (1 shl (size shl 3)) - 1
+        while (true) {
+            val old = load32(word)
+            val value = (old ushr shift) and mask
+            val new = (old and (mask shl shift).inv()) or ((f(value) and mask) shl shift)
+            if (INT_HANDLE.compareAndSet(mem, word, old, new)) {
+                return value
+            }
+        }
+    }
+
+    fun i32_atomic_load(position: Int, offset: Int): Int      = load32(checka(position, offset, 4))
+    fun i64_atomic_load(position: Int, offset: Int): Long     = load64(checka(position, offset, 8))
+    fun i32_atomic_load8_u(position: Int, offset: Int): Int   = loadNarrow(checka(position, offset, 1), 1)
+    fun i32_atomic_load16_u(position: Int, offset: Int): Int  = loadNarrow(checka(position, offset, 2), 2)
+    fun i64_atomic_load8_u(position: Int, offset: Int): Long  = loadNarrow(checka(position, offset, 1), 1).toLong()
+    fun i64_atomic_load16_u(position: Int, offset: Int): Long = loadNarrow(checka(position, offset, 2), 2).toLong()
+    fun i64_atomic_load32_u(position: Int, offset: Int): Long = load32(checka(position, offset, 4)).toLong() and 0xFFFFFFFFL
+
+    fun i32_atomic_store(position: Int, offset: Int, value: Int)    { INT_HANDLE.setVolatile(mem, checka(position, offset, 4), value)  }
+    fun i64_atomic_store(position: Int, offset: Int, value: Long)   { LONG_HANDLE.setVolatile(mem, checka(position, offset, 8), value) }
+    fun i32_atomic_store8(position: Int, offset: Int, value: Int)   { rmw32(checka(position, offset, 1), 1) { value }                  }
+    fun i32_atomic_store16(position: Int, offset: Int, value: Int)  { rmw32(checka(position, offset, 2), 2) { value }                  }
+    fun i64_atomic_store8(position: Int, offset: Int, value: Long)  { rmw32(checka(position, offset, 1), 1) { value.toInt() }          }
+    fun i64_atomic_store16(position: Int, offset: Int, value: Long) { rmw32(checka(position, offset, 2), 2) { value.toInt() }          }
+    fun i64_atomic_store32(position: Int, offset: Int, value: Long) { INT_HANDLE.setVolatile(mem, checka(position, offset, 4), value.toInt()) }
+
+    fun i32_atomic_rmw_add(position: Int, offset: Int, value: Int): Int  = INT_HANDLE.getAndAdd(mem, checka(position, offset, 4), value) as Int
+    fun i32_atomic_rmw_sub(position: Int, offset: Int, value: Int): Int  = INT_HANDLE.getAndAdd(mem, checka(position, offset, 4), -value) as Int
+    fun i32_atomic_rmw_and(position: Int, offset: Int, value: Int): Int  = INT_HANDLE.getAndBitwiseAnd(mem, checka(position, offset, 4), value) as Int
+    fun i32_atomic_rmw_or(position: Int, offset: Int, value: Int): Int   = INT_HANDLE.getAndBitwiseOr(mem, checka(position, offset, 4), value) as Int
+    fun i32_atomic_rmw_xor(position: Int, offset: Int, value: Int): Int  = INT_HANDLE.getAndBitwiseXor(mem, checka(position, offset, 4), value) as Int
+    fun i32_atomic_rmw_xchg(position: Int, offset: Int, value: Int): Int = INT_HANDLE.getAndSet(mem, checka(position, offset, 4), value) as Int
+    fun i32_atomic_rmw_cmpxchg(position: Int, offset: Int, expected: Int, value: Int): Int =
+        INT_HANDLE.compareAndExchange(mem, checka(position, offset, 4), expected, value) as Int
+
+    fun i64_atomic_rmw_add(position: Int, offset: Int, value: Long): Long  = LONG_HANDLE.getAndAdd(mem, checka(position, offset, 8), value) as Long
+    fun i64_atomic_rmw_sub(position: Int, offset: Int, value: Long): Long  = LONG_HANDLE.getAndAdd(mem, checka(position, offset, 8), -value) as Long
+    fun i64_atomic_rmw_and(position: Int, offset: Int, value: Long): Long  = LONG_HANDLE.getAndBitwiseAnd(mem, checka(position, offset, 8), value) as Long
+    fun i64_atomic_rmw_or(position: Int, offset: Int, value: Long): Long   = LONG_HANDLE.getAndBitwiseOr(mem, checka(position, offset, 8), value) as Long
+    fun i64_atomic_rmw_xor(position: Int, offset: Int, value: Long): Long  = LONG_HANDLE.getAndBitwiseXor(mem, checka(position, offset, 8), value) as Long
+    fun i64_atomic_rmw_xchg(position: Int, offset: Int, value: Long): Long = LONG_HANDLE.getAndSet(mem, checka(position, offset, 8), value) as Long
+    fun i64_atomic_rmw_cmpxchg(position: Int, offset: Int, expected: Long, value: Long): Long =
+        LONG_HANDLE.compareAndExchange(mem, checka(position, offset, 8), expected, value) as Long
+
+    fun i32_atomic_rmw8_add_u(position: Int, offset: Int, value: Int): Int   = rmw32(checka(position, offset, 1), 1) { it + value }
+    fun i32_atomic_rmw8_sub_u(position: Int, offset: Int, value: Int): Int   = rmw32(checka(position, offset, 1), 1) { it - value }
+    fun i32_atomic_rmw8_and_u(position: Int, offset: Int, value: Int): Int   = rmw32(checka(position, offset, 1), 1) { it and value }
+    fun i32_atomic_rmw8_or_u(position: Int, offset: Int, value: Int): Int    = rmw32(checka(position, offset, 1), 1) { it or value }
+    fun i32_atomic_rmw8_xor_u(position: Int, offset: Int, value: Int): Int   = rmw32(checka(position, offset, 1), 1) { it xor value }
+    fun i32_atomic_rmw8_xchg_u(position: Int, offset: Int, value: Int): Int  = rmw32(checka(position, offset, 1), 1) { value }
+    fun i32_atomic_rmw8_cmpxchg_u(position: Int, offset: Int, expected: Int, value: Int): Int =
+        rmw32(checka(position, offset, 1), 1) { if (it == expected and 0xFF) value else it }
+
+    fun i32_atomic_rmw16_add_u(position: Int, offset: Int, value: Int): Int  = rmw32(checka(position, offset, 2), 2) { it + value }
+    fun i32_atomic_rmw16_sub_u(position: Int, offset: Int, value: Int): Int  = rmw32(checka(position, offset, 2), 2) { it - value }
+    fun i32_atomic_rmw16_and_u(position: Int, offset: Int, value: Int): Int  = rmw32(checka(position, offset, 2), 2) { it and value }
+    fun i32_atomic_rmw16_or_u(position: Int, offset: Int, value: Int): Int   = rmw32(checka(position, offset, 2), 2) { it or value }
+    fun i32_atomic_rmw16_xor_u(position: Int, offset: Int, value: Int): Int  = rmw32(checka(position, offset, 2), 2) { it xor value }
+    fun i32_atomic_rmw16_xchg_u(position: Int, offset: Int, value: Int): Int = rmw32(checka(position, offset, 2), 2) { value }
+    fun i32_atomic_rmw16_cmpxchg_u(position: Int, offset: Int, expected: Int, value: Int): Int =
+        rmw32(checka(position, offset, 2), 2) { if (it == expected and 0xFFFF) value else it }
+
+    fun i64_atomic_rmw8_add_u(position: Int, offset: Int, value: Long): Long   = i32_atomic_rmw8_add_u(position, offset, value.toInt()).toLong()
+    fun i64_atomic_rmw8_sub_u(position: Int, offset: Int, value: Long): Long   = i32_atomic_rmw8_sub_u(position, offset, value.toInt()).toLong()
+    fun i64_atomic_rmw8_and_u(position: Int, offset: Int, value: Long): Long   = i32_atomic_rmw8_and_u(position, offset, value.toInt()).toLong()
+    fun i64_atomic_rmw8_or_u(position: Int, offset: Int, value: Long): Long    = i32_atomic_rmw8_or_u(position, offset, value.toInt()).toLong()
+    fun i64_atomic_rmw8_xor_u(position: Int, offset: Int, value: Long): Long   = i32_atomic_rmw8_xor_u(position, offset, value.toInt()).toLong()
+    fun i64_atomic_rmw8_xchg_u(position: Int, offset: Int, value: Long): Long  = i32_atomic_rmw8_xchg_u(position, offset, value.toInt()).toLong()
+    fun i64_atomic_rmw8_cmpxchg_u(position: Int, offset: Int, expected: Long, value: Long): Long =
+        rmw32(checka(position, offset, 1), 1) { if (it.toLong() == expected and 0xFFL) value.toInt() else it }.toLong()
+
+    fun i64_atomic_rmw16_add_u(position: Int, offset: Int, value: Long): Long  = i32_atomic_rmw16_add_u(position, offset, value.toInt()).toLong()
+    fun i64_atomic_rmw16_sub_u(position: Int, offset: Int, value: Long): Long  = i32_atomic_rmw16_sub_u(position, offset, value.toInt()).toLong()
+    fun i64_atomic_rmw16_and_u(position: Int, offset: Int, value: Long): Long  = i32_atomic_rmw16_and_u(position, offset, value.toInt()).toLong()
+    fun i64_atomic_rmw16_or_u(position: Int, offset: Int, value: Long): Long   = i32_atomic_rmw16_or_u(position, offset, value.toInt()).toLong()
+    fun i64_atomic_rmw16_xor_u(position: Int, offset: Int, value: Long): Long  = i32_atomic_rmw16_xor_u(position, offset, value.toInt()).toLong()
+    fun i64_atomic_rmw16_xchg_u(position: Int, offset: Int, value: Long): Long = i32_atomic_rmw16_xchg_u(position, offset, value.toInt()).toLong()
+    fun i64_atomic_rmw16_cmpxchg_u(position: Int, offset: Int, expected: Long, value: Long): Long =
+        rmw32(checka(position, offset, 2), 2) { if (it.toLong() == expected and 0xFFFFL) value.toInt() else it }.toLong()
+
+    fun i64_atomic_rmw32_add_u(position: Int, offset: Int, value: Long): Long  = i32_atomic_rmw_add(position, offset, value.toInt()).toLong() and 0xFFFFFFFFL
+    fun i64_atomic_rmw32_sub_u(position: Int, offset: Int, value: Long): Long  = i32_atomic_rmw_sub(position, offset, value.toInt()).toLong() and 0xFFFFFFFFL
+    fun i64_atomic_rmw32_and_u(position: Int, offset: Int, value: Long): Long  = i32_atomic_rmw_and(position, offset, value.toInt()).toLong() and 0xFFFFFFFFL
+    fun i64_atomic_rmw32_or_u(position: Int, offset: Int, value: Long): Long   = i32_atomic_rmw_or(position, offset, value.toInt()).toLong() and 0xFFFFFFFFL
+    fun i64_atomic_rmw32_xor_u(position: Int, offset: Int, value: Long): Long  = i32_atomic_rmw_xor(position, offset, value.toInt()).toLong() and 0xFFFFFFFFL
+    fun i64_atomic_rmw32_xchg_u(position: Int, offset: Int, value: Long): Long = i32_atomic_rmw_xchg(position, offset, value.toInt()).toLong() and 0xFFFFFFFFL
+    fun i64_atomic_rmw32_cmpxchg_u(position: Int, offset: Int, expected: Long, value: Long): Long =
+        i32_atomic_rmw_cmpxchg(position, offset, expected.toInt(), value.toInt()).toLong() and 0xFFFFFFFFL
+
+    // threads blocked in memory.atomic.wait, by address. guarded by itself.
+    private class Waiter(@JvmField val thread: Thread) {
+        @Volatile @JvmField var notified = false
+    }
+    private val waiters = HashMap<Int, java.util.ArrayDeque<Waiter>>()
+
+    // returns 0 when notified, 1 when the value didn't match, 2 on timeout.
+    private fun wait(p: Int, timeout: Long, matches: () -> Boolean): Int {
+        if (!shared) {
+            throw WasmTrapException("expected shared memory")
+        }
+        val waiter = Waiter(Thread.currentThread())
+        synchronized(waiters) {
+            if (!matches()) {
+                return 1
+            }
+            waiters.getOrPut(p) { java.util.ArrayDeque() }.add(waiter)
+        }
+        val deadline = System.nanoTime() + timeout
+        while (!waiter.notified) {
+            if (timeout < 0) {
+                java.util.concurrent.locks.LockSupport.park(this)
+            } else {
+                val remaining = deadline - System.nanoTime()
+                if (remaining <= 0) {
+                    break
+                }
+                java.util.concurrent.locks.LockSupport.parkNanos(this, remaining)
+            }
+        }
+        synchronized(waiters) {
+            if (waiter.notified) {
+                return 0
+            }
+            val queue = waiters.getValue(p)
+            queue.remove(waiter)
+            if (queue.isEmpty()) {
+                waiters.remove(p)
+            }
+            return 2
+        }
+    }
+
+    fun memory_atomic_wait32(position: Int, offset: Int, expected: Int, timeout: Long): Int {
+        val p = checka(position, offset, 4)
+        return wait(p, timeout) { load32(p) == expected }
+    }
+    fun memory_atomic_wait64(position: Int, offset: Int, expected: Long, timeout: Long): Int {
+        val p = checka(position, offset, 8)
+        return wait(p, timeout) { load64(p) == expected }
+    }
+
+    // count is unsigned.
+    fun memory_atomic_notify(position: Int, offset: Int, count: Int): Int {
+        val p = checka(position, offset, 4)
+        if (!shared) {
+            return 0
+        }
+        synchronized(waiters) {
+            val queue = waiters.get(p) ?: return 0
+            var woken = 0
+            while (Integer.compareUnsigned(woken, count) < 0 && !queue.isEmpty()) {
+                val waiter = queue.poll()
+                waiter.notified = true
+                java.util.concurrent.locks.LockSupport.unpark(waiter.thread)
+                woken++
+            }
+            if (queue.isEmpty()) {
+                waiters.remove(p)
+            }
+            return woken
+        }
+    }
+
+    // NOTE: growing a shared memory is thread-safe, growing any other isn't.
+    @Synchronized
     fun resize(new_pages: Int): Int {
-        val old_mem = mem;
         val old_pages = pages;
         if (new_pages < 0 || new_pages > 65536) {
             return -1;
         }
-        if (old_pages + new_pages > max_pages) {
+        if (old_pages + new_pages > max_pages || old_pages + new_pages > MAX_BUFFER_PAGES) {
             return -1;
         }
         val total_pages = old_pages + new_pages;
-        mem = java.nio.ByteBuffer.allocate(total_pages * PAGE_SIZE);
-        mem.order(java.nio.ByteOrder.LITTLE_ENDIAN);
-        // NOTE: duplicate resets byte order but it's fine here
-        mem.duplicate().put(old_mem)
+        if (total_pages * PAGE_SIZE > mem.capacity()) {
+            // reserve geometrically so growing a page at a time doesn't copy
+            // the whole memory every time.
+            val reserved_pages = minOf(maxOf(total_pages, old_pages * 2), max_pages, MAX_BUFFER_PAGES)
+            mem = backend.grow(mem, reserved_pages * PAGE_SIZE);
+            mem.order(java.nio.ByteOrder.LITTLE_ENDIAN);
+        }
+        // the area past the old limit is still zero, as nothing writes past
+        // the limit.
+        mem.limit(total_pages * PAGE_SIZE)
+        pages = total_pages
         return old_pages;
     }
 
 }
 
+// the limit browsers put on tables, as there's no Memory-like hard limit.
+const val MAX_TABLE_ELEMS: Int = 10000000;
+
+/**
+ * A wasm table. Elements are `Elem?` in funcref tables and anything in
+ * externref tables. `max_elements` is unsigned, so -1 means no limit.
+ */
 class Table(elements: Int, max_elements: Int) {
     private val max_elems = max_elements;
-    private var elems: ArrayList<Elem?> = ArrayList<Elem?>();
+    private var elems: Array<Any?> = arrayOfNulls<Any?>(elements);
+    // elems has room to grow into past size.
+    var size: Int = elements
+        private set
 
-    init {
-        while (elems.size < elements) {
-            elems.add(null);
+    operator fun get(i: Int): Any? {
+        if (i < 0 || i >= size) {
+            throw RangeException()
         }
+        return elems[i]
     }
-
-    operator fun get(i: Int): Elem {
-        try {
-            return elems.get(i) as Elem
-        } catch (e: IndexOutOfBoundsException) {
-            throw RangeException(null, e)
+    fun getOrNull(i: Int): Elem? {
+        // explicit check, this is on the call_indirect path
+        if (i < 0 || i >= size) {
+            return null
         }
+        return elems[i] as Elem?
     }
-    operator fun set(i: Int, value: Elem) {
-        try {
-            elems.set(i, value)
-        } catch (e: IndexOutOfBoundsException) {
-            throw RangeException(null, e)
+    operator fun set(i: Int, value: Any?) {
+        if (i < 0 || i >= size) {
+            throw RangeException()
         }
+        elems[i] = value
     }
 
-    fun table_init(dstoff: Int, src: Array<ElemSegExpr?>, srcoff: Int, len: Int, functypes: IntArray) {
-        if (srcoff < 0 || dstoff < 0 || len < 0 || dstoff > elems.size || elems.size - dstoff < len || srcoff > src.size || src.size - srcoff < len) {
-            throw RangeException()
+    /**
+     * Grows the table by `delta` elements set to `init`, returning the old
+     * size, or -1 if the table can't grow that much. The arguments are in
+     * wasm order.
+     */
+    fun grow(init: Any?, delta: Int): Int {
+        val old_size = size
+        if (delta < 0 || delta > MAX_TABLE_ELEMS - old_size || Integer.compareUnsigned(old_size + delta, max_elems) > 0) {
+            return -1
         }
-        if (len == 0) {
-            return
+        val new_size = old_size + delta
+        if (new_size > elems.size) {
+            // reserve geometrically, like Memory.resize.
+            val reserved = minOf(old_size * 2, MAX_TABLE_ELEMS)
+            val capacity = if (Integer.compareUnsigned(reserved, max_elems) > 0) max_elems else reserved
+            elems = java.util.Arrays.copyOf(elems, maxOf(new_size, capacity))
         }
-        for (x in 0..<len) {
-            elems.set(dstoff+x, when (val elem = src[srcoff+x]) {
-                null -> null;
-                is Func -> Elem(functypes[elem.type], elem.func);
-                else -> throw RuntimeException("???");
-            })
+        if (init != null) {
+            java.util.Arrays.fill(elems, old_size, new_size, init)
         }
+        size = new_size
+        return old_size
     }
 
-    fun copy_from(src: Table, dstoff: Int, srcoff: Int, len: Int) {
-        if (srcoff < 0 || dstoff < 0 || len < 0 || dstoff > elems.size || elems.size - dstoff < len || srcoff > src.elems.size || src.elems.size - srcoff < len) {
+    fun fill(dstoff: Int, value: Any?, len: Int) {
+        if (dstoff < 0 || len < 0 || dstoff > size || size - dstoff < len) {
             throw RangeException()
         }
-        for (x in if (dstoff < srcoff) { 0..<len } else { len-1 downTo 0 }) {
-            elems.set(dstoff+x, src.elems[srcoff+x])
+        java.util.Arrays.fill(elems, dstoff, dstoff + len, value)
+    }
+
+    fun table_init(dstoff: Int, src: Array<Any?>, srcoff: Int, len: Int) {
+        if (srcoff < 0 || dstoff < 0 || len < 0 || dstoff > size || size - dstoff < len || srcoff > src.size || src.size - srcoff < len) {
+            throw RangeException()
         }
+        System.arraycopy(src, srcoff, elems, dstoff, len)
     }
-}
 
-interface ElemSegExpr {
-}
-data class Func(val type: Int, val func: Function<*>): ElemSegExpr {
+    fun copy_from(src: Table, dstoff: Int, srcoff: Int, len: Int) {
+        if (srcoff < 0 || dstoff < 0 || len < 0 || dstoff > size || size - dstoff < len || srcoff > src.size || src.size - srcoff < len) {
+            throw RangeException()
+        }
+        // arraycopy handles overlap within the same table.
+        System.arraycopy(src.elems, srcoff, elems, dstoff, len)
+    }
 }
 
 data class Elem(val type: Int, val func: Function<*>) {
@@ -358,6 +977,12 @@ open class WasmTrapException(message: String? = null, cause: Throwable? = null)
 open class ExhaustionException(message: String? = null, cause: Throwable? = null) : WasmTrapException(message, cause) {
 }
 
+/**
+ * Thrown when wasm built with `--fuel` runs out of fuel or is interrupted.
+ */
+open class OutOfFuelException(message: String? = null, val interrupted: Boolean = false) : ExhaustionException(message) {
+}
+
 /**
  * Thrown when wasm tries to index outside of a buffer.
  */
@@ -376,6 +1001,12 @@ open class UnreachableException(message: String? = null, cause: Throwable? = nul
 open class CallIndirectException(message: String? = null, cause: Throwable? = null) : WasmTrapException(message, cause) {
 }
 
+/**
+ * Thrown when an atomic access isn't naturally aligned.
+ */
+open class UnalignedAtomicException(message: String? = null, cause: Throwable? = null) : WasmTrapException(message, cause) {
+}
+
 /**
  * Thrown when dividing by zero.
  */
@@ -394,15 +1025,53 @@ open class IntOverflowException(message: String? = null, cause: Throwable? = nul
 open class InvalidConversionException(message: String? = null, cause: Throwable? = null) : WasmTrapException(message, cause) {
 }
 
-private var func_types_by_nresults: HashMap<Pair<Int, List<Any>>, Int> = HashMap<Pair<Int, List<Any>>, Int>()
+private val func_type_ids: java.util.concurrent.ConcurrentHashMap<String, Int> = java.util.concurrent.ConcurrentHashMap<String, Int>()
+private val next_func_type_id: java.util.concurrent.atomic.AtomicInteger = java.util.concurrent.atomic.AtomicInteger()
+
+/**
+ * Returns the id of the function type with the given signature, the same in
+ * every module. The signature is mangled the way wasm2kotlin names its `Fn_`
+ * interfaces: a letter per param (`i`, `j`, `f`, `d`, `o` for v128, `c` for
+ * funcref, `e` for externref), `_`, a letter per result, with `v` standing in
+ * for none.
+ */
+fun func_type_id(signature: String): Int {
+    // Lookups of known types don't lock.
+    return func_type_ids.get(signature) ?: func_type_ids.computeIfAbsent(signature) { next_func_type_id.getAndIncrement() }
+}
+
+private fun func_type_letter(type: Any): Char = when (type) {
+    Int::class -> 'i'
+    Long::class -> 'j'
+    Float::class -> 'f'
+    Double::class -> 'd'
+    V128::class -> 'o'
+    Elem::class -> 'c'
+    Any::class -> 'e'
+    else -> throw IllegalArgumentException("unsupported type " + type)
+}
 
+/**
+ * Returns the id of the function type with the given param and result
+ * classes, for hosts that build their own table entries.
+ */
 fun register_func_type(num_params: Int, num_results: Int, vararg types: Any): Int {
     assert(num_params + num_results == types.size)
-    synchronized (func_types_by_nresults) {
-        val maybe_id: Int = func_types_by_nresults.size
-        val id: Int = func_types_by_nresults.getOrPut(Pair(num_results, types.toList())) { maybe_id }
-        return id
+    val signature = StringBuilder()
+    for (i in 0..<num_params) {
+        signature.append(func_type_letter(types[i]))
     }
+    if (num_params == 0) {
+        signature.append('v')
+    }
+    signature.append('_')
+    for (i in num_params..<types.size) {
+        signature.append(func_type_letter(types[i]))
+    }
+    if (num_results == 0) {
+        signature.append('v')
+    }
+    return func_type_id(signature.toString())
 }
 
 class Tag<T: Function<Unit>>() {
@@ -426,6 +1095,23 @@ class Tag<T: Function<Unit>>() {
 private val B64DEC: java.util.Base64.Decoder = java.util.Base64.getDecoder();
 fun loadb64(s: String): ByteArray = B64DEC.decode(s);
 
+/**
+ * Reads the data segments written by wasm2kotlin --data-file, from the
+ * resource `name` next to `cls`.
+ */
+fun loadData(cls: Class<*>, name: String, size: Int): ByteArray {
+    val stream = cls.getResourceAsStream(name) ?: throw RuntimeException("missing data resource " + name)
+    val data = ByteArray(size)
+    stream.use {
+        java.io.DataInputStream(it).readFully(data)
+    }
+    return data
+}
+
+fun atomic_fence() {
+    java.lang.invoke.VarHandle.fullFence()
+}
+
 // NOTE(Soni): these are inline not for "performance" but for code size.
 // kept running into "Method too large", this should help with *some* of them.
 @Suppress("NOTHING_TO_INLINE")
@@ -449,58 +1135,52 @@ inline fun <T> select(third: T, second: T, first: Int): T = if (first != 0) thir
 
 @Suppress("UNCHECKED_CAST")
 fun <T> CALL_INDIRECT(table: Table, type: Int, func: Int): T {
-    val elem = try {
-        table[func]
-    } catch (e: IndexOutOfBoundsException) {
-        throw CallIndirectException()
-    } catch (e: NullPointerException) {
-        throw CallIndirectException()
-    }
-    if (elem.type == type) {
+    val elem = table.getOrNull(func)
+    if (elem != null && elem.type == type) {
         return elem.func as T
     } else {
         throw CallIndirectException()
     }
 }
 
+// NOTE: these check for zero instead of catching ArithmeticException, a
+// handler in the way keeps the JIT from inlining them as well.
 fun I32_DIV_S(a: Int, b: Int): Int {
+    if (b == 0) { throw DivByZeroException() }
     if (a == Int.MIN_VALUE && b == -1) { throw IntOverflowException() }
-    try { return a/b }
-    catch (e: ArithmeticException) { throw DivByZeroException() }
+    return a/b
 }
 fun I64_DIV_S(a: Long, b: Long): Long {
+    if (b == 0L) { throw DivByZeroException() }
     if (a == Long.MIN_VALUE && b == -1L) { throw IntOverflowException() }
-    try { return a/b }
-    catch (e: ArithmeticException) { throw DivByZeroException() }
+    return a/b
 }
 
 fun I32_REM_S(a: Int, b: Int): Int {
-    if (a == Int.MIN_VALUE && b == -1) { return 0 }
-    try { return a%b }
-    catch (e: ArithmeticException) { throw DivByZeroException() }
+    if (b == 0) { throw DivByZeroException() }
+    return a%b
 }
 fun I64_REM_S(a: Long, b: Long): Long {
-    if (a == Long.MIN_VALUE && b == -1L) { return 0L }
-    try { return a%b }
-    catch (e: ArithmeticException) { throw DivByZeroException() }
+    if (b == 0L) { throw DivByZeroException() }
+    return a%b
 }
 
 fun DIV_U(a: Int, b: Int): Int {
-    try { return java.lang.Integer.divideUnsigned(a, b) }
-    catch (e: ArithmeticException) { throw DivByZeroException() }
+    if (b == 0) { throw DivByZeroException() }
+    return java.lang.Integer.divideUnsigned(a, b)
 }
 fun DIV_U(a: Long, b: Long): Long {
-    try { return java.lang.Long.divideUnsigned(a, b) }
-    catch (e: ArithmeticException) { throw DivByZeroException() }
+    if (b == 0L) { throw DivByZeroException() }
+    return java.lang.Long.divideUnsigned(a, b)
 }
 
 fun REM_U(a: Int, b: Int): Int {
-    try { return java.lang.Integer.remainderUnsigned(a, b) }
-    catch (e: ArithmeticException) { throw DivByZeroException() }
+    if (b == 0) { throw DivByZeroException() }
+    return java.lang.Integer.remainderUnsigned(a, b)
 }
 fun REM_U(a: Long, b: Long): Long {
-    try { return java.lang.Long.remainderUnsigned(a, b) }
-    catch (e: ArithmeticException) { throw DivByZeroException() }
+    if (b == 0L) { throw DivByZeroException() }
+    return java.lang.Long.remainderUnsigned(a, b)
 }
 
 fun UIntToFloat(a: Int): Float {
@@ -615,3 +1295,319 @@ fun truncate(x: Double): Double = Double.fromBits(kotlin.math.truncate(x).toBits
 // but it doesn't hold for NaNs for some reason
 fun abs(x: Double): Double = Double.fromBits(x.toRawBits() and Long.MAX_VALUE)
 fun abs(x: Float): Float = Float.fromBits(x.toRawBits() and Int.MAX_VALUE)
+
+/**
+ * A v128 value, as its low and high 64 bits. Lane 0 is in the low bits of
+ * `lo`, like in memory.
+ */
+class V128(@JvmField val lo: Long, @JvmField val hi: Long) {
+    override fun equals(other: Any?): Boolean = other is V128 && lo == other.lo && hi == other.hi
+    override fun hashCode(): Int = (lo xor hi).hashCode()
+    override fun toString(): String = String.format("v128 0x%016x%016x", hi, lo)
+
+    companion object {
+        @JvmField val ZERO = V128(0L, 0L)
+    }
+}
+
+// lane accessors and builders for the SIMD instructions below. the builders
+// call f once per lane and keep its low bits.
+private fun V128.i8(i: Int): Int = ((if (i < 8) lo else hi) ushr ((i and 7) shl 3)).toByte().toInt()
+private fun V128.u8(i: Int): Int = i8(i) and 0xFF
+private fun V128.i16(i: Int): Int = ((if (i < 4) lo else hi) ushr ((i and 3) shl 4)).toShort().toInt()
+private fun V128.u16(i: Int): Int = i16(i) and 0xFFFF
+private fun V128.i32(i: Int): Int = ((if (i < 2) lo else hi) ushr ((i and 1) shl 5)).toInt()
+private fun V128.u32(i: Int): Long = i32(i).toLong() and 0xFFFFFFFFL
+private fun V128.i64(i: Int): Long = if (i == 0) lo else hi
+private fun V128.f32(i: Int): Float = Float.fromBits(i32(i))
+private fun V128.f64(i: Int): Double = Double.fromBits(i64(i))
+
+private inline fun v128_i8(f: (Int) -> Int): V128 {
+    var lo = 0L
+    var hi = 0L
+    for (i in 0 until 8) {
+        lo = lo or ((f(i).toLong() and 0xFFL) shl (i shl 3))
+        hi = hi or ((f(i + 8).toLong() and 0xFFL) shl (i shl 3))
+    }
+    return V128(lo, hi)
+}
+private inline fun v128_i16(f: (Int) -> Int): V128 {
+    var lo = 0L
+    var hi = 0L
+    for (i in 0 until 4) {
+        lo = lo or ((f(i).toLong() and 0xFFFFL) shl (i shl 4))
+        hi = hi or ((f(i + 4).toLong() and 0xFFFFL) shl (i shl 4))
+    }
+    return V128(lo, hi)
+}
+private inline fun v128_i32(f: (Int) -> Int): V128 =
+    V128((f(0).toLong() and 0xFFFFFFFFL) or (f(1).toLong() shl 32),
+         (f(2).toLong() and 0xFFFFFFFFL) or (f(3).toLong() shl 32))
+private inline fun v128_i64(f: (Int) -> Long): V128 = V128(f(0), f(1))
+private inline fun v128_f32(f: (Int) -> Float): V128 = v128_i32 { f(it).toRawBits() }
+private inline fun v128_f64(f: (Int) -> Double): V128 = v128_i64 { f(it).toRawBits() }
+
+private fun mask(b: Boolean): Int = if (b) -1 else 0
+private fun maskL(b: Boolean): Long = if (b) -1L else 0L
+private fun sat(x: Int, min: Int, max: Int): Int = if (x < min) min else if (x > max) max else x
+
+private fun replaceBits(v: V128, bit: Int, mask: Long, x: Long): V128 {
+    val shift = bit and 63
+    val bits = (x and mask) shl shift
+    val keep = (mask shl shift).inv()
+    return if (bit < 64) V128((v.lo and keep) or bits, v.hi) else V128(v.lo, (v.hi and keep) or bits)
+}
+
+fun i8x16_splat(x: Int): V128 = v128_i8 { x }
+fun i16x8_splat(x: Int): V128 = v128_i16 { x }
+fun i32x4_splat(x: Int): V128 = v128_i32 { x }
+fun i64x2_splat(x: Long): V128 = V128(x, x)
+fun f32x4_splat(x: Float): V128 = i32x4_splat(x.toRawBits())
+fun f64x2_splat(x: Double): V128 = i64x2_splat(x.toRawBits())
+
+fun i8x16_extract_lane_s(v: V128, lane: Int): Int = v.i8(lane)
+fun i8x16_extract_lane_u(v: V128, lane: Int): Int = v.u8(lane)
+fun i16x8_extract_lane_s(v: V128, lane: Int): Int = v.i16(lane)
+fun i16x8_extract_lane_u(v: V128, lane: Int): Int = v.u16(lane)
+fun i32x4_extract_lane(v: V128, lane: Int): Int = v.i32(lane)
+fun i64x2_extract_lane(v: V128, lane: Int): Long = v.i64(lane)
+fun f32x4_extract_lane(v: V128, lane: Int): Float = v.f32(lane)
+fun f64x2_extract_lane(v: V128, lane: Int): Double = v.f64(lane)
+
+fun i8x16_replace_lane(v: V128, x: Int, lane: Int): V128 = replaceBits(v, lane shl 3, 0xFFL, x.toLong())
+fun i16x8_replace_lane(v: V128, x: Int, lane: Int): V128 = replaceBits(v, lane shl 4, 0xFFFFL, x.toLong())
+fun i32x4_replace_lane(v: V128, x: Int, lane: Int): V128 = replaceBits(v, lane shl 5, 0xFFFFFFFFL, x.toLong())
+fun i64x2_replace_lane(v: V128, x: Long, lane: Int): V128 = if (lane == 0) V128(x, v.hi) else V128(v.lo, x)
+fun f32x4_replace_lane(v: V128, x: Float, lane: Int): V128 = i32x4_replace_lane(v, x.toRawBits(), lane)
+fun f64x2_replace_lane(v: V128, x: Double, lane: Int): V128 = i64x2_replace_lane(v, x.toRawBits(), lane)
+
+// the 16 lane indices are the bytes of lanes_lo and lanes_hi.
+fun i8x16_shuffle(a: V128, b: V128, lanes_lo: Long, lanes_hi: Long): V128 = v128_i8 {
+    val index = V128(lanes_lo, lanes_hi).u8(it)
+    if (index < 16) a.i8(index) else b.i8(index - 16)
+}
+fun i8x16_swizzle(a: V128, s: V128): V128 = v128_i8 {
+    val index = s.u8(it)
+    if (index < 16) a.i8(index) else 0
+}
+
+fun v128_not(a: V128): V128 = V128(a.lo.inv(), a.hi.inv())
+fun v128_and(a: V128, b: V128): V128 = V128(a.lo and b.lo, a.hi and b.hi)
+fun v128_andnot(a: V128, b: V128): V128 = V128(a.lo and b.lo.inv(), a.hi and b.hi.inv())
+fun v128_or(a: V128, b: V128): V128 = V128(a.lo or b.lo, a.hi or b.hi)
+fun v128_xor(a: V128, b: V128): V128 = V128(a.lo xor b.lo, a.hi xor b.hi)
+fun v128_bitselect(a: V128, b: V128, c: V128): V128 =
+    V128((a.lo and c.lo) or (b.lo and c.lo.inv()), (a.hi and c.hi) or (b.hi and c.hi.inv()))
+fun v128_any_true(a: V128): Int = ((a.lo or a.hi) != 0L).btoInt()
+
+fun i8x16_eq(a: V128, b: V128): V128 = v128_i8 { mask(a.i8(it) == b.i8(it)) }
+fun i8x16_ne(a: V128, b: V128): V128 = v128_i8 { mask(a.i8(it) != b.i8(it)) }
+fun i8x16_lt_s(a: V128, b: V128): V128 = v128_i8 { mask(a.i8(it) < b.i8(it)) }
+fun i8x16_lt_u(a: V128, b: V128): V128 = v128_i8 { mask(a.u8(it) < b.u8(it)) }
+fun i8x16_gt_s(a: V128, b: V128): V128 = v128_i8 { mask(a.i8(it) > b.i8(it)) }
+fun i8x16_gt_u(a: V128, b: V128): V128 = v128_i8 { mask(a.u8(it) > b.u8(it)) }
+fun i8x16_le_s(a: V128, b: V128): V128 = v128_i8 { mask(a.i8(it) <= b.i8(it)) }
+fun i8x16_le_u(a: V128, b: V128): V128 = v128_i8 { mask(a.u8(it) <= b.u8(it)) }
+fun i8x16_ge_s(a: V128, b: V128): V128 = v128_i8 { mask(a.i8(it) >= b.i8(it)) }
+fun i8x16_ge_u(a: V128, b: V128): V128 = v128_i8 { mask(a.u8(it) >= b.u8(it)) }
+
+fun i16x8_eq(a: V128, b: V128): V128 = v128_i16 { mask(a.i16(it) == b.i16(it)) }
+fun i16x8_ne(a: V128, b: V128): V128 = v128_i16 { mask(a.i16(it) != b.i16(it)) }
+fun i16x8_lt_s(a: V128, b: V128): V128 = v128_i16 { mask(a.i16(it) < b.i16(it)) }
+fun i16x8_lt_u(a: V128, b: V128): V128 = v128_i16 { mask(a.u16(it) < b.u16(it)) }
+fun i16x8_gt_s(a: V128, b: V128): V128 = v128_i16 { mask(a.i16(it) > b.i16(it)) }
+fun i16x8_gt_u(a: V128, b: V128): V128 = v128_i16 { mask(a.u16(it) > b.u16(it)) }
+fun i16x8_le_s(a: V128, b: V128): V128 = v128_i16 { mask(a.i16(it) <= b.i16(it)) }
+fun i16x8_le_u(a: V128, b: V128): V128 = v128_i16 { mask(a.u16(it) <= b.u16(it)) }
+fun i16x8_ge_s(a: V128, b: V128): V128 = v128_i16 { mask(a.i16(it) >= b.i16(it)) }
+fun i16x8_ge_u(a: V128, b: V128): V128 = v128_i16 { mask(a.u16(it) >= b.u16(it)) }
+
+fun i32x4_eq(a: V128, b: V128): V128 = v128_i32 { mask(a.i32(it) == b.i32(it)) }
+fun i32x4_ne(a: V128, b: V128): V128 = v128_i32 { mask(a.i32(it) != b.i32(it)) }
+fun i32x4_lt_s(a: V128, b: V128): V128 = v128_i32 { mask(a.i32(it) < b.i32(it)) }
+fun i32x4_lt_u(a: V128, b: V128): V128 = v128_i32 { mask(a.u32(it) < b.u32(it)) }
+fun i32x4_gt_s(a: V128, b: V128): V128 = v128_i32 { mask(a.i32(it) > b.i32(it)) }
+fun i32x4_gt_u(a: V128, b: V128): V128 = v128_i32 { mask(a.u32(it) > b.u32(it)) }
+fun i32x4_le_s(a: V128, b: V128): V128 = v128_i32 { mask(a.i32(it) <= b.i32(it)) }
+fun i32x4_le_u(a: V128, b: V128): V128 = v128_i32 { mask(a.u32(it) <= b.u32(it)) }
+fun i32x4_ge_s(a: V128, b: V128): V128 = v128_i32 { mask(a.i32(it) >= b.i32(it)) }
+fun i32x4_ge_u(a: V128, b: V128): V128 = v128_i32 { mask(a.u32(it) >= b.u32(it)) }
+
+fun i64x2_eq(a: V128, b: V128): V128 = v128_i64 { maskL(a.i64(it) == b.i64(it)) }
+fun i64x2_ne(a: V128, b: V128): V128 = v128_i64 { maskL(a.i64(it) != b.i64(it)) }
+fun i64x2_lt_s(a: V128, b: V128): V128 = v128_i64 { maskL(a.i64(it) < b.i64(it)) }
+fun i64x2_gt_s(a: V128, b: V128): V128 = v128_i64 { maskL(a.i64(it) > b.i64(it)) }
+fun i64x2_le_s(a: V128, b: V128): V128 = v128_i64 { maskL(a.i64(it) <= b.i64(it)) }
+fun i64x2_ge_s(a: V128, b: V128): V128 = v128_i64 { maskL(a.i64(it) >= b.i64(it)) }
+
+fun f32x4_eq(a: V128, b: V128): V128 = v128_i32 { mask(a.f32(it) == b.f32(it)) }
+fun f32x4_ne(a: V128, b: V128): V128 = v128_i32 { mask(a.f32(it) != b.f32(it)) }
+fun f32x4_lt(a: V128, b: V128): V128 = v128_i32 { mask(a.f32(it) < b.f32(it)) }
+fun f32x4_gt(a: V128, b: V128): V128 = v128_i32 { mask(a.f32(it) > b.f32(it)) }
+fun f32x4_le(a: V128, b: V128): V128 = v128_i32 { mask(a.f32(it) <= b.f32(it)) }
+fun f32x4_ge(a: V128, b: V128): V128 = v128_i32 { mask(a.f32(it) >= b.f32(it)) }
+
+fun f64x2_eq(a: V128, b: V128): V128 = v128_i64 { maskL(a.f64(it) == b.f64(it)) }
+fun f64x2_ne(a: V128, b: V128): V128 = v128_i64 { maskL(a.f64(it) != b.f64(it)) }
+fun f64x2_lt(a: V128, b: V128): V128 = v128_i64 { maskL(a.f64(it) < b.f64(it)) }
+fun f64x2_gt(a: V128, b: V128): V128 = v128_i64 { maskL(a.f64(it) > b.f64(it)) }
+fun f64x2_le(a: V128, b: V128): V128 = v128_i64 { maskL(a.f64(it) <= b.f64(it)) }
+fun f64x2_ge(a: V128, b: V128): V128 = v128_i64 { maskL(a.f64(it) >= b.f64(it)) }
+
+fun i8x16_abs(a: V128): V128 = v128_i8 { kotlin.math.abs(a.i8(it)) }
+fun i8x16_neg(a: V128): V128 = v128_i8 { -a.i8(it) }
+fun i8x16_popcnt(a: V128): V128 = v128_i8 { a.u8(it).countOneBits() }
+fun i8x16_all_true(a: V128): Int = (0 until 16).all { a.i8(it) != 0 }.btoInt()
+fun i8x16_bitmask(a: V128): Int {
+    var result = 0
+    for (i in 0 until 16) { result = result or ((a.u8(i) ushr 7) shl i) }
+    return result
+}
+fun i8x16_narrow_i16x8_s(a: V128, b: V128): V128 = v128_i8 { sat(if (it < 8) a.i16(it) else b.i16(it - 8), -128, 127) }
+fun i8x16_narrow_i16x8_u(a: V128, b: V128): V128 = v128_i8 { sat(if (it < 8) a.i16(it) else b.i16(it - 8), 0, 255) }
+fun i8x16_shl(a: V128, s: Int): V128 = v128_i8 { a.i8(it) shl (s and 7) }
+fun i8x16_shr_s(a: V128, s: Int): V128 = v128_i8 { a.i8(it) shr (s and 7) }
+fun i8x16_shr_u(a: V128, s: Int): V128 = v128_i8 { a.u8(it) ushr (s and 7) }
+fun i8x16_add(a: V128, b: V128): V128 = v128_i8 { a.i8(it) + b.i8(it) }
+fun i8x16_add_sat_s(a: V128, b: V128): V128 = v128_i8 { sat(a.i8(it) + b.i8(it), -128, 127) }
+fun i8x16_add_sat_u(a: V128, b: V128): V128 = v128_i8 { sat(a.u8(it) + b.u8(it), 0, 255) }
+fun i8x16_sub(a: V128, b: V128): V128 = v128_i8 { a.i8(it) - b.i8(it) }
+fun i8x16_sub_sat_s(a: V128, b: V128): V128 = v128_i8 { sat(a.i8(it) - b.i8(it), -128, 127) }
+fun i8x16_sub_sat_u(a: V128, b: V128): V128 = v128_i8 { sat(a.u8(it) - b.u8(it), 0, 255) }
+fun i8x16_min_s(a: V128, b: V128): V128 = v128_i8 { kotlin.math.min(a.i8(it), b.i8(it)) }
+fun i8x16_min_u(a: V128, b: V128): V128 = v128_i8 { kotlin.math.min(a.u8(it), b.u8(it)) }
+fun i8x16_max_s(a: V128, b: V128): V128 = v128_i8 { kotlin.math.max(a.i8(it), b.i8(it)) }
+fun i8x16_max_u(a: V128, b: V128): V128 = v128_i8 { kotlin.math.max(a.u8(it), b.u8(it)) }
+fun i8x16_avgr_u(a: V128, b: V128): V128 = v128_i8 { (a.u8(it) + b.u8(it) + 1) ushr 1 }
+
+fun i16x8_extadd_pairwise_i8x16_s(a: V128): V128 = v128_i16 { a.i8(2 * it) + a.i8(2 * it + 1) }
+fun i16x8_extadd_pairwise_i8x16_u(a: V128): V128 = v128_i16 { a.u8(2 * it) + a.u8(2 * it + 1) }
+fun i32x4_extadd_pairwise_i16x8_s(a: V128): V128 = v128_i32 { a.i16(2 * it) + a.i16(2 * it + 1) }
+fun i32x4_extadd_pairwise_i16x8_u(a: V128): V128 = v128_i32 { a.u16(2 * it) + a.u16(2 * it + 1) }
+
+fun i16x8_abs(a: V128): V128 = v128_i16 { kotlin.math.abs(a.i16(it)) }
+fun i16x8_neg(a: V128): V128 = v128_i16 { -a.i16(it) }
+fun i16x8_q15mulr_sat_s(a: V128, b: V128): V128 = v128_i16 { sat((a.i16(it) * b.i16(it) + 0x4000) shr 15, -32768, 32767) }
+fun i16x8_all_true(a: V128): Int = (0 until 8).all { a.i16(it) != 0 }.btoInt()
+fun i16x8_bitmask(a: V128): Int {
+    var result = 0
+    for (i in 0 until 8) { result = result or ((a.u16(i) ushr 15) shl i) }
+    return result
+}
+fun i16x8_narrow_i32x4_s(a: V128, b: V128): V128 = v128_i16 { sat(if (it < 4) a.i32(it) else b.i32(it - 4), -32768, 32767) }
+fun i16x8_narrow_i32x4_u(a: V128, b: V128): V128 = v128_i16 { sat(if (it < 4) a.i32(it) else b.i32(it - 4), 0, 65535) }
+fun i16x8_extend_low_i8x16_s(a: V128): V128 = v128_i16 { a.i8(it) }
+fun i16x8_extend_high_i8x16_s(a: V128): V128 = v128_i16 { a.i8(it + 8) }
+fun i16x8_extend_low_i8x16_u(a: V128): V128 = v128_i16 { a.u8(it) }
+fun i16x8_extend_high_i8x16_u(a: V128): V128 = v128_i16 { a.u8(it + 8) }
+fun i16x8_shl(a: V128, s: Int): V128 = v128_i16 { a.i16(it) shl (s and 15) }
+fun i16x8_shr_s(a: V128, s: Int): V128 = v128_i16 { a.i16(it) shr (s and 15) }
+fun i16x8_shr_u(a: V128, s: Int): V128 = v128_i16 { a.u16(it) ushr (s and 15) }
+fun i16x8_add(a: V128, b: V128): V128 = v128_i16 { a.i16(it) + b.i16(it) }
+fun i16x8_add_sat_s(a: V128, b: V128): V128 = v128_i16 { sat(a.i16(it) + b.i16(it), -32768, 32767) }
+fun i16x8_add_sat_u(a: V128, b: V128): V128 = v128_i16 { sat(a.u16(it) + b.u16(it), 0, 65535) }
+fun i16x8_sub(a: V128, b: V128): V128 = v128_i16 { a.i16(it) - b.i16(it) }
+fun i16x8_sub_sat_s(a: V128, b: V128): V128 = v128_i16 { sat(a.i16(it) - b.i16(it), -32768, 32767) }
+fun i16x8_sub_sat_u(a: V128, b: V128): V128 = v128_i16 { sat(a.u16(it) - b.u16(it), 0, 65535) }
+fun i16x8_mul(a: V128, b: V128): V128 = v128_i16 { a.i16(it) * b.i16(it) }
+fun i16x8_min_s(a: V128, b: V128): V128 = v128_i16 { kotlin.math.min(a.i16(it), b.i16(it)) }
+fun i16x8_min_u(a: V128, b: V128): V128 = v128_i16 { kotlin.math.min(a.u16(it), b.u16(it)) }
+fun i16x8_max_s(a: V128, b: V128): V128 = v128_i16 { kotlin.math.max(a.i16(it), b.i16(it)) }
+fun i16x8_max_u(a: V128, b: V128): V128 = v128_i16 { kotlin.math.max(a.u16(it), b.u16(it)) }
+fun i16x8_avgr_u(a: V128, b: V128): V128 = v128_i16 { (a.u16(it) + b.u16(it) + 1) ushr 1 }
+fun i16x8_extmul_low_i8x16_s(a: V128, b: V128): V128 = v128_i16 { a.i8(it) * b.i8(it) }
+fun i16x8_extmul_high_i8x16_s(a: V128, b: V128): V128 = v128_i16 { a.i8(it + 8) * b.i8(it + 8) }
+fun i16x8_extmul_low_i8x16_u(a: V128, b: V128): V128 = v128_i16 { a.u8(it) * b.u8(it) }
+fun i16x8_extmul_high_i8x16_u(a: V128, b: V128): V128 = v128_i16 { a.u8(it + 8) * b.u8(it + 8) }
+
+fun i32x4_abs(a: V128): V128 = v128_i32 { kotlin.math.abs(a.i32(it)) }
+fun i32x4_neg(a: V128): V128 = v128_i32 { -a.i32(it) }
+fun i32x4_all_true(a: V128): Int = (0 until 4).all { a.i32(it) != 0 }.btoInt()
+fun i32x4_bitmask(a: V128): Int {
+    var result = 0
+    for (i in 0 until 4) { result = result or ((a.i32(i) ushr 31) shl i) }
+    return result
+}
+fun i32x4_extend_low_i16x8_s(a: V128): V128 = v128_i32 { a.i16(it) }
+fun i32x4_extend_high_i16x8_s(a: V128): V128 = v128_i32 { a.i16(it + 4) }
+fun i32x4_extend_low_i16x8_u(a: V128): V128 = v128_i32 { a.u16(it) }
+fun i32x4_extend_high_i16x8_u(a: V128): V128 = v128_i32 { a.u16(it + 4) }
+fun i32x4_shl(a: V128, s: Int): V128 = v128_i32 { a.i32(it) shl s }
+fun i32x4_shr_s(a: V128, s: Int): V128 = v128_i32 { a.i32(it) shr s }
+fun i32x4_shr_u(a: V128, s: Int): V128 = v128_i32 { a.i32(it) ushr s }
+fun i32x4_add(a: V128, b: V128): V128 = v128_i32 { a.i32(it) + b.i32(it) }
+fun i32x4_sub(a: V128, b: V128): V128 = v128_i32 { a.i32(it) - b.i32(it) }
+fun i32x4_mul(a: V128, b: V128): V128 = v128_i32 { a.i32(it) * b.i32(it) }
+fun i32x4_min_s(a: V128, b: V128): V128 = v128_i32 { kotlin.math.min(a.i32(it), b.i32(it)) }
+fun i32x4_min_u(a: V128, b: V128): V128 = v128_i32 { if (a.u32(it) < b.u32(it)) a.i32(it) else b.i32(it) }
+fun i32x4_max_s(a: V128, b: V128): V128 = v128_i32 { kotlin.math.max(a.i32(it), b.i32(it)) }
+fun i32x4_max_u(a: V128, b: V128): V128 = v128_i32 { if (a.u32(it) > b.u32(it)) a.i32(it) else b.i32(it) }
+fun i32x4_dot_i16x8_s(a: V128, b: V128): V128 = v128_i32 { a.i16(2 * it) * b.i16(2 * it) + a.i16(2 * it + 1) * b.i16(2 * it + 1) }
+fun i32x4_extmul_low_i16x8_s(a: V128, b: V128): V128 = v128_i32 { a.i16(it) * b.i16(it) }
+fun i32x4_extmul_high_i16x8_s(a: V128, b: V128): V128 = v128_i32 { a.i16(it + 4) * b.i16(it + 4) }
+fun i32x4_extmul_low_i16x8_u(a: V128, b: V128): V128 = v128_i32 { a.u16(it) * b.u16(it) }
+fun i32x4_extmul_high_i16x8_u(a: V128, b: V128): V128 = v128_i32 { a.u16(it + 4) * b.u16(it + 4) }
+
+fun i64x2_abs(a: V128): V128 = v128_i64 { kotlin.math.abs(a.i64(it)) }
+fun i64x2_neg(a: V128): V128 = v128_i64 { -a.i64(it) }
+fun i64x2_all_true(a: V128): Int = (a.lo != 0L && a.hi != 0L).btoInt()
+fun i64x2_bitmask(a: V128): Int = (a.lo ushr 63).toInt() or ((a.hi ushr 63).toInt() shl 1)
+fun i64x2_extend_low_i32x4_s(a: V128): V128 = v128_i64 { a.i32(it).toLong() }
+fun i64x2_extend_high_i32x4_s(a: V128): V128 = v128_i64 { a.i32(it + 2).toLong() }
+fun i64x2_extend_low_i32x4_u(a: V128): V128 = v128_i64 { a.u32(it) }
+fun i64x2_extend_high_i32x4_u(a: V128): V128 = v128_i64 { a.u32(it + 2) }
+fun i64x2_shl(a: V128, s: Int): V128 = v128_i64 { a.i64(it) shl s }
+fun i64x2_shr_s(a: V128, s: Int): V128 = v128_i64 { a.i64(it) shr s }
+fun i64x2_shr_u(a: V128, s: Int): V128 = v128_i64 { a.i64(it) ushr s }
+fun i64x2_add(a: V128, b: V128): V128 = v128_i64 { a.i64(it) + b.i64(it) }
+fun i64x2_sub(a: V128, b: V128): V128 = v128_i64 { a.i64(it) - b.i64(it) }
+fun i64x2_mul(a: V128, b: V128): V128 = v128_i64 { a.i64(it) * b.i64(it) }
+fun i64x2_extmul_low_i32x4_s(a: V128, b: V128): V128 = v128_i64 { a.i32(it).toLong() * b.i32(it).toLong() }
+fun i64x2_extmul_high_i32x4_s(a: V128, b: V128): V128 = v128_i64 { a.i32(it + 2).toLong() * b.i32(it + 2).toLong() }
+fun i64x2_extmul_low_i32x4_u(a: V128, b: V128): V128 = v128_i64 { a.u32(it) * b.u32(it) }
+fun i64x2_extmul_high_i32x4_u(a: V128, b: V128): V128 = v128_i64 { a.u32(it + 2) * b.u32(it + 2) }
+
+fun f32x4_ceil(a: V128): V128 = v128_f32 { ceil(a.f32(it)) }
+fun f32x4_floor(a: V128): V128 = v128_f32 { floor(a.f32(it)) }
+fun f32x4_trunc(a: V128): V128 = v128_f32 { truncate(a.f32(it)) }
+fun f32x4_nearest(a: V128): V128 = v128_f32 { kotlin.math.round(a.f32(it)) }
+fun f64x2_ceil(a: V128): V128 = v128_f64 { ceil(a.f64(it)) }
+fun f64x2_floor(a: V128): V128 = v128_f64 { floor(a.f64(it)) }
+fun f64x2_trunc(a: V128): V128 = v128_f64 { truncate(a.f64(it)) }
+fun f64x2_nearest(a: V128): V128 = v128_f64 { kotlin.math.round(a.f64(it)) }
+
+fun f32x4_abs(a: V128): V128 = V128(a.lo and 0x7FFFFFFF7FFFFFFFL, a.hi and 0x7FFFFFFF7FFFFFFFL)
+fun f32x4_neg(a: V128): V128 = V128(a.lo xor -0x7FFFFFFF80000000L, a.hi xor -0x7FFFFFFF80000000L)
+fun f32x4_sqrt(a: V128): V128 = v128_f32 { kotlin.math.sqrt(a.f32(it)) }
+fun f32x4_add(a: V128, b: V128): V128 = v128_f32 { a.f32(it) + b.f32(it) }
+fun f32x4_sub(a: V128, b: V128): V128 = v128_f32 { a.f32(it) - b.f32(it) }
+fun f32x4_mul(a: V128, b: V128): V128 = v128_f32 { a.f32(it) * b.f32(it) }
+fun f32x4_div(a: V128, b: V128): V128 = v128_f32 { a.f32(it) / b.f32(it) }
+fun f32x4_min(a: V128, b: V128): V128 = v128_f32 { MIN(a.f32(it), b.f32(it)) }
+fun f32x4_max(a: V128, b: V128): V128 = v128_f32 { MAX(a.f32(it), b.f32(it)) }
+fun f32x4_pmin(a: V128, b: V128): V128 = v128_i32 { if (b.f32(it) < a.f32(it)) b.i32(it) else a.i32(it) }
+fun f32x4_pmax(a: V128, b: V128): V128 = v128_i32 { if (a.f32(it) < b.f32(it)) b.i32(it) else a.i32(it) }
+
+fun f64x2_abs(a: V128): V128 = V128(a.lo and Long.MAX_VALUE, a.hi and Long.MAX_VALUE)
+fun f64x2_neg(a: V128): V128 = V128(a.lo xor Long.MIN_VALUE, a.hi xor Long.MIN_VALUE)
+fun f64x2_sqrt(a: V128): V128 = v128_f64 { kotlin.math.sqrt(a.f64(it)) }
+fun f64x2_add(a: V128, b: V128): V128 = v128_f64 { a.f64(it) + b.f64(it) }
+fun f64x2_sub(a: V128, b: V128): V128 = v128_f64 { a.f64(it) - b.f64(it) }
+fun f64x2_mul(a: V128, b: V128): V128 = v128_f64 { a.f64(it) * b.f64(it) }
+fun f64x2_div(a: V128, b: V128): V128 = v128_f64 { a.f64(it) / b.f64(it) }
+fun f64x2_min(a: V128, b: V128): V128 = v128_f64 { MIN(a.f64(it), b.f64(it)) }
+fun f64x2_max(a: V128, b: V128): V128 = v128_f64 { MAX(a.f64(it), b.f64(it)) }
+fun f64x2_pmin(a: V128, b: V128): V128 = v128_i64 { if (b.f64(it) < a.f64(it)) b.i64(it) else a.i64(it) }
+fun f64x2_pmax(a: V128, b: V128): V128 = v128_i64 { if (a.f64(it) < b.f64(it)) b.i64(it) else a.i64(it) }
+
+fun f32x4_demote_f64x2_zero(a: V128): V128 = v128_f32 { if (it < 2) a.f64(it).toFloat() else 0f }
+fun f64x2_promote_low_f32x4(a: V128): V128 = v128_f64 { a.f32(it).toDouble() }
+// Float.toInt() and Double.toInt() already saturate and turn NaN into 0.
+fun i32x4_trunc_sat_f32x4_s(a: V128): V128 = v128_i32 { a.f32(it).toInt() }
+fun i32x4_trunc_sat_f32x4_u(a: V128): V128 = v128_i32 { I32_TRUNC_SAT_U_F32(a.f32(it)) }
+fun f32x4_convert_i32x4_s(a: V128): V128 = v128_f32 { a.i32(it).toFloat() }
+fun f32x4_convert_i32x4_u(a: V128): V128 = v128_f32 { UIntToFloat(a.i32(it)) }
+fun i32x4_trunc_sat_f64x2_s_zero(a: V128): V128 = v128_i32 { if (it < 2) a.f64(it).toInt() else 0 }
+fun i32x4_trunc_sat_f64x2_u_zero(a: V128): V128 = v128_i32 { if (it < 2) I32_TRUNC_SAT_U_F64(a.f64(it)) else 0 }
+fun f64x2_convert_low_i32x4_s(a: V128): V128 = v128_f64 { a.i32(it).toDouble() }
+fun f64x2_convert_low_i32x4_u(a: V128): V128 = v128_f64 { UIntToDouble(a.i32(it)) }